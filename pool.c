@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// Take the newest task of a worker's own deque
+int W_Pop(Worker *worker, Task *task)
+{
+	int ok = 0;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head < worker->tail) {
+		*task = worker->task[--worker->tail];
+		ok = 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return ok;
+}
+
+// Take the oldest task of another worker
+int W_Steal(Worker *victim, Task *task)
+{
+	int ok = 0;
+
+	pthread_mutex_lock(&victim->lock);
+	if (victim->head < victim->tail) {
+		*task = victim->task[victim->head++];
+		ok = 1;
+	}
+	pthread_mutex_unlock(&victim->lock);
+
+	return ok;
+}
+
+// Run one task, our own or a stolen one.
+// Returns 0 if there was none to run.
+int W_RunOne(Worker *worker)
+{
+	Pool *pool = worker->pool;
+	Task task;
+	int found = W_Pop(worker, &task);
+
+	for (int ii = 1; !found && ii < pool->nworker; ii++) {
+		found = W_Steal(&pool->worker[(worker->id + ii) % pool->nworker], &task);
+	}
+	if (!found) {
+		return 0;
+	}
+
+	task.run(worker, task.arg);
+	__atomic_fetch_sub(task.group, 1, __ATOMIC_ACQ_REL);
+
+	return 1;
+}
+
+void *W_Main(void *arg)
+{
+	Worker *worker = arg;
+	Pool *pool = worker->pool;
+
+	for (;;) {
+		if (__atomic_load_n(&pool->running, __ATOMIC_ACQUIRE)) {
+			if (!W_RunOne(worker)) {
+				sched_yield();
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->running && !pool->quit) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->quit) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+// A pool of nthread threads, counting the caller of W_Run. nthread <= 0
+// means one per online processor.
+Pool *W_New(int nthread)
+{
+	Pool *pool = calloc(1, sizeof(Pool));
+
+	if (nthread <= 0) {
+		nthread = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthread <= 0) {
+		nthread = 1;
+	}
+	if (pool == NULL || (pool->worker = calloc(nthread, sizeof(Worker))) == NULL) {
+		fprintf(stderr, "BUG: W_New: no memory\n");
+		exit(1);
+	}
+
+	pool->nworker = nthread;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+
+	for (int ii = 0; ii < nthread; ii++) {
+		Worker *worker = &pool->worker[ii];
+		worker->pool = pool;
+		worker->id = ii;
+		pthread_mutex_init(&worker->lock, NULL);
+	}
+	for (int ii = 1; ii < nthread; ii++) {
+		if (pthread_create(&pool->worker[ii].thread, NULL, W_Main, &pool->worker[ii]) != 0) {
+			fprintf(stderr, "BUG: W_New: cannot start thread\n");
+			exit(1);
+		}
+	}
+
+	return pool;
+}
+
+// Run a task and everything it spawns, and return when all are done.
+// Not to be called from inside a task.
+void W_Run(Pool *pool, PoolTask run, void *arg)
+{
+	assert(pool);
+	assert(run);
+
+	Worker *caller = &pool->worker[0];
+	int group = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->running, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	W_Spawn(caller, run, arg, &group);
+	W_Wait(caller, &group);
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void W_Spawn(Worker *worker, PoolTask run, void *arg, int *group)
+{
+	assert(worker);
+	assert(run);
+	assert(group);
+
+	__atomic_fetch_add(group, 1, __ATOMIC_ACQ_REL);
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head == worker->tail) {
+		worker->head = worker->tail = 0;
+	}
+	if (worker->tail == worker->max) {
+		int newmax = worker->max ? worker->max * 2 : 64;
+		Task *task = realloc(worker->task, newmax * sizeof(Task));
+		if (task == NULL) {
+			fprintf(stderr, "BUG: W_Spawn: no memory\n");
+			exit(1);
+		}
+		worker->task = task;
+		worker->max = newmax;
+	}
+	worker->task[worker->tail].run = run;
+	worker->task[worker->tail].arg = arg;
+	worker->task[worker->tail].group = group;
+	worker->tail++;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+// Run tasks, ours first, until every task in group has returned
+void W_Wait(Worker *worker, int *group)
+{
+	assert(worker);
+	assert(group);
+
+	while (__atomic_load_n(group, __ATOMIC_ACQUIRE) > 0) {
+		if (!W_RunOne(worker)) {
+			sched_yield();
+		}
+	}
+}
+
+void W_Free(Pool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int ii = 1; ii < pool->nworker; ii++) {
+		pthread_join(pool->worker[ii].thread, NULL);
+	}
+	for (int ii = 0; ii < pool->nworker; ii++) {
+		pthread_mutex_destroy(&pool->worker[ii].lock);
+		free(pool->worker[ii].task);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	free(pool->worker);
+	free(pool);
+}
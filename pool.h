@@ -0,0 +1,53 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+// A fixed set of threads running tasks that may spawn further tasks.
+//
+// Each worker keeps its own deque. A worker runs its newest task first
+// and, when it has none, steals the oldest task of another worker, which
+// is usually the largest piece of work left. The thread calling W_Run is
+// worker 0, so a pool of one thread runs everything on the caller.
+//
+// Tasks are counted in groups: W_Spawn adds one to a group and the group
+// drops by one when the task returns. W_Wait runs tasks until a group
+// reaches zero.
+
+typedef struct tPool Pool;
+typedef struct tWorker Worker;
+typedef struct tTask Task;
+
+typedef void (*PoolTask)(Worker *worker, void *arg);
+
+struct tTask {
+	PoolTask run;
+	void *arg;
+	int *group;
+};
+
+struct tWorker {
+	Pool *pool;
+	int id;			// 0 .. nworker - 1
+	pthread_t thread;
+	pthread_mutex_t lock;
+	Task *task;		// deque, oldest at head, newest at tail - 1
+	int head, tail, max;
+};
+
+struct tPool {
+	int nworker;
+	Worker *worker;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int running;		// a W_Run is in progress, workers look for tasks
+	int quit;
+};
+
+Pool *W_New(int nthread);
+void W_Run(Pool *pool, PoolTask run, void *arg);
+void W_Spawn(Worker *worker, PoolTask run, void *arg, int *group);
+void W_Wait(Worker *worker, int *group);
+void W_Free(Pool *pool);
+
+#endif // POOL_H
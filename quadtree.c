@@ -1,374 +1,5281 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
 
 #include "quadtree.h"
+#include "scan.h"
 
-Geom *P_New(float xf, float yf, float zf)
+// Links that readers of a shared tree follow are read and written with
+// these, so a reader sees a published quad complete
+#define LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define PUBLISH(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+#ifdef QUAD_TRACE
+
+Trace *Trace_List;		// every thread's trace, newest first
+__thread Trace *Trace_Mine;
+__thread int Trace_Depth;	// nodes descended through by this add or find
+__thread unsigned Trace_Tick;	// adds and finds begun, for sampling
+
+Trace *Trace_Get(void)
 {
-	Geom *geom = calloc(1, sizeof(Geom));
-	assert(geom);
+	Trace *trace = Trace_Mine;
 
-	geom->tag = GEOM_POINT;
+	if (trace == NULL) {
+		if ((trace = calloc(1, sizeof(Trace))) == NULL) {
+			fprintf(stderr, "BUG: Trace_Get: no memory\n");
+			exit(1);
+		}
+		// on failure trace->next is loaded with the newer head
+		trace->next = __atomic_load_n(&Trace_List, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&Trace_List, &trace->next, trace, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+		Trace_Mine = trace;
+	}
 
-	Pt *pt = &geom->pt;
-	pt->xf = xf;
-	pt->yf = yf;
-	pt->zf = zf;
+	return trace;
+}
 
-	return geom;
+uint64_t Trace_Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
 }
 
-void Q_Init(Quad *quad, int tag, int left, int top, int width, int height)
+int Trace_Bin(uint64_t val)
 {
-	assert(quad);
+	int bin = val ? 63 - __builtin_clzll(val) : 0;
 
-	quad->tag = tag;
-	quad->left = left;
-	quad->top = top;
-	quad->width = width;
-	quad->height = height;
+	return bin < TRACEBINS ? bin : TRACEBINS - 1;
 }
 
-Quad *L_New(int left, int top, int width, int height)
+// Only this thread writes its bins, so a plain increment will do. The
+// stores are atomic so readers see whole values.
+void Trace_Bump(long *bin)
 {
-	Quad *quad = calloc(1, sizeof(Quad));
-	assert(quad);
+	__atomic_store_n(bin, __atomic_load_n(bin, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
 
-	Q_Init(quad, QUAD_LEAF, left, top, width, height);
+// The start of an add or find, 0 unless it is one of the sampled ones
+uint64_t Trace_Begin(void)
+{
+	Trace_Depth = 0;
+	return ++Trace_Tick % TRACESAMPLE ? 0 : Trace_Now();
+}
 
-	Leaf *leaf = &quad->leaf;
+void Trace_End(int op, uint64_t start)
+{
+	Trace *trace = Trace_Get();
+
+	if (op <= TRACE_FIND) {
+		Trace_Bump(&trace->depth[op][Trace_Bin(Trace_Depth)]);
+	}
+	if (start) {
+		Trace_Bump(&trace->ns[op][Trace_Bin(Trace_Now() - start)]);
+	}
+}
 
-	leaf->geom = calloc(LEAFMINSIZE, sizeof(Geom *));
-	assert(leaf->geom);
+void Trace_Scan(int cnt)
+{
+	Trace_Bump(&Trace_Get()->scan[Trace_Bin(cnt)]);
+}
 
-	leaf->size = LEAFMINSIZE;
+// Call visit with the trace of every thread that has traced anything
+void Trace_Each(TraceVisit visit, void *arg)
+{
+	assert(visit);
 
-	return quad;
+	for (Trace *trace = __atomic_load_n(&Trace_List, __ATOMIC_ACQUIRE); trace; trace = trace->next) {
+		visit(trace, arg);
+	}
 }
 
-Quad *N_New(int left, int top, int width, int height)
+void Trace_Add(Trace *trace, void *arg)
 {
-	Quad *quad = calloc(1, sizeof(Quad));
-	assert(quad);
+	Trace *sum = arg;
+	long *from = &trace->ns[0][0], *to = &sum->ns[0][0];
+	int nbin = (sizeof(Trace) - offsetof(Trace, ns)) / sizeof(long);
 
-	Q_Init(quad, QUAD_NODE, left, top, width, height);
+	for (int ii = 0; ii < nbin; ii++) {
+		to[ii] += __atomic_load_n(&from[ii], __ATOMIC_RELAXED);
+	}
+}
 
-	return quad;
+// The histograms of every thread added up
+void Trace_Sum(Trace *sum)
+{
+	assert(sum);
+
+	memset(sum, 0, sizeof(Trace));
+	Trace_Each(Trace_Add, sum);
+}
+
+void Trace_Print(char *op, char *what, long *bins)
+{
+	printf("trace %s %s", op, what);
+	for (int ii = 0; ii < TRACEBINS; ii++) {
+		if (bins[ii]) {
+			printf(" %d:%ld", ii, bins[ii]);
+		}
+	}
+	printf("\n");
 }
 
-#define LEAFMINSIZE 10
+// Print the summed histograms, one per line as
+//
+//	trace <op> <ns|depth|scan> <bin>:<count> ...
+//
+// listing only the bins that counted something.
+void Trace_Dump(void)
+{
+	char *names[TRACE_LAST] = { "add", "find", "split", "grow" };
+	Trace sum;
 
-void QL_Resize(Quad *quad, int newsize)
+	Trace_Sum(&sum);
+	for (int op = 0; op < TRACE_LAST; op++) {
+		Trace_Print(names[op], "ns", sum.ns[op]);
+	}
+	Trace_Print(names[TRACE_ADD], "depth", sum.depth[TRACE_ADD]);
+	Trace_Print(names[TRACE_FIND], "depth", sum.depth[TRACE_FIND]);
+	Trace_Print(names[TRACE_FIND], "scan", sum.scan);
+}
+
+#define TRACE_BEGIN(var) uint64_t var = Trace_Begin()
+#define TRACE_START(var) uint64_t var = Trace_Now()
+#define TRACE_END(op, var) Trace_End(op, var)
+#define TRACE_DESCEND() Trace_Depth++
+#define TRACE_SCAN(cnt) Trace_Scan(cnt)
+
+#else
+
+#define TRACE_BEGIN(var)
+#define TRACE_START(var)
+#define TRACE_END(op, var)
+#define TRACE_DESCEND()
+#define TRACE_SCAN(cnt)
+
+#endif // QUAD_TRACE
+
+void A_Init(Arena *arena)
 {
-	assert(quad);
-	assert(quad->tag == QUAD_SMALL);
+	assert(arena);
 
-	Leaf *leaf = &quad->leaf;
-	Geom **newgeom;
+	memset(arena, 0, sizeof(Arena));
+}
+
+// Size classes go up in steps of 16 bytes to 128, then in quarters of
+// each power of two: 160, 192, 224, 256, 320 and so on. Blocks stay a
+// multiple of 16, and quads, geoms and leaf blocks waste at most a fifth.
+#define ARENAFINE 8
 
-	if (newsize < LEAFMINSIZE) {
-		newsize = LEAFMINSIZE;
+// Size of the blocks of a class
+size_t A_Size(int cls)
+{
+	if (cls < ARENAFINE) {
+		return (size_t) 16 * (cls + 1);
 	}
 
-	if ((newgeom = calloc(newsize, sizeof(Geom *))) == NULL) {
-		fprintf(stderr, "BUG: QL_Resize: no memory\n");
-		exit(1);
+	int power = (cls - ARENAFINE) / 4, quarter = (cls - ARENAFINE) % 4;
+
+	return ((size_t) 128 << power) + ((size_t) 32 << power) * (quarter + 1);
+}
+
+// Size class of a block: the smallest class of at least size bytes
+int A_Class(size_t size)
+{
+	if (size <= 128) {
+		return size <= 16 ? 0 : (int) ((size + 15) / 16) - 1;
 	}
 
-	if (leaf->size) {
-		assert(leaf->geom);
-		memcpy(newgeom, leaf->geom, leaf->full * sizeof(Geom *));
-		free(leaf->geom);
+	int cls = ARENAFINE;
+	size_t base = 128;
+
+	while (base * 2 < size) {
+		base *= 2;
+		cls += 4;
 	}
+	// base < size <= 2 * base, in quarters of base
+	cls += (int) ((size - base + base / 4 - 1) / (base / 4)) - 1;
+	assert(cls < ARENACLASSES);
 
-	leaf->geom = newgeom;
-	leaf->size = newsize;
+	return cls;
 }
 
-void QL_Grow(Quad *quad)
+// chunk headers are padded so that blocks stay 16 byte aligned
+#define CHUNKHEAD ((sizeof(Chunk) + 15) & ~(size_t) 15)
+
+Chunk *A_Chunk(Arena *arena, size_t size)
 {
-	assert(quad);
-	assert(quad->tag == QUAD_SMALL);
+	assert(arena);
 
-	Leaf *leaf = &quad->leaf;
-	QL_Resize(quad, leaf->size * 3 / 2);
+	Chunk *chunk = malloc(CHUNKHEAD + size);
+
+	if (chunk == NULL) {
+		fprintf(stderr, "BUG: A_Chunk: no memory\n");
+		exit(1);
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	arena->bytes += CHUNKHEAD + size;
+
+	return chunk;
 }
 
-void QL_Add(Quad *quad, Geom *geom);
+void A_Carve(Arena *arena, Chunk *chunk)
+{
+	arena->chunk = chunk;
+	arena->next = (char *) chunk + CHUNKHEAD;
+	arena->end = arena->next + chunk->size;
+}
 
-void QL_SplitSmall(Quad *quad)
+// Returns zeroed memory, like calloc
+void *A_Alloc(Arena *arena, size_t size)
 {
-	assert(quad);
-	assert(quad->tag == QUAD_LEAF);
+	assert(arena);
+
+	int cls = A_Class(size);
+	size_t csize = A_Size(cls);
+	void *ptr;
+
+	if ((ptr = arena->free[cls]) != NULL) {
+		arena->free[cls] = *(void **) ptr;
+	}
+	else if (csize > ARENACHUNK / 4) {
+		Chunk *chunk = A_Chunk(arena, csize);
+		chunk->next = arena->large;
+		arena->large = chunk;
+		ptr = (char *) chunk + CHUNKHEAD;
+	}
+	else {
+		while (arena->end - arena->next < (ptrdiff_t) csize) {
+			if (arena->chunk && arena->chunk->next) {
+				A_Carve(arena, arena->chunk->next);
+			}
+			else {
+				Chunk *chunk = A_Chunk(arena, ARENACHUNK);
+				if (arena->chunk) {
+					arena->chunk->next = chunk;
+				}
+				else {
+					arena->chunks = chunk;
+				}
+				A_Carve(arena, chunk);
+			}
+		}
+		ptr = arena->next;
+		arena->next += csize;
+	}
+
+	memset(ptr, 0, csize);
 
-	quad->tag = QUAD_SMALL;
+	return ptr;
 }
 
-enum {
-	NEWS_NONE,
-	NEWS_NW,
-	NEWS_NE,
-	NEWS_SW,
-	NEWS_SE,
-	NEWS_LAST
-};
+// Return a block to its size class, size must be as passed to A_Alloc
+void A_Release(Arena *arena, void *ptr, size_t size)
+{
+	assert(arena);
 
-int almost(float aa, float bb)
+	if (ptr == NULL) {
+		return;
+	}
+
+	int cls = A_Class(size);
+	*(void **) ptr = arena->free[cls];
+	arena->free[cls] = ptr;
+}
+
+void A_FreeLarge(Arena *arena)
 {
-	aa = aa - bb;
-	aa = aa * aa;
-	return aa < 0.01;
+	Chunk *chunk, *next;
+
+	for (chunk = arena->large; chunk; chunk = next) {
+		next = chunk->next;
+		arena->bytes -= CHUNKHEAD + chunk->size;
+		free(chunk);
+	}
+	arena->large = NULL;
 }
 
-int News(int centrex, int centrey, float xf, float yf)
+// Forget every block. Regular chunks are kept for reuse, so the cost does
+// not depend on how much was allocated.
+void A_Reset(Arena *arena)
 {
-	if (xf < centrex) {
-		if (yf < centrey) {
-			return NEWS_NW;
+	assert(arena);
+
+	A_FreeLarge(arena);
+	memset(arena->free, 0, sizeof(arena->free));
+	arena->chunk = NULL;
+	arena->next = arena->end = NULL;
+	if (arena->chunks) {
+		A_Carve(arena, arena->chunks);
+	}
+}
+
+// Take over every block of src, which is left empty. Blocks in use stay
+// in use until a reset.
+void A_Adopt(Arena *arena, Arena *src)
+{
+	assert(arena);
+	assert(src);
+
+	Chunk *last;
+	void **tail;
+
+	if (src->chunks) {
+		// ahead of the chunk being carved, which must stay the last in use
+		for (last = src->chunks; last->next; last = last->next) {
+		}
+		if (arena->chunk) {
+			last->next = arena->chunks;
+			arena->chunks = src->chunks;
 		}
 		else {
-			return NEWS_SW;
+			arena->chunks = src->chunks;
+			arena->chunk = last;
+			arena->next = arena->end = (char *) last + CHUNKHEAD + last->size;
 		}
 	}
-	else {
-		if (yf < centrey) {
-			return NEWS_NE;
+
+	if (src->large) {
+		for (last = src->large; last->next; last = last->next) {
 		}
-		else {
-			return NEWS_SE;
+		last->next = arena->large;
+		arena->large = src->large;
+	}
+
+	for (int cls = 0; cls < ARENACLASSES; cls++) {
+		if (src->free[cls]) {
+			for (tail = src->free[cls]; *tail; tail = *tail) {
+			}
+			*tail = arena->free[cls];
+			arena->free[cls] = src->free[cls];
 		}
 	}
+
+	arena->bytes += src->bytes;
+	A_Init(src);
 }
 
-void QL_SplitLarge(Quad *quad, int centrex, int centrey)
+void A_Free(Arena *arena)
 {
-	assert(quad);
-	assert(quad->tag == QUAD_LEAF);
+	assert(arena);
 
-	Quad *nw = L_New(quad->left, quad->top, centrex - quad->left, centrey - quad->top);
-	Quad *ne = L_New(centrex, quad->top, quad->left + quad->width - centrex, centrey - quad->top);
-	Quad *sw = L_New(quad->left, centrey, centrex - quad->left, quad->top + quad->height - centrey);
-	Quad *se = L_New(centrex, centrey, quad->left + quad->width - centrex, quad->top + quad->height - centrey);
+	Chunk *chunk, *next;
 
-	// distribute points evenly to the new leaf nodes.
-	Leaf *leaf = &quad->leaf;
-	Geom *geom;
-	Quad *news;
-	Pt *pt;
+	A_FreeLarge(arena);
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	A_Init(arena);
+}
 
-	for (int ii = 0; ii < leaf->full; ii++) {
-		geom = leaf->geom[ii];
-		assert(geom);
-		assert(geom->tag == GEOM_POINT);
-		pt = &geom->pt;
-		news = NULL;
-		switch (News(centrex, centrey, pt->xf, pt->yf)) {
-		case NEWS_NW:
-			news = nw;
-			break;
-		case NEWS_NE:
-			news = ne;
-			break;
-		case NEWS_SW:
-			news = sw;
-			break;
-		case NEWS_SE:
-			news = se;
-			break;
-		default:
-			fprintf(stderr, "BUG: QL_Split: unknown news\n");
-			exit(1);
+// A spin lock, for locks held for a few instructions
+void Q_Lock(int *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+			sched_yield();
 		}
-		assert(news);
-		assert(news->tag == QUAD_LEAF);
-
-		QL_Add(news, geom);
 	}
+}
 
-	// repurpose the quad as a NODE 
-	Node *node = &quad->node;
-	memset(node, 0, sizeof(Node));
-	node->centrex = centrex;
-	node->centrey = centrey;
-	node->nw = nw;
-	node->ne = ne;
-	node->sw = sw;
-	node->se = se;
-
-	quad->tag = QUAD_NODE;
+void Q_Unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
 }
 
-// Find a centre such that that points are evenly distributed
-void QL_Centre(Quad *quad, int *centrex, int *centrey)
+// Allocate from the tree's arena, or the C heap for a tree without one
+void *T_Alloc(Tree *tree, size_t size)
 {
-	assert(quad);
-	assert(centrex);
-	assert(centrey);
-	assert(quad->tag == QUAD_LEAF);
-	assert(quad->leaf.full > 0);
+	void *ptr;
 
-	float xfsum, yfsum;
-	Leaf *leaf = &quad->leaf;
-	Geom *geom;
-	Pt *pt;
+	if (tree && tree->writers) {
+		Q_Lock(&tree->lock);
+		ptr = A_Alloc(&tree->arena, size);
+		Q_Unlock(&tree->lock);
+		return ptr;
+	}
+	if (tree) {
+		return A_Alloc(&tree->arena, size);
+	}
 
-	xfsum = yfsum = 0.0;
-	for (int ii = 0; ii < leaf->full; ii++) {
-		geom = leaf->geom[ii];
-		assert(geom);
-		assert(geom->tag == GEOM_POINT);
-		pt = &geom->pt;
-		xfsum += pt->xf;
-		yfsum += pt->yf;
+	if ((ptr = calloc(1, size)) == NULL) {
+		fprintf(stderr, "BUG: T_Alloc: no memory\n");
+		exit(1);
 	}
 
-	*centrex = (int) xfsum / leaf->full;
-	*centrey = (int) yfsum / leaf->full;
+	return ptr;
 }
 
-#define QUADMINEXTENT 10
-
-void QL_Split(Quad *quad)
+// Keep a block a reader may still be using until T_Collect frees it
+void E_Retire(Epoch *epoch, void *ptr, size_t size)
 {
-	assert(quad);
-	assert(quad->tag == QUAD_LEAF);
+	assert(epoch);
 
-	int centrex, centrey;
-	QL_Centre(quad, &centrex, &centrey);
+	if (epoch->nretired == epoch->maxretired) {
+		int newmax = epoch->maxretired ? epoch->maxretired * 2 : 64;
+		Retired *retired = realloc(epoch->retired, newmax * sizeof(Retired));
+		if (retired == NULL) {
+			fprintf(stderr, "BUG: E_Retire: no memory\n");
+			exit(1);
+		}
+		epoch->retired = retired;
+		epoch->maxretired = newmax;
+	}
 
-	if (
-		centrex - quad->left < QUADMINEXTENT ||
-		quad->left + quad->width - centrex < QUADMINEXTENT ||
-		centrey - quad->top < QUADMINEXTENT ||
-		quad->top + quad->height - centrey < QUADMINEXTENT
-	) {
-		QL_SplitSmall(quad);
+	Retired *rr = &epoch->retired[epoch->nretired++];
+	rr->ptr = ptr;
+	rr->size = size;
+	rr->epoch = epoch->epoch;
+}
+
+void T_Release(Tree *tree, void *ptr, size_t size)
+{
+	if (tree && tree->epoch) {
+		if (ptr) {
+			E_Retire(tree->epoch, ptr, size);
+		}
+	}
+	else if (tree && tree->writers) {
+		Q_Lock(&tree->lock);
+		A_Release(&tree->arena, ptr, size);
+		Q_Unlock(&tree->lock);
+	}
+	else if (tree) {
+		A_Release(&tree->arena, ptr, size);
 	}
 	else {
-		QL_SplitLarge(quad, centrex, centrey);
+		free(ptr);
 	}
 }
 
-void QL_Add(Quad *quad, Geom *geom)
+Geom *TP_New(Tree *tree, float xf, float yf, float zf)
 {
-	assert(quad);
-	assert(geom);
-	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
-	assert(geom->tag == GEOM_POINT);
+	Geom *geom = T_Alloc(tree, sizeof(Geom));
 
-	Leaf *leaf = &quad->leaf;
+	geom->tag = GEOM_POINT;
 
-	assert(leaf->full < leaf->size);
-	leaf->geom[leaf->full++] = geom;
+	Pt *pt = &geom->pt;
+	pt->xf = xf;
+	pt->yf = yf;
+	pt->zf = zf;
+
+	return geom;
 }
 
-int QL_Find(Quad *quad, float xf, float yf, Geom **found)
+Geom *P_New(float xf, float yf, float zf)
 {
-	assert(quad);
-	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+	return TP_New(NULL, xf, yf, zf);
+}
 
-	Leaf *leaf = &quad->leaf;
-	Geom *geom;
-	int ii;
-	for (ii = 0; ii < leaf->full; ii++) {
-		geom = leaf->geom[ii];
-		assert(geom);
-		assert(geom->tag == GEOM_POINT);
-		if (almost(geom->pt.xf, xf) && almost(geom->pt.yf, yf)) {
-			*found = geom;
-			break;
-		}
-	}
+Geom *Rect_New(float left, float top, float width, float height)
+{
+	Geom *geom = T_Alloc(NULL, sizeof(Geom));
 
-	return ii < leaf->full;
+	geom->tag = GEOM_RECT;
+	geom->rect.left = left;
+	geom->rect.top = top;
+	geom->rect.width = width;
+	geom->rect.height = height;
+
+	return geom;
 }
 
-void Q_Add(Quad *quad, Geom *geom)
+Geom *Seg_New(float x0, float y0, float x1, float y1)
 {
-	assert(quad);
-	assert(geom);
-	assert(geom->tag == GEOM_POINT);
+	Geom *geom = T_Alloc(NULL, sizeof(Geom));
 
-	Leaf *leaf = &quad->leaf;
-	Node *node = &quad->node;
-	Pt *pt = &geom->pt;
-	Quad *news = NULL;
+	geom->tag = GEOM_SEGMENT;
+	geom->seg.x0 = x0;
+	geom->seg.y0 = y0;
+	geom->seg.x1 = x1;
+	geom->seg.y1 = y1;
 
-	switch (quad->tag) {
-	case QUAD_LEAF:
-		if (leaf->full == LEAFMINSIZE) {
-			QL_Split(quad);
-			Q_Add(quad, geom);
+	return geom;
+}
+
+void Q_Init(Quad *quad, int tag, float left, float top, float width, float height)
+{
+	assert(quad);
+
+	quad->tag = tag;
+	quad->left = left;
+	quad->top = top;
+	quad->width = width;
+	quad->height = height;
+}
+
+#define LEAFPOINTSIZE (sizeof(Geom *) + 3 * sizeof(float))
+
+// Points a leaf of the tree holds before it splits
+int T_LeafSize(Tree *tree)
+{
+	return tree ? tree->config.leafsize : LEAFMINSIZE;
+}
+
+// The size a small leaf of size points grows to
+int T_Grown(Tree *tree, int size)
+{
+	int grown = size * (tree ? tree->config.growth : LEAFGROWTH);
+
+	return grown > size ? grown : size + 1;
+}
+
+// Bump one of the running counts of the tree a quad belongs to
+#define T_COUNT(quad, field) \
+	do { \
+		if ((quad)->tree) { \
+			__atomic_fetch_add(&(quad)->tree->counts.field, 1, __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+
+// Allocate the columns for size points in one block. The payload column
+// comes first so the pointers stay aligned.
+void L_Block(Tree *tree, Leaf *leaf, int size)
+{
+	assert(leaf);
+
+	char *block = T_Alloc(tree, size * LEAFPOINTSIZE);
+
+	leaf->geom = (Geom **) block;
+	leaf->xf = (float *) (block + size * sizeof(Geom *));
+	leaf->yf = leaf->xf + size;
+	leaf->zf = leaf->yf + size;
+	leaf->size = size;
+	leaf->index = NULL;
+}
+
+// Buckets in the index of a small leaf with room for size points
+int L_Buckets(int size)
+{
+	int nbucket = 16;
+
+	while (nbucket < size) {
+		nbucket *= 2;
+	}
+
+	return nbucket;
+}
+
+#define L_INDEXSIZE(size) ((2 * L_Buckets(size) + (size)) * sizeof(int))
+
+void L_Release(Tree *tree, Leaf *leaf)
+{
+	assert(leaf);
+
+	T_Release(tree, leaf->geom, leaf->size * LEAFPOINTSIZE);
+	if (leaf->index) {
+		T_Release(tree, leaf->index, L_INDEXSIZE(leaf->size));
+	}
+}
+
+Quad *TL_New(Tree *tree, float left, float top, float width, float height)
+{
+	Quad *quad = T_Alloc(tree, sizeof(Quad));
+
+	Q_Init(quad, QUAD_LEAF, left, top, width, height);
+	quad->tree = tree;
+
+	L_Block(tree, &quad->leaf, T_LeafSize(tree));
+
+	return quad;
+}
+
+Quad *L_New(float left, float top, float width, float height)
+{
+	return TL_New(NULL, left, top, width, height);
+}
+
+Quad *TN_New(Tree *tree, float left, float top, float width, float height)
+{
+	Quad *quad = T_Alloc(tree, sizeof(Quad));
+
+	Q_Init(quad, QUAD_NODE, left, top, width, height);
+	quad->tree = tree;
+
+	return quad;
+}
+
+Quad *N_New(float left, float top, float width, float height)
+{
+	return TN_New(NULL, left, top, width, height);
+}
+
+#define LOOSEGEOMSIZE (sizeof(Geom *) + 4 * sizeof(float))
+#define LOOSEMINSIZE 4
+
+Quad *TX_New(Tree *tree, float left, float top, float width, float height)
+{
+	Quad *quad = T_Alloc(tree, sizeof(Quad));
+
+	Q_Init(quad, QUAD_LOOSE, left, top, width, height);
+	quad->tree = tree;
+
+	return quad;
+}
+
+// Move the geoms of a loose quad to a block with room for size
+void QX_Resize(Quad *quad, int size)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LOOSE);
+
+	Loose *loose = &quad->loose;
+	Loose old = *loose;
+	char *block = T_Alloc(quad->tree, size * LOOSEGEOMSIZE);
+
+	loose->geom = (Geom **) block;
+	loose->left = (float *) (block + size * sizeof(Geom *));
+	loose->top = loose->left + size;
+	loose->right = loose->top + size;
+	loose->bottom = loose->right + size;
+	loose->size = size;
+
+	if (old.size) {
+		memcpy(loose->geom, old.geom, old.full * sizeof(Geom *));
+		memcpy(loose->left, old.left, old.full * sizeof(float));
+		memcpy(loose->top, old.top, old.full * sizeof(float));
+		memcpy(loose->right, old.right, old.full * sizeof(float));
+		memcpy(loose->bottom, old.bottom, old.full * sizeof(float));
+		T_Release(quad->tree, old.geom, old.size * LOOSEGEOMSIZE);
+	}
+}
+
+// Release a quad and everything below it. Points are not owned by the
+// tree and are left alone.
+void Q_Free(Quad *quad)
+{
+	if (quad == NULL) {
+		return;
+	}
+
+	switch (quad->tag) {
+	case QUAD_NODE:
+		Q_Free(quad->node.nw);
+		Q_Free(quad->node.ne);
+		Q_Free(quad->node.sw);
+		Q_Free(quad->node.se);
+		break;
+	case QUAD_LEAF:
+	case QUAD_SMALL:
+		L_Release(quad->tree, &quad->leaf);
+		break;
+	case QUAD_LOOSE:
+		Q_Free(quad->loose.nw);
+		Q_Free(quad->loose.ne);
+		Q_Free(quad->loose.sw);
+		Q_Free(quad->loose.se);
+		T_Release(quad->tree, quad->loose.geom, quad->loose.size * LOOSEGEOMSIZE);
+		break;
+	default:
+		fprintf(stderr, "BUG: Q_Free: unknown tag: %d\n", quad->tag);
+		exit(1);
+	}
+
+	T_Release(quad->tree, quad, sizeof(Quad));
+}
+
+#define HASHMINSIZE 64
+
+// The entry a position probes from. -0 and 0 are the same position.
+int H_Home(Hash *hash, float xf, float yf)
+{
+	uint32_t xbits, ybits;
+	uint64_t key;
+
+	xf += 0.0f;
+	yf += 0.0f;
+	memcpy(&xbits, &xf, sizeof(float));
+	memcpy(&ybits, &yf, sizeof(float));
+	key = ((uint64_t) xbits << 32 | ybits) * 0x9e3779b97f4a7c15ull;
+
+	return (key >> 32) & (hash->size - 1);
+}
+
+void H_Put(Hash *hash, Geom *geom)
+{
+	int mask = hash->size - 1;
+	int ii = H_Home(hash, geom->pt.xf, geom->pt.yf);
+
+	while (hash->entry[ii].geom) {
+		ii = (ii + 1) & mask;
+	}
+	hash->entry[ii].xf = geom->pt.xf + 0.0f;
+	hash->entry[ii].yf = geom->pt.yf + 0.0f;
+	hash->entry[ii].geom = geom;
+	hash->full++;
+}
+
+void H_Resize(Hash *hash, int size)
+{
+	HashEntry *old = hash->entry;
+	int oldsize = hash->size;
+
+	if ((hash->entry = calloc(size, sizeof(HashEntry))) == NULL) {
+		fprintf(stderr, "BUG: H_Resize: no memory\n");
+		exit(1);
+	}
+	hash->size = size;
+	hash->full = 0;
+
+	for (int ii = 0; ii < oldsize; ii++) {
+		if (old[ii].geom) {
+			H_Put(hash, old[ii].geom);
+		}
+	}
+	free(old);
+}
+
+// Kept at most half full so probes stay short
+void H_Add(Hash *hash, Geom *geom)
+{
+	assert(hash);
+	assert(geom);
+
+	if (2 * (hash->full + 1) > hash->size) {
+		H_Resize(hash, 2 * hash->size);
+	}
+	H_Put(hash, geom);
+}
+
+// Take geom out, at the position it was added with. Later entries of the
+// same run that probed past it move back, so no entry is marked deleted.
+void H_Remove(Hash *hash, Geom *geom)
+{
+	assert(hash);
+	assert(geom);
+
+	int mask = hash->size - 1;
+	int ii = H_Home(hash, geom->pt.xf, geom->pt.yf);
+	int jj, home;
+
+	while (hash->entry[ii].geom != geom) {
+		if (hash->entry[ii].geom == NULL) {
+			fprintf(stderr, "BUG: H_Remove: geom not in hash\n");
+			exit(1);
+		}
+		ii = (ii + 1) & mask;
+	}
+
+	for (jj = (ii + 1) & mask; hash->entry[jj].geom; jj = (jj + 1) & mask) {
+		home = H_Home(hash, hash->entry[jj].xf, hash->entry[jj].yf);
+		// entry jj may fill the gap if ii lies between its home and jj
+		if (((jj - home) & mask) >= ((jj - ii) & mask)) {
+			hash->entry[ii] = hash->entry[jj];
+			ii = jj;
+		}
+	}
+	hash->entry[ii].geom = NULL;
+	hash->full--;
+}
+
+Geom *H_Find(Hash *hash, float xf, float yf)
+{
+	assert(hash);
+
+	int mask = hash->size - 1;
+	int ii = H_Home(hash, xf, yf);
+
+	xf += 0.0f;
+	yf += 0.0f;
+	for (; hash->entry[ii].geom; ii = (ii + 1) & mask) {
+		if (hash->entry[ii].xf == xf && hash->entry[ii].yf == yf) {
+			return hash->entry[ii].geom;
+		}
+	}
+
+	return NULL;
+}
+
+// Add every point under quad
+void H_Fill(Hash *hash, Quad *quad)
+{
+	if (quad->tag == QUAD_NODE) {
+		H_Fill(hash, quad->node.nw);
+		H_Fill(hash, quad->node.ne);
+		H_Fill(hash, quad->node.sw);
+		H_Fill(hash, quad->node.se);
+		return;
+	}
+	for (int ii = 0; ii < quad->leaf.full; ii++) {
+		if (quad->leaf.geom[ii]) {
+			H_Add(hash, quad->leaf.geom[ii]);
+		}
+	}
+}
+
+void H_Clear(Hash *hash)
+{
+	memset(hash->entry, 0, hash->size * sizeof(HashEntry));
+	hash->full = 0;
+}
+
+// Keep the exact position of every point of the tree in a hash as well,
+// for T_FindExact, or stop doing so. Q_Add, Q_AddBatch, Q_Remove, Q_Move,
+// T_Fill and T_Reset keep it up to date. Not for a shared tree or one
+// with concurrent writers.
+void T_Hash(Tree *tree, int on)
+{
+	assert(tree);
+	assert(tree->root->tag != QUAD_LOOSE);
+	assert(tree->epoch == NULL);
+	assert(!tree->writers);
+
+	if (!on) {
+		if (tree->hash) {
+			free(tree->hash->entry);
+			free(tree->hash);
+			tree->hash = NULL;
+		}
+		return;
+	}
+	if (tree->hash) {
+		return;
+	}
+
+	if ((tree->hash = calloc(1, sizeof(Hash))) == NULL) {
+		fprintf(stderr, "BUG: T_Hash: no memory\n");
+		exit(1);
+	}
+	H_Resize(tree->hash, HASHMINSIZE);
+	H_Fill(tree->hash, tree->root);
+}
+
+Tree *T_New(float left, float top, float width, float height)
+{
+	Config config = { LEAFMINSIZE, LEAFGROWTH, QUADMINEXTENT };
+
+	return T_NewConfig(&config, left, top, width, height);
+}
+
+// A tree whose leaves are shaped by config, tuned to the data it will hold
+Tree *T_NewConfig(Config *config, float left, float top, float width, float height)
+{
+	assert(config);
+
+	Tree *tree;
+
+	if (config->leafsize < 1 || config->growth <= 1 || config->minextent < 0) {
+		fprintf(stderr, "BUG: T_NewConfig: bad config: leafsize %d growth %f minextent %f\n", config->leafsize, config->growth, config->minextent);
+		exit(1);
+	}
+	if ((tree = calloc(1, sizeof(Tree))) == NULL) {
+		fprintf(stderr, "BUG: T_NewConfig: no memory\n");
+		exit(1);
+	}
+	A_Init(&tree->arena);
+	tree->config = *config;
+	tree->root = TL_New(tree, left, top, width, height);
+
+	return tree;
+}
+
+// A loose tree, for geoms with extent as well as points, see Loose. It
+// takes rects and segments in Q_Add and Q_Remove, and reports every geom
+// a window or a geom touches through Q_QueryRect and Q_Intersect.
+Tree *T_NewLoose(float left, float top, float width, float height)
+{
+	Tree *tree = T_New(left, top, width, height);
+
+	Q_Free(tree->root);
+	tree->root = TX_New(tree, left, top, width, height);
+
+	return tree;
+}
+
+// Drop every quad and every point allocated from the tree and start again
+// with an empty root over the same bounds.
+void T_Reset(Tree *tree)
+{
+	assert(tree);
+	assert(tree->root);
+
+	Quad *root = tree->root;
+	float left = root->left;
+	float top = root->top;
+	float width = root->width;
+	float height = root->height;
+	int loose = root->tag == QUAD_LOOSE;
+
+	A_Reset(&tree->arena);
+	if (tree->epoch) {
+		// no reader may be inside the tree, the arena is gone
+		tree->epoch->nretired = 0;
+	}
+	if (tree->hash) {
+		H_Clear(tree->hash);
+	}
+	if (loose) {
+		tree->root = TX_New(tree, left, top, width, height);
+	}
+	else {
+		tree->root = TL_New(tree, left, top, width, height);
+	}
+}
+
+void T_Free(Tree *tree)
+{
+	if (tree == NULL) {
+		return;
+	}
+
+	if (tree->epoch) {
+		free(tree->epoch->retired);
+		free(tree->epoch);
+	}
+	if (tree->hash) {
+		free(tree->hash->entry);
+		free(tree->hash);
+	}
+	A_Free(&tree->arena);
+	free(tree);
+}
+
+// Let readers run alongside the writer from now on. Readers must not be
+// started before this is called. The writer then works only through the
+// root, tree->root, which moves when the root is split or merged, and
+// calls T_Collect now and then when idle.
+void T_Share(Tree *tree)
+{
+	assert(tree);
+	assert(tree->root->tag != QUAD_LOOSE);
+	assert(tree->epoch == NULL);
+	assert(tree->hash == NULL);
+
+	Epoch *epoch = calloc(1, sizeof(Epoch));
+
+	if (epoch == NULL) {
+		fprintf(stderr, "BUG: T_Share: no memory\n");
+		exit(1);
+	}
+	epoch->epoch = 1;
+	tree->epoch = epoch;
+}
+
+// Claim a reader slot, once for each reading thread.
+// Returns the slot, or -1 if all EPOCHREADERS are taken.
+int T_Reader(Tree *tree)
+{
+	assert(tree);
+	assert(tree->epoch);
+
+	int reader = __atomic_fetch_add(&tree->epoch->nreader, 1, __ATOMIC_ACQ_REL);
+
+	if (reader >= EPOCHREADERS) {
+		__atomic_fetch_sub(&tree->epoch->nreader, 1, __ATOMIC_ACQ_REL);
+		return -1;
+	}
+
+	return reader;
+}
+
+// Start reading and return the root to query from. Everything reachable
+// from it stays valid until T_Leave. Keep read sections short, since
+// nothing retired meanwhile can be released.
+Quad *T_Enter(Tree *tree, int reader)
+{
+	assert(tree);
+	assert(tree->epoch);
+	assert(reader >= 0 && reader < EPOCHREADERS);
+
+	Epoch *epoch = tree->epoch;
+	uint64_t now;
+
+	// if the epoch moved on before the writer could see the slot, the
+	// writer may not have waited for us, so announce the new one
+	do {
+		now = __atomic_load_n(&epoch->epoch, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&epoch->reader[reader].epoch, now, __ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST) != now);
+
+	return LOAD(&tree->root);
+}
+
+void T_Leave(Tree *tree, int reader)
+{
+	assert(tree);
+	assert(tree->epoch);
+	assert(reader >= 0 && reader < EPOCHREADERS);
+
+	__atomic_store_n(&tree->epoch->reader[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+#define EPOCHBATCH 64
+
+// Writer only. Move to the next epoch if every reader inside the tree
+// has seen the current one, and release what was retired two epochs ago
+// or more: no reader can still be in the tree it was taken out of.
+void T_Collect(Tree *tree)
+{
+	assert(tree);
+	assert(tree->epoch);
+
+	Epoch *epoch = tree->epoch;
+	uint64_t now = epoch->epoch;
+	int nreader = LOAD(&epoch->nreader);
+	int ii, kept;
+
+	for (ii = 0; ii < nreader && ii < EPOCHREADERS; ii++) {
+		uint64_t seen = __atomic_load_n(&epoch->reader[ii].epoch, __ATOMIC_SEQ_CST);
+		if (seen != 0 && seen != now) {
+			break;
+		}
+	}
+	if (ii == nreader || ii == EPOCHREADERS) {
+		__atomic_store_n(&epoch->epoch, ++now, __ATOMIC_SEQ_CST);
+	}
+
+	kept = 0;
+	for (ii = 0; ii < epoch->nretired; ii++) {
+		Retired *rr = &epoch->retired[ii];
+		if (now - rr->epoch >= 2) {
+			A_Release(&tree->arena, rr->ptr, rr->size);
+		}
+		else {
+			epoch->retired[kept++] = *rr;
+		}
+	}
+	epoch->nretired = kept;
+}
+
+// Collect once enough has been retired to be worth it
+void T_Sync(Tree *tree)
+{
+	if (tree->epoch->nretired >= EPOCHBATCH) {
+		T_Collect(tree);
+	}
+}
+
+// Let any number of threads call Q_Add and Q_AddBatch on the tree at
+// once, until switched off again. Nothing else may use the tree
+// meanwhile. Writers lock only the leaf they add to, so writers in
+// different parts of the tree do not wait for each other.
+void T_Writers(Tree *tree, int on)
+{
+	assert(tree);
+	assert(tree->root->tag != QUAD_LOOSE);
+	assert(tree->epoch == NULL);
+	assert(tree->hash == NULL);
+
+	tree->writers = on;
+}
+
+// Split the leaves of the tree with split from now on. Nodes already
+// made keep their centres; T_Fill rebuilds the tree with the new policy.
+void T_Split(Tree *tree, SplitPolicy split)
+{
+	assert(tree);
+
+	tree->split = split;
+}
+
+// Index cells per unit. A cell is as wide as almost() reaches, so a miss
+// next to a dense spot need not look at the spot's points.
+#define SMALLGRID 10
+// How far either side of a position to look, almost()'s reach with room
+// for rounding
+#define SMALLREACH 0.11f
+// Points scanned before the index is used, see QL_Lookup
+#define SMALLSCAN 128
+
+// The index of a small leaf is laid out as
+//	head[nbucket], tail[nbucket], next[size]
+// Each bucket chains the slots of the points that hash to it in
+// ascending order, so the first match in a chain is the first in the
+// leaf. -1 ends a chain.
+
+// Cells far out are clamped, as casting a float out of the range of int
+// is undefined, with room left for the cells around them. NaN goes low.
+#define SMALLCELLMAX (INT_MAX / 2)
+
+int QL_Cell(float vf)
+{
+	float scaled = vf * SMALLGRID;
+
+	if (!(scaled > -SMALLCELLMAX)) {
+		return -SMALLCELLMAX;
+	}
+	if (scaled > SMALLCELLMAX) {
+		return SMALLCELLMAX;
+	}
+
+	int cell = (int) scaled;
+
+	// round down, not towards zero
+	return cell > scaled ? cell - 1 : cell;
+}
+
+int QL_Bucket(int nbucket, int cellx, int celly)
+{
+	unsigned hash = (unsigned) cellx * 73856093u ^ (unsigned) celly * 19349663u;
+
+	return hash & (nbucket - 1);
+}
+
+// Chain slot ii in its bucket. Slots are usually added at the end.
+void QL_Link(Leaf *leaf, int ii)
+{
+	int nbucket = L_Buckets(leaf->size);
+	int bucket = QL_Bucket(nbucket, QL_Cell(leaf->xf[ii]), QL_Cell(leaf->yf[ii]));
+	int *head = leaf->index;
+	int *tail = head + nbucket;
+	int *next = tail + nbucket;
+	int *prev;
+
+	next[ii] = -1;
+	if (head[bucket] < 0) {
+		PUBLISH(&head[bucket], ii);
+		tail[bucket] = ii;
+		return;
+	}
+	if (tail[bucket] < ii) {
+		// readers of a shared tree see the slot once it is linked
+		PUBLISH(&next[tail[bucket]], ii);
+		tail[bucket] = ii;
+		return;
+	}
+
+	for (prev = &head[bucket]; *prev < ii; prev = &next[*prev]) {
+	}
+	next[ii] = *prev;
+	*prev = ii;
+}
+
+void QL_Unlink(Leaf *leaf, int ii)
+{
+	int nbucket = L_Buckets(leaf->size);
+	int bucket = QL_Bucket(nbucket, QL_Cell(leaf->xf[ii]), QL_Cell(leaf->yf[ii]));
+	int *head = leaf->index;
+	int *tail = head + nbucket;
+	int *next = tail + nbucket;
+	int *prev;
+	int last = -1;
+
+	for (prev = &head[bucket]; *prev != ii; prev = &next[*prev]) {
+		assert(*prev >= 0);
+		last = *prev;
+	}
+	*prev = next[ii];
+	if (tail[bucket] == ii) {
+		tail[bucket] = last;
+	}
+}
+
+// Index every point of a small leaf afresh
+void QL_Index(Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_SMALL || quad->tag == QUAD_LEAF);
+
+	Leaf *leaf = &quad->leaf;
+	int nbucket = L_Buckets(leaf->size);
+
+	if (leaf->index) {
+		T_Release(quad->tree, leaf->index, L_INDEXSIZE(leaf->size));
+	}
+	leaf->index = T_Alloc(quad->tree, L_INDEXSIZE(leaf->size));
+	for (int ii = 0; ii < 2 * nbucket; ii++) {
+		leaf->index[ii] = -1;
+	}
+	for (int ii = 0; ii < leaf->full; ii++) {
+		QL_Link(leaf, ii);
+	}
+}
+
+// The first point near (xf, yf) in one chain, if it comes before found
+int QL_Chain(Leaf *leaf, int nbucket, int cellx, int celly, float xf, float yf, int found)
+{
+	int *next = leaf->index + 2 * nbucket;
+	int ii = LOAD(&leaf->index[QL_Bucket(nbucket, cellx, celly)]);
+	float dx, dy;
+
+	for (; ii >= 0 && (found < 0 || ii < found); ii = LOAD(&next[ii])) {
+		dx = leaf->xf[ii] - xf;
+		dy = leaf->yf[ii] - yf;
+		if (dx * dx < 0.01 && dy * dy < 0.01) {
+			return ii;
+		}
+	}
+
+	return found;
+}
+
+// As S_Find, through the index. In a dense cluster the first match is
+// usually among the first few points, which are quicker to scan than to
+// reach through the chains, so they are tried first. Then the cell
+// holding (xf, yf) is searched: it is the likeliest to hold an early
+// match, which cuts short the search of the others.
+int QL_Lookup(Leaf *leaf, float xf, float yf)
+{
+	int full = LOAD(&leaf->full);
+	int found = S_Find(leaf->xf, leaf->yf, full < SMALLSCAN ? full : SMALLSCAN, xf, yf);
+
+	if (found >= 0 || full <= SMALLSCAN) {
+		return found;
+	}
+
+	int nbucket = L_Buckets(leaf->size);
+	int homex = QL_Cell(xf);
+	int homey = QL_Cell(yf);
+
+	found = QL_Chain(leaf, nbucket, homex, homey, xf, yf, -1);
+
+	for (int cellx = QL_Cell(xf - SMALLREACH); cellx <= QL_Cell(xf + SMALLREACH); cellx++) {
+		for (int celly = QL_Cell(yf - SMALLREACH); celly <= QL_Cell(yf + SMALLREACH); celly++) {
+			if (cellx != homex || celly != homey) {
+				found = QL_Chain(leaf, nbucket, cellx, celly, xf, yf, found);
+			}
+		}
+	}
+
+	return found;
+}
+
+// Give the point in slot ii new coordinates where it lies
+void QL_Set(Quad *quad, int ii, float xf, float yf, float zf)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+
+	if (leaf->index) {
+		QL_Unlink(leaf, ii);
+	}
+	leaf->xf[ii] = xf;
+	leaf->yf[ii] = yf;
+	leaf->zf[ii] = zf;
+	if (leaf->index) {
+		QL_Link(leaf, ii);
+	}
+}
+
+void QL_Resize(Quad *quad, int newsize)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+	Leaf old = *leaf;
+
+	if (newsize < T_LeafSize(quad->tree)) {
+		newsize = T_LeafSize(quad->tree);
+	}
+
+	L_Block(quad->tree, leaf, newsize);
+
+	T_COUNT(quad, resizes);
+	if (old.size) {
+		assert(old.geom);
+		memcpy(leaf->geom, old.geom, old.full * sizeof(Geom *));
+		memcpy(leaf->xf, old.xf, old.full * sizeof(float));
+		memcpy(leaf->yf, old.yf, old.full * sizeof(float));
+		memcpy(leaf->zf, old.zf, old.full * sizeof(float));
+		L_Release(quad->tree, &old);
+	}
+
+	QL_Index(quad);
+}
+
+void QL_Grow(Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_SMALL);
+
+	TRACE_START(start);
+
+	Leaf *leaf = &quad->leaf;
+	QL_Resize(quad, T_Grown(quad->tree, leaf->size));
+
+	TRACE_END(TRACE_GROW, start);
+}
+
+void QL_Add(Quad *quad, Geom *geom);
+void QL_Put(Quad *quad, Geom *geom, float xf, float yf, float zf);
+
+void QL_SplitSmall(Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+
+	T_COUNT(quad, smallsplits);
+	QL_Index(quad);
+	PUBLISH(&quad->tag, QUAD_SMALL);
+}
+
+enum {
+	NEWS_NONE,
+	NEWS_NW,
+	NEWS_NE,
+	NEWS_SW,
+	NEWS_SE,
+	NEWS_LAST
+};
+
+int almost(float aa, float bb)
+{
+	aa = aa - bb;
+	aa = aa * aa;
+	return aa < 0.01;
+}
+
+int News(float centrex, float centrey, float xf, float yf)
+{
+	if (xf < centrex) {
+		if (yf < centrey) {
+			return NEWS_NW;
+		}
+		else {
+			return NEWS_SW;
+		}
+	}
+	else {
+		if (yf < centrey) {
+			return NEWS_NE;
+		}
+		else {
+			return NEWS_SE;
+		}
+	}
+}
+
+void QL_SplitLarge(Quad *quad, float centrex, float centrey)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+
+	T_COUNT(quad, splits);
+
+	Tree *tree = quad->tree;
+	Quad *nw = TL_New(tree, quad->left, quad->top, centrex - quad->left, centrey - quad->top);
+	Quad *ne = TL_New(tree, centrex, quad->top, quad->left + quad->width - centrex, centrey - quad->top);
+	Quad *sw = TL_New(tree, quad->left, centrey, centrex - quad->left, quad->top + quad->height - centrey);
+	Quad *se = TL_New(tree, centrex, centrey, quad->left + quad->width - centrex, quad->top + quad->height - centrey);
+
+	// distribute points evenly to the new leaf nodes.
+	Leaf *leaf = &quad->leaf;
+	Quad *news;
+
+	for (int ii = 0; ii < leaf->full; ii++) {
+		news = NULL;
+		switch (News(centrex, centrey, leaf->xf[ii], leaf->yf[ii])) {
+		case NEWS_NW:
+			news = nw;
+			break;
+		case NEWS_NE:
+			news = ne;
+			break;
+		case NEWS_SW:
+			news = sw;
+			break;
+		case NEWS_SE:
+			news = se;
+			break;
+		default:
+			fprintf(stderr, "BUG: QL_Split: unknown news\n");
+			exit(1);
+		}
+		assert(news);
+		assert(news->tag == QUAD_LEAF);
+
+		QL_Put(news, leaf->geom[ii], leaf->xf[ii], leaf->yf[ii], leaf->zf[ii]);
+	}
+
+	L_Release(tree, leaf);
+
+	// repurpose the quad as a NODE 
+	Node *node = &quad->node;
+	memset(node, 0, sizeof(Node));
+	node->centrex = centrex;
+	node->centrey = centrey;
+	node->nw = nw;
+	node->ne = ne;
+	node->sw = sw;
+	node->se = se;
+
+	PUBLISH(&quad->tag, QUAD_NODE);
+}
+
+// Find a centre such that that points are evenly distributed
+void Centre(float xfsum, float yfsum, int cnt, float *centrex, float *centrey)
+{
+	assert(centrex);
+	assert(centrey);
+	assert(cnt > 0);
+
+	*centrex = xfsum / cnt;
+	*centrey = yfsum / cnt;
+}
+
+// Split at the mean of the points. Cheap, but clustered points pull the
+// centre towards the cluster, and a leaf at the edge of a cluster can be
+// left with a child too narrow to split again.
+void Split_Mean(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey)
+{
+	float xfsum, yfsum;
+
+	xfsum = yfsum = 0.0;
+	for (int ii = 0; ii < cnt; ii++) {
+		xfsum += xf[ii];
+		yfsum += yf[ii];
+	}
+
+	Centre(xfsum, yfsum, cnt, centrex, centrey);
+}
+
+// Reorder vals so that vals[kk] is the value that would be there if they
+// were sorted, with nothing greater before it and nothing less after it
+float Split_Select(float *vals, int cnt, int kk)
+{
+	assert(kk >= 0 && kk < cnt);
+
+	int lo = 0, hi = cnt - 1;
+	float pivot, tmp;
+
+	while (lo < hi) {
+		pivot = vals[lo + (hi - lo) / 2];
+		int ii = lo, jj = hi;
+		while (ii <= jj) {
+			while (vals[ii] < pivot) {
+				ii++;
+			}
+			while (vals[jj] > pivot) {
+				jj--;
+			}
+			if (ii <= jj) {
+				tmp = vals[ii];
+				vals[ii] = vals[jj];
+				vals[jj] = tmp;
+				ii++;
+				jj--;
+			}
+		}
+		if (kk <= jj) {
+			hi = jj;
+		}
+		else if (kk >= ii) {
+			lo = ii;
+		}
+		else {
+			break;
+		}
+	}
+
+	return vals[kk];
+}
+
+// Halfway between the middle two values, so each side gets half
+float Split_Half(float *vals, int cnt)
+{
+	int kk = cnt / 2;
+	float upper = Split_Select(vals, cnt, kk);
+	float lower;
+
+	if (cnt % 2) {
+		return upper;
+	}
+	lower = vals[0];
+	for (int ii = 1; ii < kk; ii++) {
+		if (vals[ii] > lower) {
+			lower = vals[ii];
+		}
+	}
+
+	return lower + (upper - lower) / 2;
+}
+
+// Split at the median of the points, so that half go each way on each
+// axis whatever their distribution. Linear time, by selection.
+void Split_Median(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey)
+{
+	assert(cnt > 0);
+
+	*centrex = Split_Half(xf, cnt);
+	*centrey = Split_Half(yf, cnt);
+}
+
+// Split at the middle of the leaf, whatever points it holds, as a region
+// quadtree does. Children never get narrower than half their parent.
+void Split_Mid(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey)
+{
+	*centrex = left + width / 2;
+	*centrey = top + height / 2;
+}
+
+// The middle of left .. left + width unless every point is on one side
+// of it, when it slides up to the points so at least one goes each way.
+// Points on the centre go right, so sliding right stops at the second
+// smallest value rather than the smallest.
+float Split_SlideAxis(float *vals, int cnt, float left, float width)
+{
+	float mid = left + width / 2;
+	float min, next, max;
+
+	min = max = vals[0];
+	for (int ii = 1; ii < cnt; ii++) {
+		if (vals[ii] < min) {
+			min = vals[ii];
+		}
+		if (vals[ii] > max) {
+			max = vals[ii];
+		}
+	}
+
+	if (min == max) {
+		return mid;
+	}
+	if (max < mid) {
+		return max;
+	}
+	if (min >= mid) {
+		next = max;
+		for (int ii = 0; ii < cnt; ii++) {
+			if (vals[ii] > min && vals[ii] < next) {
+				next = vals[ii];
+			}
+		}
+		return next;
+	}
+
+	return mid;
+}
+
+// Sliding midpoint: the middle of the leaf, moved towards the points
+// when they all fall on one side, so that no split leaves a child empty
+// on an axis the points spread along
+void Split_Slide(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey)
+{
+	assert(cnt > 0);
+
+	*centrex = Split_SlideAxis(xf, cnt, left, width);
+	*centrey = Split_SlideAxis(yf, cnt, top, height);
+}
+
+// The policy leaves of quad are split with
+SplitPolicy Q_Policy(Quad *quad)
+{
+	if (quad->tree && quad->tree->split) {
+		return quad->tree->split;
+	}
+	return Split_Mean;
+}
+
+// Points per block of a pass over a large set of points in a build. Passes
+// are made block by block so that a parallel build, which hands blocks to
+// different threads, gets exactly the same result.
+#define GEOMBLOCK (1 << 16)
+
+void G_Sum(Geom **geoms, int cnt, float *xfsum, float *yfsum)
+{
+	assert(geoms || cnt == 0);
+
+	Geom *geom;
+	Pt *pt;
+
+	*xfsum = *yfsum = 0.0;
+	for (int ii = 0; ii < cnt; ii++) {
+		geom = geoms[ii];
+		assert(geom);
+		assert(geom->tag == GEOM_POINT);
+		pt = &geom->pt;
+		*xfsum += pt->xf;
+		*yfsum += pt->yf;
+	}
+}
+
+// The centre quad would be split at to hold geoms. For the mean, sums are
+// taken a GEOMBLOCK at a time and then added together. Other policies are
+// given copies of the coordinates.
+void G_Centre(Quad *quad, Geom **geoms, int cnt, float *centrex, float *centrey)
+{
+	assert(quad);
+	assert(geoms);
+
+	SplitPolicy split = Q_Policy(quad);
+	float xfsum, yfsum, xf, yf;
+	float *xfs, *yfs;
+
+	if (split == Split_Mean) {
+		xfsum = yfsum = 0.0;
+		for (int from = 0; from < cnt; from += GEOMBLOCK) {
+			G_Sum(geoms + from, cnt - from < GEOMBLOCK ? cnt - from : GEOMBLOCK, &xf, &yf);
+			xfsum += xf;
+			yfsum += yf;
+		}
+
+		Centre(xfsum, yfsum, cnt, centrex, centrey);
+		return;
+	}
+
+	if ((xfs = malloc(2 * cnt * sizeof(float))) == NULL) {
+		fprintf(stderr, "BUG: G_Centre: no memory\n");
+		exit(1);
+	}
+	yfs = xfs + cnt;
+	for (int ii = 0; ii < cnt; ii++) {
+		assert(geoms[ii]->tag == GEOM_POINT);
+		xfs[ii] = geoms[ii]->pt.xf;
+		yfs[ii] = geoms[ii]->pt.yf;
+	}
+
+	split(xfs, yfs, cnt, quad->left, quad->top, quad->width, quad->height, centrex, centrey);
+
+	free(xfs);
+}
+
+// Leaves that split are small, so their columns are copied to the stack
+// for the policy to reorder
+#define CENTREMAXSTACK 64
+
+void QL_Centre(Quad *quad, float *centrex, float *centrey)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+	assert(quad->leaf.full > 0);
+
+	Leaf *leaf = &quad->leaf;
+	float stack[2 * CENTREMAXSTACK];
+	float *xfs = stack, *yfs;
+
+	if (leaf->full > CENTREMAXSTACK && (xfs = malloc(2 * leaf->full * sizeof(float))) == NULL) {
+		fprintf(stderr, "BUG: QL_Centre: no memory\n");
+		exit(1);
+	}
+	yfs = xfs + leaf->full;
+	memcpy(xfs, leaf->xf, leaf->full * sizeof(float));
+	memcpy(yfs, leaf->yf, leaf->full * sizeof(float));
+
+	Q_Policy(quad)(xfs, yfs, leaf->full, quad->left, quad->top, quad->width, quad->height, centrex, centrey);
+
+	if (xfs != stack) {
+		free(xfs);
+	}
+}
+
+// A split of quad at (centrex, centrey) would leave a child too narrow
+// to be useful. A child of no width at all always is, even with a
+// minextent of 0, as its points would all go back into one child.
+int Q_TooSmall(Quad *quad, float centrex, float centrey)
+{
+	float minextent = quad->tree ? quad->tree->config.minextent : QUADMINEXTENT;
+
+	return
+		centrex - quad->left < minextent || centrex <= quad->left ||
+		quad->left + quad->width - centrex < minextent || centrex >= quad->left + quad->width ||
+		centrey - quad->top < minextent || centrey <= quad->top ||
+		quad->top + quad->height - centrey < minextent || centrey >= quad->top + quad->height;
+}
+
+void QL_Split(Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+
+	TRACE_START(start);
+
+	float centrex, centrey;
+	QL_Centre(quad, &centrex, &centrey);
+
+	if (Q_TooSmall(quad, centrex, centrey)) {
+		QL_SplitSmall(quad);
+	}
+	else {
+		QL_SplitLarge(quad, centrex, centrey);
+	}
+
+	TRACE_END(TRACE_SPLIT, start);
+}
+
+void QL_Add(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(geom);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+	assert(geom->tag == GEOM_POINT);
+
+	Pt *pt = &geom->pt;
+	QL_Put(quad, geom, pt->xf, pt->yf, pt->zf);
+}
+
+void QL_Put(Quad *quad, Geom *geom, float xf, float yf, float zf)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+
+	assert(leaf->full < leaf->size);
+	if (geom) {
+		geom->quad = quad;
+		geom->slot = leaf->full;
+	}
+	leaf->geom[leaf->full] = geom;
+	leaf->xf[leaf->full] = xf;
+	leaf->yf[leaf->full] = yf;
+	leaf->zf[leaf->full] = zf;
+	if (leaf->index) {
+		QL_Link(leaf, leaf->full);
+	}
+	// readers of a shared tree see the point once they see the count
+	PUBLISH(&leaf->full, leaf->full + 1);
+}
+
+int QL_Find(Quad *quad, float xf, float yf, Geom **found)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+	Tree *tree = quad->tree;
+	ScanFixed fixed = NULL;
+	int ii;
+
+	// The fixed scans read the free slots too, which concurrent writers
+	// may be filling, so they are only for trees with one writer.
+	if (leaf->index == NULL && tree && tree->epoch == NULL && !tree->writers) {
+		fixed = S_Fixed(leaf->size);
+	}
+
+	if (leaf->index) {
+		ii = QL_Lookup(leaf, xf, yf);
+	}
+	else if (fixed) {
+		TRACE_SCAN(leaf->full);
+		ii = fixed(leaf->xf, leaf->yf, leaf->full, xf, yf);
+	}
+	else {
+		int full = LOAD(&leaf->full);
+		TRACE_SCAN(full);
+		ii = S_Find(leaf->xf, leaf->yf, full, xf, yf);
+	}
+
+	if (ii < 0) {
+		return 0;
+	}
+
+	*found = leaf->geom[ii];
+
+	return 1;
+}
+
+typedef struct tBox Box;
+
+// The region a quad's points can occupy. Quads on the edge of the tree
+// are unbounded on their outer sides.
+struct tBox {
+	float left, top, right, bottom;
+};
+
+void Box_All(Box *box)
+{
+	box->left = box->top = -INFINITY;
+	box->right = box->bottom = INFINITY;
+}
+
+int Box_Holds(Box *box, float xf, float yf)
+{
+	return xf >= box->left && xf < box->right && yf >= box->top && yf < box->bottom;
+}
+
+// The child of a node that holds (xf, yf). If box is the node's region it
+// is narrowed to the child's.
+Quad *QN_Child(Quad *quad, float xf, float yf, Box *box)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_NODE);
+
+	Node *node = &quad->node;
+
+	TRACE_DESCEND();
+	switch (News(node->centrex, node->centrey, xf, yf)) {
+	case NEWS_NW:
+		if (box) {
+			box->right = node->centrex;
+			box->bottom = node->centrey;
+		}
+		return LOAD(&node->nw);
+	case NEWS_NE:
+		if (box) {
+			box->left = node->centrex;
+			box->bottom = node->centrey;
+		}
+		return LOAD(&node->ne);
+	case NEWS_SW:
+		if (box) {
+			box->right = node->centrex;
+			box->top = node->centrey;
+		}
+		return LOAD(&node->sw);
+	case NEWS_SE:
+		if (box) {
+			box->left = node->centrex;
+			box->top = node->centrey;
+		}
+		return LOAD(&node->se);
+	default:
+		fprintf(stderr, "BUG: QN_Child: unknown news\n");
+		exit(1);
+	}
+}
+
+// Add geom below quad and return the leaf it went into. If box is not
+// NULL it is quad's region on entry and the leaf's on return.
+Quad *QA_Add(Quad *quad, Geom *geom, Box *box)
+{
+	assert(quad);
+	assert(geom);
+	assert(geom->tag == GEOM_POINT);
+
+	Pt *pt = &geom->pt;
+
+	for (;;) {
+		switch (quad->tag) {
+		case QUAD_LEAF:
+			if (quad->leaf.full == T_LeafSize(quad->tree)) {
+				// the leaf becomes a node or a small leaf, look again
+				QL_Split(quad);
+				continue;
+			}
+			QL_Add(quad, geom);
+			return quad;
+		case QUAD_SMALL:
+			if (quad->leaf.full == quad->leaf.size) {
+				QL_Grow(quad);
+			}
+			QL_Add(quad, geom);
+			return quad;
+		case QUAD_NODE:
+			quad = QN_Child(quad, pt->xf, pt->yf, box);
+			break;
+		default:
+			fprintf(stderr, "BUG: Q_Add: unknown tag: %d\n", quad->tag);
+			exit(1);
+		}
+	}
+}
+
+Quad *Q_Leaf(Quad *quad, float xf, float yf, Box *box);
+
+// The leaf below quad that holds (xf, yf), locked. Leaves only ever turn
+// into nodes, and a node does not change once made, so the descent takes
+// no locks. A leaf that became a node while we waited for it is left and
+// the descent goes on.
+Quad *QC_Leaf(Quad *quad, float xf, float yf, Box *box)
+{
+	for (;;) {
+		quad = Q_Leaf(quad, xf, yf, box);
+		Q_Lock(&quad->lock);
+		if (quad->tag != QUAD_NODE) {
+			return quad;
+		}
+		Q_Unlock(&quad->lock);
+	}
+}
+
+// As QA_Add, alongside other writers, see T_Writers
+Quad *QC_Add(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(geom);
+	assert(geom->tag == GEOM_POINT);
+
+	Pt *pt = &geom->pt;
+
+	for (;;) {
+		quad = QC_Leaf(quad, pt->xf, pt->yf, NULL);
+		if (quad->tag == QUAD_LEAF && quad->leaf.full == T_LeafSize(quad->tree)) {
+			QL_Split(quad);
+		}
+		if (quad->tag != QUAD_NODE) {
+			break;
+		}
+		Q_Unlock(&quad->lock);
+	}
+
+	if (quad->tag == QUAD_SMALL && quad->leaf.full == quad->leaf.size) {
+		QL_Grow(quad);
+	}
+	QL_Add(quad, geom);
+	Q_Unlock(&quad->lock);
+
+	return quad;
+}
+
+Quad *QS_Add(Quad *quad, Geom *geom);
+
+void QX_Add(Quad *quad, Geom *geom);
+
+void Q_Add(Quad *quad, Geom *geom)
+{
+	assert(quad);
+
+	TRACE_BEGIN(start);
+
+	// loaded, as concurrent writers may be turning the root into a node
+	if (LOAD(&quad->tag) == QUAD_LOOSE) {
+		QX_Add(quad, geom);
+	}
+	else if (quad->tree && quad->tree->epoch) {
+		QS_Add(quad, geom);
+	}
+	else if (quad->tree && quad->tree->writers) {
+		QC_Add(quad, geom);
+	}
+	else {
+		QA_Add(quad, geom, NULL);
+		if (quad->tree && quad->tree->hash) {
+			H_Add(quad->tree->hash, geom);
+		}
+	}
+
+	TRACE_END(TRACE_ADD, start);
+}
+
+// The leaf that would hold (xf, yf), see QA_Add for box
+Quad *Q_Leaf(Quad *quad, float xf, float yf, Box *box)
+{
+	assert(quad);
+
+	int tag;
+
+	// read once: with concurrent writers the leaf may become a node
+	while ((tag = LOAD(&quad->tag)) == QUAD_NODE) {
+		quad = QN_Child(quad, xf, yf, box);
+	}
+
+	if (tag != QUAD_LEAF && tag != QUAD_SMALL) {
+		fprintf(stderr, "BUG: Q_Leaf: unknown tag: %d\n", tag);
+		exit(1);
+	}
+
+	return quad;
+}
+
+int QX_Find(Quad *quad, float xf, float yf, int exact, int root, Geom **found);
+
+int Q_Find(Quad *quad, float xf, float yf, Geom **found)
+{
+	assert(quad);
+	assert(found);
+
+	if (quad->tag == QUAD_LOOSE) {
+		return QX_Find(quad, xf, yf, 0, 1, found);
+	}
+
+	TRACE_BEGIN(start);
+
+	int ok = QL_Find(Q_Leaf(quad, xf, yf, NULL), xf, yf, found);
+
+	TRACE_END(TRACE_FIND, start);
+
+	return ok;
+}
+
+// Whether a point is at exactly (xf, yf), rather than within almost().
+// Answered by the hash if the tree has one, in constant time, or by a
+// scan of the leaf. Of several points there, any may be reported.
+int T_FindExact(Tree *tree, float xf, float yf, Geom **found)
+{
+	assert(tree);
+	assert(found);
+
+	Quad *leaf;
+
+	if (tree->hash) {
+		*found = H_Find(tree->hash, xf, yf);
+		return *found != NULL;
+	}
+	if (tree->root->tag == QUAD_LOOSE) {
+		return QX_Find(tree->root, xf, yf, 1, 1, found);
+	}
+
+	leaf = Q_Leaf(tree->root, xf, yf, NULL);
+	for (int ii = 0; ii < leaf->leaf.full; ii++) {
+		if (leaf->leaf.xf[ii] == xf && leaf->leaf.yf[ii] == yf) {
+			*found = leaf->leaf.geom[ii];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// A node whose children hold this few points between them is merged back
+// into a leaf. Well under the leaf size so that a leaf does not split and
+// merge again on every other insert and remove.
+int T_MergeSize(Tree *tree)
+{
+	return T_LeafSize(tree) / 2;
+}
+
+// The number of points below a node if all four children are leaves,
+// otherwise -1
+int QN_LeafCount(Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_NODE);
+
+	Node *node = &quad->node;
+	Quad *kids[4] = { node->nw, node->ne, node->sw, node->se };
+	int cnt = 0;
+
+	for (int ii = 0; ii < 4; ii++) {
+		if (kids[ii]->tag != QUAD_LEAF && kids[ii]->tag != QUAD_SMALL) {
+			return -1;
+		}
+		cnt += kids[ii]->leaf.full;
+	}
+
+	return cnt;
+}
+
+// Turn a node whose children are all leaves back into a single leaf
+void QN_Merge(Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_NODE);
+	assert(QN_LeafCount(quad) >= 0 && QN_LeafCount(quad) <= T_LeafSize(quad->tree));
+
+	Node node = quad->node;
+	Quad *kids[4] = { node.nw, node.ne, node.sw, node.se };
+	Leaf *leaf = &quad->leaf;
+
+	memset(leaf, 0, sizeof(Leaf));
+	L_Block(quad->tree, leaf, T_LeafSize(quad->tree));
+	quad->tag = QUAD_LEAF;
+
+	for (int ii = 0; ii < 4; ii++) {
+		Leaf *kid = &kids[ii]->leaf;
+		for (int jj = 0; jj < kid->full; jj++) {
+			QL_Put(quad, kid->geom[jj], kid->xf[jj], kid->yf[jj], kid->zf[jj]);
+		}
+		Q_Free(kids[ii]);
+	}
+}
+
+// Take the point in slot ii out of a leaf. The last point fills the gap.
+void QL_Remove(Quad *quad, int ii)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+	int last = leaf->full - 1;
+
+	assert(ii >= 0 && ii <= last);
+
+	if (leaf->index) {
+		QL_Unlink(leaf, ii);
+		if (ii != last) {
+			QL_Unlink(leaf, last);
+		}
+	}
+	if (leaf->geom[ii]) {
+		leaf->geom[ii]->quad = NULL;
+	}
+	if (leaf->geom[last]) {
+		leaf->geom[last]->slot = ii;
+	}
+	leaf->geom[ii] = leaf->geom[last];
+	leaf->xf[ii] = leaf->xf[last];
+	leaf->yf[ii] = leaf->yf[last];
+	leaf->zf[ii] = leaf->zf[last];
+	leaf->geom[last] = NULL;
+	leaf->full = last;
+	if (leaf->index && ii != last) {
+		QL_Link(leaf, ii);
+	}
+}
+
+#define QUADPATH 64
+
+// Remove geom from the tree. Nodes on the way down whose children have
+// dropped to T_MergeSize points between them are merged back into
+// leaves, from the bottom up. The geom itself is not freed.
+// Returns 1 if geom was in the tree.
+int QS_Remove(Quad *quad, Geom *geom);
+
+int QX_Remove(Quad *quad, Geom *geom);
+
+int Q_Remove(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(geom);
+
+	if (quad->tag == QUAD_LOOSE) {
+		return QX_Remove(quad, geom);
+	}
+	assert(geom->tag == GEOM_POINT);
+
+	if (quad->tree && quad->tree->epoch) {
+		return QS_Remove(quad, geom);
+	}
+
+	// the most recent QUADPATH ancestors of the leaf
+	Quad *path[QUADPATH];
+	int depth = 0;
+	Pt *pt = &geom->pt;
+
+	while (quad->tag == QUAD_NODE) {
+		path[depth++ % QUADPATH] = quad;
+		quad = QN_Child(quad, pt->xf, pt->yf, NULL);
+	}
+
+	// the descent is only needed for the path, the geom knows its slot
+	if (geom->quad != quad) {
+		return 0;
+	}
+	assert(quad->leaf.geom[geom->slot] == geom);
+
+	QL_Remove(quad, geom->slot);
+	if (quad->tree && quad->tree->hash) {
+		H_Remove(quad->tree->hash, geom);
+	}
+
+	for (int up = 0; up < depth && up < QUADPATH; up++) {
+		quad = path[(depth - 1 - up) % QUADPATH];
+		int cnt = QN_LeafCount(quad);
+		if (cnt < 0 || cnt > T_MergeSize(quad->tree)) {
+			break;
+		}
+		QN_Merge(quad);
+	}
+
+	return 1;
+}
+
+// The link in a node to the child that holds (xf, yf)
+Quad **QN_Slot(Quad *quad, float xf, float yf)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_NODE);
+
+	Node *node = &quad->node;
+
+	switch (News(node->centrex, node->centrey, xf, yf)) {
+	case NEWS_NW:
+		return &node->nw;
+	case NEWS_NE:
+		return &node->ne;
+	case NEWS_SW:
+		return &node->sw;
+	case NEWS_SE:
+		return &node->se;
+	default:
+		fprintf(stderr, "BUG: QN_Slot: unknown news\n");
+		exit(1);
+	}
+}
+
+// Updates to a shared tree, see T_Share. Readers may be anywhere in the
+// tree, so the only change made in place is appending to a leaf, which
+// readers see once the count is published. A leaf that has to split,
+// grow or lose a point, and a node that merges, is replaced by a copy
+// that is linked into the parent when complete.
+
+// A copy of a leaf, with room for size points. Back references move to
+// the copy.
+Quad *QS_Copy(Quad *quad, int size)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+	assert(size >= quad->leaf.full);
+
+	Tree *tree = quad->tree;
+	Quad *copy = T_Alloc(tree, sizeof(Quad));
+	Leaf *leaf = &quad->leaf;
+
+	Q_Init(copy, quad->tag, quad->left, quad->top, quad->width, quad->height);
+	copy->tree = tree;
+	L_Block(tree, &copy->leaf, size);
+	if (quad->tag == QUAD_SMALL) {
+		QL_Index(copy);
+	}
+
+	for (int ii = 0; ii < leaf->full; ii++) {
+		QL_Put(copy, leaf->geom[ii], leaf->xf[ii], leaf->yf[ii], leaf->zf[ii]);
+	}
+
+	return copy;
+}
+
+// Link fresh in place of old and retire old
+Quad *QS_Publish(Quad **slot, Quad *old, Quad *fresh)
+{
+	assert(slot);
+	assert(*slot == old);
+
+	PUBLISH(slot, fresh);
+	Q_Free(old);
+
+	return fresh;
+}
+
+void QS_Split(Quad **slot, Quad *quad)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+
+	TRACE_START(start);
+
+	float centrex, centrey;
+	Quad *copy;
+
+	QL_Centre(quad, &centrex, &centrey);
+
+	if (Q_TooSmall(quad, centrex, centrey)) {
+		// grown already, as it is about to be
+		copy = QS_Copy(quad, T_Grown(quad->tree, quad->leaf.size));
+		copy->tag = QUAD_SMALL;
+		T_COUNT(quad, smallsplits);
+		QL_Index(copy);
+	}
+	else {
+		copy = QS_Copy(quad, T_LeafSize(quad->tree));
+		QL_SplitLarge(copy, centrex, centrey);
+	}
+
+	QS_Publish(slot, quad, copy);
+
+	TRACE_END(TRACE_SPLIT, start);
+}
+
+// A leaf holding the points of a node whose children are all leaves
+Quad *QS_Merged(Quad *quad)
+{
+	assert(quad);
+	assert(QN_LeafCount(quad) >= 0 && QN_LeafCount(quad) <= T_LeafSize(quad->tree));
+
+	Node *node = &quad->node;
+	Quad *kids[4] = { node->nw, node->ne, node->sw, node->se };
+	Quad *merged = TL_New(quad->tree, quad->left, quad->top, quad->width, quad->height);
+
+	for (int ii = 0; ii < 4; ii++) {
+		Leaf *kid = &kids[ii]->leaf;
+		for (int jj = 0; jj < kid->full; jj++) {
+			QL_Put(merged, kid->geom[jj], kid->xf[jj], kid->yf[jj], kid->zf[jj]);
+		}
+	}
+
+	return merged;
+}
+
+// As QA_Add, from the root of a shared tree
+Quad *QS_Add(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(geom);
+	assert(geom->tag == GEOM_POINT);
+	assert(quad->tree && quad == quad->tree->root);
+
+	Tree *tree = quad->tree;
+	Quad **slot = &tree->root;
+	Pt *pt = &geom->pt;
+
+	for (;;) {
+		switch (quad->tag) {
+		case QUAD_LEAF:
+			if (quad->leaf.full == T_LeafSize(tree)) {
+				QS_Split(slot, quad);
+				quad = *slot;
+				continue;
+			}
+			QL_Add(quad, geom);
+			T_Sync(tree);
+			return quad;
+		case QUAD_SMALL:
+			if (quad->leaf.full == quad->leaf.size) {
+				quad = QS_Publish(slot, quad, QS_Copy(quad, T_Grown(tree, quad->leaf.size)));
+			}
+			QL_Add(quad, geom);
+			T_Sync(tree);
+			return quad;
+		case QUAD_NODE:
+			slot = QN_Slot(quad, pt->xf, pt->yf);
+			quad = *slot;
+			break;
+		default:
+			fprintf(stderr, "BUG: QS_Add: unknown tag: %d\n", quad->tag);
+			exit(1);
+		}
+	}
+}
+
+// As Q_Remove, from the root of a shared tree
+int QS_Remove(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(geom);
+	assert(quad->tree && quad == quad->tree->root);
+
+	Tree *tree = quad->tree;
+	Quad **path[QUADPATH];
+	Quad **slot = &tree->root;
+	int depth = 0;
+	Pt *pt = &geom->pt;
+	Quad *copy;
+
+	while (quad->tag == QUAD_NODE) {
+		path[depth++ % QUADPATH] = slot;
+		slot = QN_Slot(quad, pt->xf, pt->yf);
+		quad = *slot;
+	}
+
+	if (geom->quad != quad) {
+		return 0;
+	}
+	assert(quad->leaf.geom[geom->slot] == geom);
+
+	copy = QS_Copy(quad, quad->leaf.size);
+	QL_Remove(copy, geom->slot);
+	QS_Publish(slot, quad, copy);
+
+	for (int up = 0; up < depth && up < QUADPATH; up++) {
+		slot = path[(depth - 1 - up) % QUADPATH];
+		quad = *slot;
+		int cnt = QN_LeafCount(quad);
+		if (cnt < 0 || cnt > T_MergeSize(quad->tree)) {
+			break;
+		}
+		QS_Publish(slot, quad, QS_Merged(quad));
+	}
+
+	T_Sync(tree);
+
+	return 1;
+}
+
+typedef struct tStay Stay;
+
+// A point of a move that stays in its leaf, and where in the batch
+struct tStay {
+	Quad *leaf;
+	int ii;
+};
+
+// By leaf, then by place in the batch
+int Stay_Compare(const void *aa, const void *bb)
+{
+	const Stay *sa = aa, *sb = bb;
+
+	if (sa->leaf != sb->leaf) {
+		return (uintptr_t) sa->leaf < (uintptr_t) sb->leaf ? -1 : 1;
+	}
+
+	return sa->ii - sb->ii;
+}
+
+// As Q_Move, from the root of a shared tree. The points that stay in
+// their leaf are grouped by leaf, and each leaf is updated in one copy;
+// the rest are then removed and added again one at a time.
+int QS_Move(Quad *quad, Geom **geoms, Pt *pts, int cnt)
+{
+	assert(quad);
+	assert(quad->tree && quad == quad->tree->root);
+
+	Tree *tree = quad->tree;
+	Stay *stays = malloc((cnt ? cnt : 1) * sizeof(Stay));
+	int *moves = malloc((cnt ? cnt : 1) * sizeof(int));
+	int nstay = 0, nmoved = 0;
+	Quad **slot;
+	Quad *leaf, *copy;
+	Geom *geom;
+	Pt *pt;
+
+	if (stays == NULL || moves == NULL) {
+		fprintf(stderr, "BUG: QS_Move: no memory\n");
+		exit(1);
+	}
+
+	for (int ii = 0; ii < cnt; ii++) {
+		geom = geoms[ii];
+		pt = &pts[ii];
+		assert(geom);
+		assert(geom->tag == GEOM_POINT);
+		assert(geom->quad);
+
+		leaf = geom->quad;
+		if (Q_Leaf(tree->root, pt->xf, pt->yf, NULL) == leaf) {
+			stays[nstay].leaf = leaf;
+			stays[nstay].ii = ii;
+			nstay++;
+		}
+		else {
+			moves[nmoved++] = ii;
+		}
+	}
+	qsort(stays, nstay, sizeof(Stay), Stay_Compare);
+
+	for (int ss = 0, end; ss < nstay; ss = end) {
+		leaf = stays[ss].leaf;
+		geom = geoms[stays[ss].ii];
+		slot = &tree->root;
+		while ((*slot)->tag == QUAD_NODE) {
+			slot = QN_Slot(*slot, geom->pt.xf, geom->pt.yf);
+		}
+		assert(*slot == leaf);
+
+		copy = QS_Copy(leaf, leaf->leaf.size);
+		for (end = ss; end < nstay && stays[end].leaf == leaf; end++) {
+			geom = geoms[stays[end].ii];
+			pt = &pts[stays[end].ii];
+			QL_Set(copy, geom->slot, pt->xf, pt->yf, pt->zf);
+		}
+		QS_Publish(slot, leaf, copy);
+		for (int ee = ss; ee < end; ee++) {
+			geoms[stays[ee].ii]->pt = pts[stays[ee].ii];
+		}
+	}
+
+	for (int mm = 0; mm < nmoved; mm++) {
+		geom = geoms[moves[mm]];
+		if (!QS_Remove(tree->root, geom)) {
+			fprintf(stderr, "BUG: QS_Move: geom not in tree\n");
+			exit(1);
+		}
+		geom->pt = pts[moves[mm]];
+		QS_Add(tree->root, geom);
+	}
+
+	T_Sync(tree);
+	free(moves);
+	free(stays);
+
+	return nmoved;
+}
+
+typedef struct tMorton Morton;
+
+struct tMorton {
+	unsigned key;
+	int idx;
+};
+
+// Interleave 16 bits of each coordinate, quantised over the root's
+// bounds, so that points close in space are close in key order.
+unsigned M_Key(Quad *quad, float xf, float yf)
+{
+	unsigned key = 0;
+	float fx, fy;
+	unsigned qx, qy;
+
+	fx = quad->width > 0 ? (xf - quad->left) / quad->width * 65536 : 0;
+	fy = quad->height > 0 ? (yf - quad->top) / quad->height * 65536 : 0;
+	qx = fx < 0 || fx != fx ? 0 : fx > 65535 ? 65535 : (unsigned) fx;
+	qy = fy < 0 || fy != fy ? 0 : fy > 65535 ? 65535 : (unsigned) fy;
+
+	for (int bit = 15; bit >= 0; bit--) {
+		key = (key << 2) | (((qy >> bit) & 1) << 1) | ((qx >> bit) & 1);
+	}
+
+	return key;
+}
+
+// Return cnt indexes ordered by key: an LSD radix sort, a byte at a time
+Morton *M_Sort(Morton *keys, int cnt)
+{
+	assert(keys || cnt == 0);
+
+	Morton *tmp, *swap;
+	int count[256];
+
+	if ((tmp = malloc(cnt * sizeof(Morton) + 1)) == NULL) {
+		fprintf(stderr, "BUG: M_Sort: no memory\n");
+		exit(1);
+	}
+
+	for (int shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (int ii = 0; ii < cnt; ii++) {
+			count[(keys[ii].key >> shift) & 0xff]++;
+		}
+		for (int ii = 0, sum = 0; ii < 256; ii++) {
+			int cc = count[ii];
+			count[ii] = sum;
+			sum += cc;
+		}
+		for (int ii = 0; ii < cnt; ii++) {
+			tmp[count[(keys[ii].key >> shift) & 0xff]++] = keys[ii];
+		}
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	// an even number of passes leaves the result back in keys
+	free(tmp);
+
+	return keys;
+}
+
+Morton *M_New(int cnt)
+{
+	Morton *keys = malloc(cnt * sizeof(Morton) + 1);
+
+	if (keys == NULL) {
+		fprintf(stderr, "BUG: M_New: no memory\n");
+		exit(1);
+	}
+
+	return keys;
+}
+
+void QB_Fill(Quad *quad, Geom **geoms, int cnt);
+
+// Add cnt points that all belong in the leaf quad. A plain leaf that
+// cannot take them all is rebuilt over its old and new points together,
+// as Q_Build would, instead of being split on whichever points happened
+// to arrive first. In Morton order those are bunched in one corner.
+void QL_AddMany(Quad *quad, Geom **geoms, int cnt)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+	Geom **all;
+	int full;
+
+	if (quad->tag == QUAD_SMALL && leaf->full + cnt > leaf->size) {
+		int newsize = T_Grown(quad->tree, leaf->size);
+		QL_Resize(quad, newsize > leaf->full + cnt ? newsize : leaf->full + cnt);
+	}
+
+	if (quad->tag == QUAD_SMALL || leaf->full + cnt <= T_LeafSize(quad->tree)) {
+		for (int ii = 0; ii < cnt; ii++) {
+			QL_Add(quad, geoms[ii]);
+		}
+		return;
+	}
+
+	full = leaf->full;
+	if ((all = malloc((full + cnt) * sizeof(Geom *))) == NULL) {
+		fprintf(stderr, "BUG: QL_AddMany: no memory\n");
+		exit(1);
+	}
+	memcpy(all, leaf->geom, full * sizeof(Geom *));
+	memcpy(all + full, geoms, cnt * sizeof(Geom *));
+
+	leaf->full = 0;
+	QB_Fill(quad, all, full + cnt);
+
+	free(all);
+}
+
+// Add cnt points in Morton order. Consecutive points usually land in the
+// same leaf, so the leaf and its region are kept and the descent from the
+// root is skipped while they still hold the next point. Each run of
+// points for one leaf is added in one go.
+void Q_AddBatch(Quad *quad, Geom **geoms, int cnt)
+{
+	assert(quad);
+	assert(geoms || cnt == 0);
+
+	Morton *keys;
+	Geom **sorted;
+	Quad *leaf = NULL;
+	Box box;
+	Pt *pt;
+	int writers = quad->tree && quad->tree->writers;
+	int run;
+
+	if (quad->tag == QUAD_LOOSE) {
+		for (int ii = 0; ii < cnt; ii++) {
+			QX_Add(quad, geoms[ii]);
+		}
+		return;
+	}
+	if (quad->tree && quad->tree->epoch) {
+		for (int ii = 0; ii < cnt; ii++) {
+			QS_Add(quad->tree->root, geoms[ii]);
+		}
+		return;
+	}
+
+	keys = M_New(cnt);
+
+	if ((sorted = malloc(cnt * sizeof(Geom *) + 1)) == NULL) {
+		fprintf(stderr, "BUG: Q_AddBatch: no memory\n");
+		exit(1);
+	}
+
+	for (int ii = 0; ii < cnt; ii++) {
+		assert(geoms[ii]);
+		assert(geoms[ii]->tag == GEOM_POINT);
+		pt = &geoms[ii]->pt;
+		keys[ii].key = M_Key(quad, pt->xf, pt->yf);
+		keys[ii].idx = ii;
+	}
+	keys = M_Sort(keys, cnt);
+	for (int ii = 0; ii < cnt; ii++) {
+		sorted[ii] = geoms[keys[ii].idx];
+	}
+
+	for (int ii = 0; ii < cnt; ii += run) {
+		pt = &sorted[ii]->pt;
+		if (leaf == NULL || !Box_Holds(&box, pt->xf, pt->yf)) {
+			leaf = quad;
+			Box_All(&box);
+		}
+		if (writers) {
+			leaf = QC_Leaf(leaf, pt->xf, pt->yf, &box);
+		}
+		else {
+			leaf = Q_Leaf(leaf, pt->xf, pt->yf, &box);
+		}
+
+		for (run = 1; ii + run < cnt; run++) {
+			pt = &sorted[ii + run]->pt;
+			if (!Box_Holds(&box, pt->xf, pt->yf)) {
+				break;
+			}
+		}
+		QL_AddMany(leaf, sorted + ii, run);
+
+		if (writers) {
+			Q_Unlock(&leaf->lock);
+		}
+	}
+
+	for (int ii = 0; quad->tree && quad->tree->hash && ii < cnt; ii++) {
+		H_Add(quad->tree->hash, geoms[ii]);
+	}
+
+	free(sorted);
+	free(keys);
+}
+
+// Look up cnt points, setting found[ii] to the match for (xf[ii], yf[ii])
+// or NULL. Lookups are made in Morton order, reusing the last leaf as
+// Q_AddBatch does.
+// Returns the number of points found.
+int Q_FindBatch(Quad *quad, float *xf, float *yf, int cnt, Geom **found)
+{
+	assert(quad);
+	assert(found || cnt == 0);
+
+	Morton *keys;
+	Quad *leaf = NULL;
+	Box box;
+	int nfound = 0;
+	int idx;
+
+	if (quad->tag == QUAD_LOOSE) {
+		for (int ii = 0; ii < cnt; ii++) {
+			found[ii] = NULL;
+			nfound += QX_Find(quad, xf[ii], yf[ii], 0, 1, &found[ii]);
+		}
+		return nfound;
+	}
+
+	keys = M_New(cnt);
+	for (int ii = 0; ii < cnt; ii++) {
+		keys[ii].key = M_Key(quad, xf[ii], yf[ii]);
+		keys[ii].idx = ii;
+	}
+	keys = M_Sort(keys, cnt);
+
+	for (int ii = 0; ii < cnt; ii++) {
+		idx = keys[ii].idx;
+		if (leaf == NULL || !Box_Holds(&box, xf[idx], yf[idx])) {
+			Box_All(&box);
+			leaf = Q_Leaf(quad, xf[idx], yf[idx], &box);
+		}
+		found[idx] = NULL;
+		nfound += QL_Find(leaf, xf[idx], yf[idx], &found[idx]);
+	}
+
+	free(keys);
+
+	return nfound;
+}
+
+typedef struct tQueryRect QueryRect;
+
+#define SCANCHUNK 256
+
+struct tQueryRect {
+	float left, top, right, bottom;
+	QVisit visit;
+	void *arg;
+	int cnt;
+	int stop;
+};
+
+void QL_QueryRect(Quad *quad, QueryRect *qr)
+{
+	assert(quad);
+	assert(qr);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+	int full = LOAD(&leaf->full);
+	int idx[SCANCHUNK];
+	int cnt, hits;
+
+	// filter a chunk at a time so an early stop does not scan the rest
+	for (int from = 0; from < full && !qr->stop; from += SCANCHUNK) {
+		cnt = full - from < SCANCHUNK ? full - from : SCANCHUNK;
+		hits = S_Rect(leaf->xf + from, leaf->yf + from, cnt, qr->left, qr->top, qr->right, qr->bottom, idx);
+		for (int ii = 0; ii < hits && !qr->stop; ii++) {
+			qr->cnt++;
+			if (qr->visit && !qr->visit(leaf->geom[from + idx[ii]], qr->arg)) {
+				qr->stop = 1;
+			}
+		}
+	}
+}
+
+void QX_QueryRect(Quad *quad, QueryRect *qr);
+
+// Points outside the root are filed in the edge quadrants, so prune
+// against the split lines rather than the cell extents: each child
+// covers the open half-planes on its side of centrex/centrey, which is
+// the same partition as left/top/width/height inside the root.
+void QN_QueryRect(Quad *quad, QueryRect *qr)
+{
+	assert(quad);
+	assert(qr);
+
+	if (qr->stop) {
+		return;
+	}
+
+	switch (quad->tag) {
+	case QUAD_NODE: {
+		Node *node = &quad->node;
+		if (qr->top < node->centrey) {
+			if (qr->left < node->centrex) {
+				QN_QueryRect(LOAD(&node->nw), qr);
+			}
+			if (qr->right > node->centrex) {
+				QN_QueryRect(LOAD(&node->ne), qr);
+			}
+		}
+		if (qr->bottom > node->centrey) {
+			if (qr->left < node->centrex) {
+				QN_QueryRect(LOAD(&node->sw), qr);
+			}
+			if (qr->right > node->centrex) {
+				QN_QueryRect(LOAD(&node->se), qr);
+			}
+		}
+		break;
+	}
+	case QUAD_LEAF:
+	case QUAD_SMALL:
+		QL_QueryRect(quad, qr);
+		break;
+	case QUAD_LOOSE:
+		QX_QueryRect(quad, qr);
+		break;
+	default:
+		fprintf(stderr, "BUG: QN_QueryRect: unknown tag: %d\n", quad->tag);
+		exit(1);
+	}
+}
+
+// Report every point with left <= x < left + width and top <= y < top + height.
+// In a loose tree, report every geom that touches the window, edges
+// included. Returns the number of geoms reported.
+int Q_QueryRect(Quad *quad, float left, float top, float width, float height, QVisit visit, void *arg)
+{
+	assert(quad);
+
+	QueryRect qr;
+
+	if (width <= 0 || height <= 0) {
+		return 0;
+	}
+
+	qr.left = left;
+	qr.top = top;
+	qr.right = left + width;
+	qr.bottom = top + height;
+	qr.visit = visit;
+	qr.arg = arg;
+	qr.cnt = 0;
+	qr.stop = 0;
+
+	QN_QueryRect(quad, &qr);
+
+	return qr.cnt;
+}
+
+typedef struct tQueryBuf QueryBuf;
+
+struct tQueryBuf {
+	Geom **out;
+	int max, full;
+};
+
+int Q_QueryBufVisit(Geom *geom, void *arg)
+{
+	QueryBuf *buf = arg;
+
+	if (buf->full < buf->max) {
+		buf->out[buf->full] = geom;
+	}
+	buf->full++;
+
+	return 1;
+}
+
+// As Q_QueryRect, but store at most max results in out.
+// Returns the total number of matches, which may exceed max.
+int Q_QueryRectBuf(Quad *quad, float left, float top, float width, float height, Geom **out, int max)
+{
+	assert(quad);
+	assert(out || max == 0);
+
+	QueryBuf buf;
+
+	buf.out = out;
+	buf.max = max;
+	buf.full = 0;
+
+	Q_QueryRect(quad, left, top, width, height, Q_QueryBufVisit, &buf);
+
+	return buf.full;
+}
+
+typedef struct tCell Cell;
+typedef struct tNearest Nearest;
+
+// A quad, or a node of a frozen tree, together with the region its points
+// can occupy, which is unbounded on the sides where it touches the edge of
+// the root.
+struct tCell {
+	float dist;
+	float left, top, right, bottom;
+	Quad *quad;
+	int node;
+};
+
+#define NEARESTCELLS 64
+#define NEARESTMAXK 64
+
+// The k best points are kept in a max-heap on dist, so the worst is at
+// the root. Results are Geoms in out for a Quad tree, and point indexes in
+// idx for a frozen one.
+struct tNearest {
+	float xf, yf;
+	int k, full;
+	Geom **out;
+	int *idx;
+	float *dist;
+	int ncell, maxcell;
+	Cell *cell;
+	Cell cells[NEARESTCELLS];
+	float dists[NEARESTMAXK];
+};
+
+float Cell_Dist(float xf, float yf, float left, float top, float right, float bottom)
+{
+	float dx, dy;
+
+	dx = xf < left ? left - xf : xf > right ? xf - right : 0;
+	dy = yf < top ? top - yf : yf > bottom ? yf - bottom : 0;
+
+	return dx * dx + dy * dy;
+}
+
+void QK_Init(Nearest *nn, float xf, float yf, int k, Geom **out, int *idx)
+{
+	assert(nn);
+	assert(k > 0);
+
+	nn->xf = xf;
+	nn->yf = yf;
+	nn->k = k;
+	nn->full = 0;
+	nn->out = out;
+	nn->idx = idx;
+	nn->dist = nn->dists;
+	if (k > NEARESTMAXK && (nn->dist = malloc(k * sizeof(float))) == NULL) {
+		fprintf(stderr, "BUG: QK_Init: no memory\n");
+		exit(1);
+	}
+	nn->ncell = 0;
+	nn->maxcell = NEARESTCELLS;
+	nn->cell = nn->cells;
+}
+
+// min-heap of cells on dist
+void QK_PushCell(Nearest *nn, Quad *quad, int node, float left, float top, float right, float bottom)
+{
+	assert(nn);
+
+	Cell *cell;
+	Cell tmp;
+	int ii, pp;
+
+	if (nn->ncell == nn->maxcell) {
+		int newmax = nn->maxcell * 2;
+		if (nn->cell == nn->cells) {
+			cell = malloc(newmax * sizeof(Cell));
+			if (cell) {
+				memcpy(cell, nn->cell, nn->ncell * sizeof(Cell));
+			}
+		}
+		else {
+			cell = realloc(nn->cell, newmax * sizeof(Cell));
+		}
+		if (cell == NULL) {
+			fprintf(stderr, "BUG: QK_PushCell: no memory\n");
+			exit(1);
+		}
+		nn->cell = cell;
+		nn->maxcell = newmax;
+	}
+
+	cell = nn->cell;
+	ii = nn->ncell++;
+	cell[ii].dist = Cell_Dist(nn->xf, nn->yf, left, top, right, bottom);
+	cell[ii].left = left;
+	cell[ii].top = top;
+	cell[ii].right = right;
+	cell[ii].bottom = bottom;
+	cell[ii].quad = quad;
+	cell[ii].node = node;
+
+	while (ii > 0) {
+		pp = (ii - 1) / 2;
+		if (cell[pp].dist <= cell[ii].dist) {
+			break;
+		}
+		tmp = cell[pp];
+		cell[pp] = cell[ii];
+		cell[ii] = tmp;
+		ii = pp;
+	}
+}
+
+// Push the four children of a node with split (centrex, centrey) whose
+// region is parent. Children are quads if kids is not NULL, otherwise
+// frozen nodes first .. first + 3.
+void QK_PushKids(Nearest *nn, Cell *parent, float centrex, float centrey, Quad **kids, int first)
+{
+	QK_PushCell(nn, kids ? kids[0] : NULL, first, parent->left, parent->top, centrex, centrey);
+	QK_PushCell(nn, kids ? kids[1] : NULL, first + 1, centrex, parent->top, parent->right, centrey);
+	QK_PushCell(nn, kids ? kids[2] : NULL, first + 2, parent->left, centrey, centrex, parent->bottom);
+	QK_PushCell(nn, kids ? kids[3] : NULL, first + 3, centrex, centrey, parent->right, parent->bottom);
+}
+
+void QK_PopCell(Nearest *nn, Cell *top)
+{
+	assert(nn);
+	assert(top);
+	assert(nn->ncell > 0);
+
+	Cell *cell = nn->cell;
+	Cell tmp;
+	int ii, cc;
+
+	*top = cell[0];
+	cell[0] = cell[--nn->ncell];
+
+	ii = 0;
+	for (;;) {
+		cc = 2 * ii + 1;
+		if (cc >= nn->ncell) {
+			break;
+		}
+		if (cc + 1 < nn->ncell && cell[cc + 1].dist < cell[cc].dist) {
+			cc++;
+		}
+		if (cell[ii].dist <= cell[cc].dist) {
+			break;
+		}
+		tmp = cell[ii];
+		cell[ii] = cell[cc];
+		cell[cc] = tmp;
+		ii = cc;
+	}
+}
+
+// No unvisited cell can hold a better point than the k found so far
+int QK_Done(Nearest *nn, Cell *cell)
+{
+	return nn->full == nn->k && cell->dist >= nn->dist[0];
+}
+
+void QK_Swap(Nearest *nn, int aa, int bb)
+{
+	float dtmp = nn->dist[aa];
+	nn->dist[aa] = nn->dist[bb];
+	nn->dist[bb] = dtmp;
+
+	if (nn->out) {
+		Geom *gtmp = nn->out[aa];
+		nn->out[aa] = nn->out[bb];
+		nn->out[bb] = gtmp;
+	}
+	if (nn->idx) {
+		int itmp = nn->idx[aa];
+		nn->idx[aa] = nn->idx[bb];
+		nn->idx[bb] = itmp;
+	}
+}
+
+void QK_SiftDown(Nearest *nn, int ii)
+{
+	float *dist = nn->dist;
+	int cc;
+
+	for (;;) {
+		cc = 2 * ii + 1;
+		if (cc >= nn->full) {
+			break;
+		}
+		if (cc + 1 < nn->full && dist[cc + 1] > dist[cc]) {
+			cc++;
+		}
+		if (dist[ii] >= dist[cc]) {
+			break;
+		}
+		QK_Swap(nn, ii, cc);
+		ii = cc;
+	}
+}
+
+void QK_Offer(Nearest *nn, Geom *geom, int idx, float dd)
+{
+	float *dist = nn->dist;
+	int ii, pp;
+
+	if (nn->full < nn->k) {
+		ii = nn->full++;
+	}
+	else if (dd < dist[0]) {
+		ii = 0;
+	}
+	else {
+		return;
+	}
+
+	dist[ii] = dd;
+	if (nn->out) {
+		nn->out[ii] = geom;
+	}
+	if (nn->idx) {
+		nn->idx[ii] = idx;
+	}
+
+	if (ii == 0) {
+		QK_SiftDown(nn, 0);
+		return;
+	}
+	while (ii > 0) {
+		pp = (ii - 1) / 2;
+		if (dist[pp] >= dist[ii]) {
+			break;
+		}
+		QK_Swap(nn, ii, pp);
+		ii = pp;
+	}
+}
+
+// Heap sort the results into ascending order, release any memory and
+// return the number of results.
+int QK_Finish(Nearest *nn)
+{
+	int full = nn->full;
+
+	while (nn->full > 1) {
+		nn->full--;
+		QK_Swap(nn, 0, nn->full);
+		QK_SiftDown(nn, 0);
+	}
+
+	if (nn->cell != nn->cells) {
+		free(nn->cell);
+	}
+	if (nn->dist != nn->dists) {
+		free(nn->dist);
+	}
+
+	return full;
+}
+
+void QL_Nearest(Quad *quad, Nearest *nn)
+{
+	assert(quad);
+	assert(nn);
+	assert(quad->tag == QUAD_LEAF || quad->tag == QUAD_SMALL);
+
+	Leaf *leaf = &quad->leaf;
+	int full = LOAD(&leaf->full);
+	float dx, dy;
+
+	for (int ii = 0; ii < full; ii++) {
+		dx = leaf->xf[ii] - nn->xf;
+		dy = leaf->yf[ii] - nn->yf;
+		QK_Offer(nn, leaf->geom[ii], ii, dx * dx + dy * dy);
+	}
+}
+
+void QX_Nearest(Quad *quad, Nearest *nn);
+
+// Find the k points closest to (xf, yf) and store them in out, nearest
+// first. Cells are visited in order of their distance from the query
+// point and the search stops as soon as the next cell is further away
+// than the k-th best point found so far.
+// Returns the number of points stored, which is less than k only if the
+// tree holds fewer than k points.
+int Q_Nearest(Quad *quad, float xf, float yf, int k, Geom **out)
+{
+	assert(quad);
+	assert(out);
+
+	Nearest nn;
+	Cell cell;
+
+	if (k <= 0) {
+		return 0;
+	}
+
+	QK_Init(&nn, xf, yf, k, out, NULL);
+	QK_PushCell(&nn, quad, 0, -INFINITY, -INFINITY, INFINITY, INFINITY);
+
+	while (nn.ncell > 0) {
+		QK_PopCell(&nn, &cell);
+		if (QK_Done(&nn, &cell)) {
+			break;
+		}
+
+		switch (cell.quad->tag) {
+		case QUAD_NODE: {
+			Node *node = &cell.quad->node;
+			Quad *kids[4] = { LOAD(&node->nw), LOAD(&node->ne), LOAD(&node->sw), LOAD(&node->se) };
+			QK_PushKids(&nn, &cell, node->centrex, node->centrey, kids, 0);
+			break;
+		}
+		case QUAD_LEAF:
+		case QUAD_SMALL:
+			QL_Nearest(cell.quad, &nn);
+			break;
+		case QUAD_LOOSE:
+			QX_Nearest(cell.quad, &nn);
+			break;
+		default:
+			fprintf(stderr, "BUG: Q_Nearest: unknown tag: %d\n", cell.quad->tag);
+			exit(1);
+		}
+	}
+
+	return QK_Finish(&nn);
+}
+
+// Batches of queries on a pool. The queries are cut into chunks of
+// consecutive queries, one task each, and every query writes only its own
+// result slots, so tasks share nothing but the tree, which must not
+// change until the call returns.
+#define QJCHUNK 1024
+
+typedef struct tQueryJob QueryJob;
+typedef struct tQueryChunk QueryChunk;
+
+enum {
+	QJ_NONE,
+	QJ_FIND,
+	QJ_NEAREST,
+	QJ_RECT,
+	QJ_LAST
+};
+
+struct tQueryJob {
+	int kind;
+	Quad *quad;
+	int cnt, chunk;
+	float *xf, *yf;		// points, or the top left of boxes
+	float *width, *height;
+	int max;		// result slots per query
+	Geom **out;
+	int *nout;		// results per query
+	int total;		// results over all queries
+};
+
+struct tQueryChunk {
+	QueryJob *job;
+	int from, cnt;
+};
+
+void QJ_Chunk(Worker *worker, void *arg)
+{
+	QueryChunk *qc = arg;
+	QueryJob *job = qc->job;
+	int total = 0;
+	int qq;
+
+	switch (job->kind) {
+	case QJ_FIND:
+		total = Q_FindBatch(job->quad, job->xf + qc->from, job->yf + qc->from, qc->cnt, job->out + qc->from);
+		break;
+	case QJ_NEAREST:
+		for (int ii = 0; ii < qc->cnt; ii++) {
+			qq = qc->from + ii;
+			job->nout[qq] = Q_Nearest(job->quad, job->xf[qq], job->yf[qq], job->max, job->out + (size_t) qq * job->max);
+			total += job->nout[qq];
+		}
+		break;
+	case QJ_RECT:
+		for (int ii = 0; ii < qc->cnt; ii++) {
+			qq = qc->from + ii;
+			job->nout[qq] = Q_QueryRectBuf(job->quad, job->xf[qq], job->yf[qq], job->width[qq], job->height[qq], job->out + (size_t) qq * job->max, job->max);
+			total += job->nout[qq];
+		}
+		break;
+	default:
+		fprintf(stderr, "BUG: QJ_Chunk: unknown kind: %d\n", job->kind);
+		exit(1);
+	}
+
+	__atomic_fetch_add(&job->total, total, __ATOMIC_RELAXED);
+}
+
+void QJ_Spawn(Worker *worker, void *arg)
+{
+	QueryChunk *qcs = arg;
+	QueryJob *job = qcs[0].job;
+	int nchunk = (job->cnt + job->chunk - 1) / job->chunk;
+	int group = 0;
+
+	for (int ii = 0; ii < nchunk; ii++) {
+		W_Spawn(worker, QJ_Chunk, &qcs[ii], &group);
+	}
+	W_Wait(worker, &group);
+}
+
+// Run the queries of job on pool, or on this thread if pool is NULL.
+// Returns the sum of the results.
+int QJ_Run(Pool *pool, QueryJob *job)
+{
+	QueryChunk *qcs;
+	int nchunk;
+
+	if (job->cnt <= 0) {
+		return 0;
+	}
+	if (job->chunk <= 0) {
+		job->chunk = QJCHUNK;
+	}
+	nchunk = (job->cnt + job->chunk - 1) / job->chunk;
+
+	if ((qcs = malloc(nchunk * sizeof(QueryChunk))) == NULL) {
+		fprintf(stderr, "BUG: QJ_Run: no memory\n");
+		exit(1);
+	}
+	for (int ii = 0; ii < nchunk; ii++) {
+		qcs[ii].job = job;
+		qcs[ii].from = ii * job->chunk;
+		qcs[ii].cnt = job->cnt - qcs[ii].from < job->chunk ? job->cnt - qcs[ii].from : job->chunk;
+	}
+
+	job->total = 0;
+	if (pool) {
+		W_Run(pool, QJ_Spawn, qcs);
+	}
+	else {
+		for (int ii = 0; ii < nchunk; ii++) {
+			QJ_Chunk(NULL, &qcs[ii]);
+		}
+	}
+
+	free(qcs);
+
+	return job->total;
+}
+
+// As Q_FindBatch, on a pool, chunk queries per task. chunk <= 0 means
+// QJCHUNK. Each chunk is looked up in Morton order, as Q_FindBatch does.
+// Returns the number of points found.
+int Q_FindPool(Pool *pool, Quad *quad, float *xf, float *yf, int cnt, Geom **found, int chunk)
+{
+	assert(quad);
+	assert(found || cnt == 0);
+
+	QueryJob job = { 0 };
+
+	job.kind = QJ_FIND;
+	job.quad = quad;
+	job.cnt = cnt;
+	job.chunk = chunk;
+	job.xf = xf;
+	job.yf = yf;
+	job.out = found;
+
+	return QJ_Run(pool, &job);
+}
+
+// Q_Nearest for each (xf[ii], yf[ii]) on a pool. Query ii stores its
+// results in out[ii * k] .. out[ii * k + k - 1] and their number in
+// nout[ii].
+// Returns the number of points stored over all queries.
+int Q_NearestPool(Pool *pool, Quad *quad, float *xf, float *yf, int cnt, int k, Geom **out, int *nout, int chunk)
+{
+	assert(quad);
+	assert((out && nout) || cnt == 0);
+
+	QueryJob job = { 0 };
+
+	job.kind = QJ_NEAREST;
+	job.quad = quad;
+	job.cnt = cnt;
+	job.chunk = chunk;
+	job.xf = xf;
+	job.yf = yf;
+	job.max = k;
+	job.out = out;
+	job.nout = nout;
+
+	return QJ_Run(pool, &job);
+}
+
+// Q_QueryRectBuf for each box on a pool. Query ii stores at most max
+// results in out[ii * max] onwards and the number of matches, which may
+// exceed max, in nout[ii].
+// Returns the number of matches over all queries.
+int Q_QueryRectPool(Pool *pool, Quad *quad, float *left, float *top, float *width, float *height, int cnt, Geom **out, int max, int *nout, int chunk)
+{
+	assert(quad);
+	assert(nout || cnt == 0);
+	assert(out || max == 0);
+
+	QueryJob job = { 0 };
+
+	job.kind = QJ_RECT;
+	job.quad = quad;
+	job.cnt = cnt;
+	job.chunk = chunk;
+	job.xf = left;
+	job.yf = top;
+	job.width = width;
+	job.height = height;
+	job.max = max;
+	job.out = out;
+	job.nout = nout;
+
+	return QJ_Run(pool, &job);
+}
+
+typedef struct tJoin Join;
+typedef struct tJoinTask JoinTask;
+
+// Expansions of the join below which each pair of quads is a task
+#define JOINSPAWNDEPTH 4
+
+struct tJoin {
+	float dist, dist2;
+	QPair visit;
+	void *arg;
+	long cnt;		// pairs reported by finished tasks
+	int stop;
+};
+
+// A join of the points of aa with each other when bb is NULL, else of
+// the points of aa with those of bb. The boxes are the regions the quads'
+// points can occupy, as for Cell.
+struct tJoinTask {
+	Join *join;
+	Quad *aa, *bb;
+	Box boxa, boxb;
+	int depth;
+};
+
+// Square of the distance between the nearest points of two boxes
+float Box_Dist(Box *aa, Box *bb)
+{
+	float dx = bb->left - aa->right > aa->left - bb->right ? bb->left - aa->right : aa->left - bb->right;
+	float dy = bb->top - aa->bottom > aa->top - bb->bottom ? bb->top - aa->bottom : aa->top - bb->bottom;
+
+	dx = dx > 0 ? dx : 0;
+	dy = dy > 0 ? dy : 0;
+
+	return dx * dx + dy * dy;
+}
+
+// The children of a node and their regions, in News order
+void QD_Kids(Quad *quad, Box *box, Quad **kids, Box *boxes)
+{
+	assert(quad->tag == QUAD_NODE);
+
+	Node *node = &quad->node;
+	float centrex = node->centrex, centrey = node->centrey;
+
+	kids[0] = LOAD(&node->nw);
+	kids[1] = LOAD(&node->ne);
+	kids[2] = LOAD(&node->sw);
+	kids[3] = LOAD(&node->se);
+	boxes[0] = (Box) { box->left, box->top, centrex, centrey };
+	boxes[1] = (Box) { centrex, box->top, box->right, centrey };
+	boxes[2] = (Box) { box->left, centrey, centrex, box->bottom };
+	boxes[3] = (Box) { centrex, centrey, box->right, box->bottom };
+}
+
+typedef struct tJoinPt JoinPt;
+
+#define JOINSTACK 256
+
+struct tJoinPt {
+	float xf, yf;
+	Geom *geom;
+};
+
+int JoinPt_Compare(const void *aa, const void *bb)
+{
+	float xa = ((const JoinPt *) aa)->xf, xb = ((const JoinPt *) bb)->xf;
+
+	return xa < xb ? -1 : xa > xb;
+}
+
+// The points of a leaf that may be within the join's distance of box,
+// or all of them if box is NULL, in order of x
+int QD_Gather(Join *join, Quad *quad, Box *box, JoinPt *pts)
+{
+	Leaf *leaf = &quad->leaf;
+	int full = LOAD(&leaf->full);
+	int cnt = 0;
+
+	for (int ii = 0; ii < full; ii++) {
+		float xf = leaf->xf[ii], yf = leaf->yf[ii];
+		if (box && Cell_Dist(xf, yf, box->left, box->top, box->right, box->bottom) > join->dist2) {
+			continue;
+		}
+		pts[cnt].xf = xf;
+		pts[cnt].yf = yf;
+		pts[cnt].geom = leaf->geom[ii];
+		cnt++;
+	}
+	qsort(pts, cnt, sizeof(JoinPt), JoinPt_Compare);
+
+	return cnt;
+}
+
+// The pairs within one leaf, or across two. Only the points near the
+// other leaf's region are compared, swept in order of x, so that small
+// leaves of thousands of points are not compared all against all.
+long QD_Leaves(Join *join, JoinTask *jt)
+{
+	Quad *aa = jt->aa, *bb = jt->bb;
+	int max = LOAD(&aa->leaf.full) + (bb ? LOAD(&bb->leaf.full) : 0);
+	JoinPt stack[JOINSTACK];
+	JoinPt *ptsa = stack, *ptsb;
+	int cnta, cntb, from = 0;
+	long cnt = 0;
+
+	if (max > JOINSTACK && (ptsa = malloc(max * sizeof(JoinPt))) == NULL) {
+		fprintf(stderr, "BUG: QD_Leaves: no memory\n");
+		exit(1);
+	}
+	cnta = QD_Gather(join, aa, bb ? &jt->boxb : NULL, ptsa);
+	ptsb = bb ? ptsa + cnta : ptsa;
+	cntb = bb ? QD_Gather(join, bb, &jt->boxa, ptsb) : cnta;
+
+	for (int ii = 0; ii < cnta; ii++) {
+		float xf = ptsa[ii].xf, yf = ptsa[ii].yf;
+		int jj = ii + 1;
+		// in a join of two leaves, points of bb too far left of this
+		// point are too far left of the rest
+		if (bb) {
+			while (from < cntb && ptsb[from].xf < xf && (xf - ptsb[from].xf) * (xf - ptsb[from].xf) > join->dist2) {
+				from++;
+			}
+			jj = from;
+		}
+		for (; jj < cntb; jj++) {
+			float dx = ptsb[jj].xf - xf, dy = ptsb[jj].yf - yf;
+			if (dx > 0 && dx * dx > join->dist2) {
+				break;
+			}
+			if (dx * dx + dy * dy > join->dist2) {
+				continue;
+			}
+			cnt++;
+			if (join->visit && !join->visit(ptsa[ii].geom, ptsb[jj].geom, join->arg)) {
+				__atomic_store_n(&join->stop, 1, __ATOMIC_RELAXED);
+				ii = cnta;
+				break;
+			}
+		}
+	}
+
+	if (ptsa != stack) {
+		free(ptsa);
+	}
+
+	return cnt;
+}
+
+void QD_Task(Worker *worker, void *arg);
+long QD_Run(Worker *worker, JoinTask *jt);
+
+// Run the tasks a join task expands into, on other workers while near
+// the top. Returns the pairs reported here rather than by spawned tasks.
+long QD_Spawn(Worker *worker, JoinTask *jt, JoinTask *subs, int nsub)
+{
+	long cnt = 0;
+
+	if (worker && jt->depth < JOINSPAWNDEPTH) {
+		int group = 0;
+		for (int ii = 0; ii < nsub; ii++) {
+			JoinTask *sub = malloc(sizeof(JoinTask));
+			if (sub == NULL) {
+				fprintf(stderr, "BUG: QD_Spawn: no memory\n");
+				exit(1);
+			}
+			*sub = subs[ii];
+			W_Spawn(worker, QD_Task, sub, &group);
+		}
+		W_Wait(worker, &group);
+	}
+	else {
+		for (int ii = 0; ii < nsub; ii++) {
+			cnt += QD_Run(NULL, &subs[ii]);
+		}
+	}
+
+	return cnt;
+}
+
+// The square of the distance from (xf, yf) to a segment
+float G_SegDist(Seg *seg, float xf, float yf)
+{
+	float dx = seg->x1 - seg->x0, dy = seg->y1 - seg->y0;
+	float len2 = dx * dx + dy * dy;
+	float along = len2 > 0 ? ((xf - seg->x0) * dx + (yf - seg->y0) * dy) / len2 : 0;
+
+	along = along < 0 ? 0 : along > 1 ? 1 : along;
+	dx = seg->x0 + along * dx - xf;
+	dy = seg->y0 + along * dy - yf;
+
+	return dx * dx + dy * dy;
+}
+
+// The pairs of a point below quad, whose region is box, and a geom held
+// in the loose quad itself, not its children. own bounds those geoms.
+long QD_Own(Join *join, Quad *quad, Box *box, Quad *holder, Box *own)
+{
+	if (__atomic_load_n(&join->stop, __ATOMIC_RELAXED) || Box_Dist(box, own) > join->dist2) {
+		return 0;
+	}
+
+	int tag = LOAD(&quad->tag);
+	long cnt = 0;
+
+	if (tag == QUAD_NODE) {
+		Quad *kids[4];
+		Box boxes[4];
+		QD_Kids(quad, box, kids, boxes);
+		for (int ii = 0; ii < 4; ii++) {
+			cnt += QD_Own(join, kids[ii], &boxes[ii], holder, own);
+		}
+		return cnt;
+	}
+	if (tag != QUAD_LEAF && tag != QUAD_SMALL) {
+		fprintf(stderr, "BUG: QD_Own: unknown tag: %d\n", tag);
+		exit(1);
+	}
+
+	Leaf *leaf = &quad->leaf;
+	Loose *loose = &holder->loose;
+	int full = LOAD(&leaf->full);
+
+	for (int ii = 0; ii < full; ii++) {
+		float xf = leaf->xf[ii], yf = leaf->yf[ii];
+		if (Cell_Dist(xf, yf, own->left, own->top, own->right, own->bottom) > join->dist2) {
+			continue;
+		}
+		for (int jj = 0; jj < loose->full; jj++) {
+			// the bounds are the geom unless it is a segment
+			Geom *geom = loose->geom[jj];
+			if (Cell_Dist(xf, yf, loose->left[jj], loose->top[jj], loose->right[jj], loose->bottom[jj]) > join->dist2) {
+				continue;
+			}
+			if (geom->tag == GEOM_SEGMENT && G_SegDist(&geom->seg, xf, yf) > join->dist2) {
+				continue;
+			}
+			cnt++;
+			if (join->visit && !join->visit(leaf->geom[ii], geom, join->arg)) {
+				__atomic_store_n(&join->stop, 1, __ATOMIC_RELAXED);
+				return cnt;
+			}
+		}
+	}
+
+	return cnt;
+}
+
+// A join of the points below aa with the geoms below the loose quad bb,
+// whose reach is boxb. aa is first narrowed to the child that holds all
+// the points that could be near bb, so the two trees are walked
+// together; the geoms bb holds itself are then joined with the points
+// below aa, and its children are joined as tasks of their own.
+long QD_Loose(Worker *worker, JoinTask *jt)
+{
+	Join *join = jt->join;
+	Quad *aa = jt->aa, *bb = jt->bb;
+	Loose *loose = &bb->loose;
+	float dist = join->dist;
+	Box near = { jt->boxb.left - dist, jt->boxb.top - dist, jt->boxb.right + dist, jt->boxb.bottom + dist };
+	Box boxa = jt->boxa;
+
+	while (LOAD(&aa->tag) == QUAD_NODE) {
+		Quad *kids[4];
+		Box boxes[4];
+		int ii;
+		QD_Kids(aa, &boxa, kids, boxes);
+		for (ii = 0; ii < 4; ii++) {
+			if (near.left > boxes[ii].left && near.right < boxes[ii].right &&
+			    near.top > boxes[ii].top && near.bottom < boxes[ii].bottom) {
+				break;
+			}
+		}
+		if (ii == 4) {
+			break;
+		}
+		aa = kids[ii];
+		boxa = boxes[ii];
+	}
+
+	long cnt = 0;
+
+	if (loose->full) {
+		Box own = { INFINITY, INFINITY, -INFINITY, -INFINITY };
+		for (int ii = 0; ii < loose->full; ii++) {
+			own.left = loose->left[ii] < own.left ? loose->left[ii] : own.left;
+			own.top = loose->top[ii] < own.top ? loose->top[ii] : own.top;
+			own.right = loose->right[ii] > own.right ? loose->right[ii] : own.right;
+			own.bottom = loose->bottom[ii] > own.bottom ? loose->bottom[ii] : own.bottom;
+		}
+		cnt = QD_Own(join, aa, &boxa, bb, &own);
+	}
+
+	Quad *kids[4] = { loose->nw, loose->ne, loose->sw, loose->se };
+	JoinTask subs[4];
+	int nsub = 0;
+
+	for (int ii = 0; ii < 4; ii++) {
+		Quad *kid = kids[ii];
+		if (kid == NULL) {
+			continue;
+		}
+		Box reach = { kid->left - kid->width / 2, kid->top - kid->height / 2,
+			kid->left + kid->width * 1.5f, kid->top + kid->height * 1.5f };
+		subs[nsub++] = (JoinTask) { join, aa, kid, boxa, reach, jt->depth + 1 };
+	}
+
+	return cnt + QD_Spawn(worker, jt, subs, nsub);
+}
+
+// Run a join task: report the pairs of two leaves, or expand into the
+// pairs of quads below, see QD_Spawn.
+long QD_Run(Worker *worker, JoinTask *jt)
+{
+	Join *join = jt->join;
+	Quad *aa = jt->aa, *bb = jt->bb;
+
+	if (__atomic_load_n(&join->stop, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	if (bb && Box_Dist(&jt->boxa, &jt->boxb) > join->dist2) {
+		return 0;
+	}
+
+	int taga = LOAD(&aa->tag), tagb = bb ? LOAD(&bb->tag) : taga;
+
+	if (tagb == QUAD_LOOSE) {
+		return QD_Loose(worker, jt);
+	}
+	if (taga != QUAD_NODE && tagb != QUAD_NODE) {
+		if ((taga != QUAD_LEAF && taga != QUAD_SMALL) || (tagb != QUAD_LEAF && tagb != QUAD_SMALL)) {
+			fprintf(stderr, "BUG: QD_Run: unknown tag: %d, %d\n", taga, tagb);
+			exit(1);
+		}
+		return QD_Leaves(join, jt);
+	}
+
+	// a self join is of each child and of each pair of children; a join
+	// of two quads splits the larger node
+	JoinTask subs[10];
+	Quad *kids[4];
+	Box boxes[4];
+	int nsub = 0;
+
+	if (bb == NULL) {
+		QD_Kids(aa, &jt->boxa, kids, boxes);
+		for (int ii = 0; ii < 4; ii++) {
+			subs[nsub++] = (JoinTask) { join, kids[ii], NULL, boxes[ii], boxes[ii], jt->depth + 1 };
+			for (int jj = ii + 1; jj < 4; jj++) {
+				subs[nsub++] = (JoinTask) { join, kids[ii], kids[jj], boxes[ii], boxes[jj], jt->depth + 1 };
+			}
+		}
+	}
+	else if (taga == QUAD_NODE && (tagb != QUAD_NODE || aa->width * aa->height >= bb->width * bb->height)) {
+		QD_Kids(aa, &jt->boxa, kids, boxes);
+		for (int ii = 0; ii < 4; ii++) {
+			subs[nsub++] = (JoinTask) { join, kids[ii], bb, boxes[ii], jt->boxb, jt->depth + 1 };
+		}
+	}
+	else {
+		QD_Kids(bb, &jt->boxb, kids, boxes);
+		for (int ii = 0; ii < 4; ii++) {
+			subs[nsub++] = (JoinTask) { join, aa, kids[ii], jt->boxa, boxes[ii], jt->depth + 1 };
+		}
+	}
+
+	return QD_Spawn(worker, jt, subs, nsub);
+}
+
+void QD_Task(Worker *worker, void *arg)
+{
+	JoinTask *jt = arg;
+	long cnt = QD_Run(worker, jt);
+
+	__atomic_fetch_add(&jt->join->cnt, cnt, __ATOMIC_RELAXED);
+	free(jt);
+}
+
+// Run a join from the roots of its trees, bb NULL for a self join.
+// Returns the number of pairs reported.
+long QD_Start(Pool *pool, Join *join, Quad *aa, Quad *bb)
+{
+	JoinTask *jt = malloc(sizeof(JoinTask));
+
+	if (jt == NULL) {
+		fprintf(stderr, "BUG: QD_Start: no memory\n");
+		exit(1);
+	}
+	*jt = (JoinTask) { join, aa, bb, { 0 }, { 0 }, 0 };
+	Box_All(&jt->boxa);
+	Box_All(&jt->boxb);
+
+	if (pool) {
+		W_Run(pool, QD_Task, jt);
+	}
+	else {
+		QD_Task(NULL, jt);
+	}
+
+	return join->cnt;
+}
+
+// Report every pair of points below quad at most dist apart, each pair
+// once, by walking the tree against itself: pairs of quads whose regions
+// are further apart are never looked in. With a pool the pairs of quads
+// near the top are shared among its workers, and visit is called from
+// all of them. Not for loose trees. Returns the number of pairs reported.
+long Q_SelfJoin(Pool *pool, Quad *quad, float dist, QPair visit, void *arg)
+{
+	assert(quad);
+	assert(dist >= 0);
+
+	if (quad->tag == QUAD_LOOSE) {
+		fprintf(stderr, "BUG: Q_SelfJoin: a loose tree\n");
+		exit(1);
+	}
+
+	Join join = { dist, dist * dist, visit, arg, 0, 0 };
+
+	return QD_Start(pool, &join, quad, NULL);
+}
+
+// Report every pair of a point below aa and a geom below bb at most dist
+// apart, with visit(geom of aa, geom of bb), walking the two trees
+// together as Q_SelfJoin does. They need not share bounds or centres,
+// as the larger of two nodes is split first. aa is a point tree and bb
+// a point tree or a loose tree, whose rects and segments are dist from a
+// point if their nearest part is: dist 0 finds the points inside rects.
+long Q_Join(Pool *pool, Quad *aa, Quad *bb, float dist, QPair visit, void *arg)
+{
+	assert(aa);
+	assert(bb);
+	assert(dist >= 0);
+
+	if (aa->tag == QUAD_LOOSE) {
+		fprintf(stderr, "BUG: Q_Join: aa is a loose tree\n");
+		exit(1);
+	}
+
+	Join join = { dist, dist * dist, visit, arg, 0, 0 };
+
+	return QD_Start(pool, &join, aa, bb);
+}
+
+void QT_Stats(Quad *quad, int depth, Stats *stats)
+{
+	switch (quad->tag) {
+	case QUAD_NODE:
+		stats->nnode++;
+		stats->bytes += sizeof(Quad);
+		QT_Stats(quad->node.nw, depth + 1, stats);
+		QT_Stats(quad->node.ne, depth + 1, stats);
+		QT_Stats(quad->node.sw, depth + 1, stats);
+		QT_Stats(quad->node.se, depth + 1, stats);
+		break;
+	case QUAD_SMALL:
+		stats->nsmall++;
+		if (quad->leaf.size > stats->maxsmall) {
+			stats->maxsmall = quad->leaf.size;
+		}
+		stats->bytes += L_INDEXSIZE(quad->leaf.size);
+		// fall through
+	case QUAD_LEAF: {
+		Leaf *leaf = &quad->leaf;
+		stats->nleaf++;
+		stats->npt += leaf->full;
+		stats->depth[depth < STATSDEPTH ? depth : STATSDEPTH - 1]++;
+		stats->fill[leaf->size ? leaf->full * STATSFILL / leaf->size : 0]++;
+		stats->bytes += sizeof(Quad) + leaf->size * LEAFPOINTSIZE;
+		if (depth > stats->maxdepth) {
+			stats->maxdepth = depth;
+		}
+		break;
+	}
+	case QUAD_LOOSE: {
+		Loose *loose = &quad->loose;
+		Quad *kids[4] = { loose->nw, loose->ne, loose->sw, loose->se };
+		stats->nleaf++;
+		stats->npt += loose->full;
+		stats->depth[depth < STATSDEPTH ? depth : STATSDEPTH - 1]++;
+		stats->fill[loose->size ? loose->full * STATSFILL / loose->size : 0]++;
+		stats->bytes += sizeof(Quad) + loose->size * LOOSEGEOMSIZE;
+		if (depth > stats->maxdepth) {
+			stats->maxdepth = depth;
+		}
+		for (int ii = 0; ii < 4; ii++) {
+			if (kids[ii]) {
+				QT_Stats(kids[ii], depth + 1, stats);
+			}
+		}
+		break;
+	}
+	default:
+		fprintf(stderr, "BUG: QT_Stats: unknown tag: %d\n", quad->tag);
+		exit(1);
+	}
+}
+
+// Count the quads and points below quad, by depth and by how full the
+// leaves are. It walks the whole tree, so it is for a writer or a reader
+// of a shared tree to call, not for one among concurrent writers.
+//
+// For a quad of a tree, bytes is everything the tree took from malloc,
+// which includes freed blocks it keeps for reuse, and counts are the
+// tree's. For a quad from plain calloc, bytes is what the quads and
+// leaves below it take up.
+void Q_Stats(Quad *quad, Stats *stats)
+{
+	assert(quad);
+	assert(stats);
+
+	Tree *tree = quad->tree;
+
+	memset(stats, 0, sizeof(Stats));
+	QT_Stats(quad, 0, stats);
+
+	if (tree) {
+		stats->bytes = tree->arena.bytes;
+		if (tree->hash) {
+			stats->bytes += tree->hash->size * sizeof(HashEntry) + sizeof(Hash);
+		}
+		stats->counts.splits = __atomic_load_n(&tree->counts.splits, __ATOMIC_RELAXED);
+		stats->counts.smallsplits = __atomic_load_n(&tree->counts.smallsplits, __ATOMIC_RELAXED);
+		stats->counts.resizes = __atomic_load_n(&tree->counts.resizes, __ATOMIC_RELAXED);
+	}
+}
+
+// The smallest box holding geom, edges included
+void G_Bounds(Geom *geom, Box *box)
+{
+	switch (geom->tag) {
+	case GEOM_POINT:
+		box->left = box->right = geom->pt.xf;
+		box->top = box->bottom = geom->pt.yf;
+		break;
+	case GEOM_RECT:
+		box->left = geom->rect.left;
+		box->top = geom->rect.top;
+		box->right = geom->rect.left + geom->rect.width;
+		box->bottom = geom->rect.top + geom->rect.height;
+		break;
+	case GEOM_SEGMENT:
+		box->left = geom->seg.x0 < geom->seg.x1 ? geom->seg.x0 : geom->seg.x1;
+		box->right = geom->seg.x0 < geom->seg.x1 ? geom->seg.x1 : geom->seg.x0;
+		box->top = geom->seg.y0 < geom->seg.y1 ? geom->seg.y0 : geom->seg.y1;
+		box->bottom = geom->seg.y0 < geom->seg.y1 ? geom->seg.y1 : geom->seg.y0;
+		break;
+	default:
+		fprintf(stderr, "BUG: G_Bounds: unknown tag: %d\n", geom->tag);
+		exit(1);
+	}
+}
+
+// Positive on one side of the line through seg, negative on the other
+float G_Side(Seg *seg, float xf, float yf)
+{
+	return (seg->x1 - seg->x0) * (yf - seg->y0) - (seg->y1 - seg->y0) * (xf - seg->x0);
+}
+
+// Whether a segment touches a box its bounds overlap: it does unless
+// the whole box lies to one side of its line
+int G_SegBox(Seg *seg, Box *box)
+{
+	float sides[4] = {
+		G_Side(seg, box->left, box->top),
+		G_Side(seg, box->right, box->top),
+		G_Side(seg, box->left, box->bottom),
+		G_Side(seg, box->right, box->bottom),
+	};
+	int above = 0, below = 0;
+
+	for (int ii = 0; ii < 4; ii++) {
+		above += sides[ii] > 0;
+		below += sides[ii] < 0;
+	}
+
+	return above < 4 && below < 4;
+}
+
+// Whether two segments whose bounds overlap touch. Collinear segments
+// with overlapping bounds do.
+int G_SegSeg(Seg *aa, Seg *bb)
+{
+	float b0 = G_Side(aa, bb->x0, bb->y0), b1 = G_Side(aa, bb->x1, bb->y1);
+	float a0 = G_Side(bb, aa->x0, aa->y0), a1 = G_Side(bb, aa->x1, aa->y1);
+
+	if ((b0 > 0 && b1 > 0) || (b0 < 0 && b1 < 0)) {
+		return 0;
+	}
+	if ((a0 > 0 && a1 > 0) || (a0 < 0 && a1 < 0)) {
+		return 0;
+	}
+
+	return 1;
+}
+
+// Whether two geoms share a point, edges included
+int G_Intersects(Geom *aa, Geom *bb)
+{
+	assert(aa);
+	assert(bb);
+
+	Box boxa, boxb;
+
+	G_Bounds(aa, &boxa);
+	G_Bounds(bb, &boxb);
+	if (boxa.right < boxb.left || boxb.right < boxa.left || boxa.bottom < boxb.top || boxb.bottom < boxa.top) {
+		return 0;
+	}
+
+	if (aa->tag == GEOM_SEGMENT && bb->tag == GEOM_SEGMENT) {
+		return G_SegSeg(&aa->seg, &bb->seg);
+	}
+	if (aa->tag == GEOM_SEGMENT) {
+		return G_SegBox(&aa->seg, &boxb);
+	}
+	if (bb->tag == GEOM_SEGMENT) {
+		return G_SegBox(&bb->seg, &boxa);
+	}
+
+	return 1;
+}
+
+// The child of a loose quad over the quarter of its cell that holds
+// (xf, yf), made if there is none yet
+Quad *QX_Child(Quad *quad, float xf, float yf)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LOOSE);
+
+	Loose *loose = &quad->loose;
+	float width = quad->width / 2, height = quad->height / 2;
+	int east = xf >= quad->left + width, south = yf >= quad->top + height;
+	Quad **kid = south ? (east ? &loose->se : &loose->sw) : (east ? &loose->ne : &loose->nw);
+
+	if (*kid == NULL) {
+		*kid = TX_New(quad->tree, quad->left + east * width, quad->top + south * height, width, height);
+	}
+
+	return *kid;
+}
+
+void QX_Add(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LOOSE);
+	assert(geom);
+
+	float minextent = quad->tree ? quad->tree->config.minextent : QUADMINEXTENT;
+	Box box;
+
+	G_Bounds(geom, &box);
+
+	float centrex = box.left + (box.right - box.left) / 2;
+	float centrey = box.top + (box.bottom - box.top) / 2;
+
+	// a geom centred outside the root stays there, no child covers it
+	if (centrex >= quad->left && centrex < quad->left + quad->width &&
+	    centrey >= quad->top && centrey < quad->top + quad->height) {
+		while (box.right - box.left <= quad->width / 2 && box.bottom - box.top <= quad->height / 2 &&
+		       quad->width / 2 >= minextent && quad->height / 2 >= minextent) {
+			quad = QX_Child(quad, centrex, centrey);
+		}
+	}
+
+	Loose *loose = &quad->loose;
+
+	if (loose->full == loose->size) {
+		QX_Resize(quad, loose->size ? T_Grown(quad->tree, loose->size) : LOOSEMINSIZE);
+	}
+	loose->geom[loose->full] = geom;
+	loose->left[loose->full] = box.left;
+	loose->top[loose->full] = box.top;
+	loose->right[loose->full] = box.right;
+	loose->bottom[loose->full] = box.bottom;
+	geom->quad = quad;
+	geom->slot = loose->full++;
+}
+
+// Returns 0 if geom is not in the tree. Quads left empty stay, to be
+// reused, until T_Reset.
+int QX_Remove(Quad *quad, Geom *geom)
+{
+	assert(quad);
+	assert(geom);
+
+	Quad *holder = geom->quad;
+
+	if (holder == NULL || holder->tag != QUAD_LOOSE || holder->tree != quad->tree) {
+		return 0;
+	}
+
+	Loose *loose = &holder->loose;
+	int slot = geom->slot;
+	int last = --loose->full;
+
+	assert(loose->geom[slot] == geom);
+
+	loose->geom[slot] = loose->geom[last];
+	loose->left[slot] = loose->left[last];
+	loose->top[slot] = loose->top[last];
+	loose->right[slot] = loose->right[last];
+	loose->bottom[slot] = loose->bottom[last];
+	loose->geom[slot]->slot = slot;
+	geom->quad = NULL;
+
+	return 1;
+}
+
+// Report the geoms below quad that touch with, whose bounds are those of
+// qr. The root's reach is unbounded, as it also holds the geoms centred
+// outside it.
+void QX_Intersect(Quad *quad, Geom *with, int root, QueryRect *qr)
+{
+	if (quad == NULL || qr->stop) {
+		return;
+	}
+	if (!root && (
+	    quad->left - quad->width / 2 > qr->right || quad->left + quad->width * 1.5 < qr->left ||
+	    quad->top - quad->height / 2 > qr->bottom || quad->top + quad->height * 1.5 < qr->top)) {
+		return;
+	}
+
+	Loose *loose = &quad->loose;
+
+	for (int ii = 0; ii < loose->full && !qr->stop; ii++) {
+		if (loose->left[ii] > qr->right || loose->right[ii] < qr->left ||
+		    loose->top[ii] > qr->bottom || loose->bottom[ii] < qr->top) {
+			continue;
+		}
+		// overlapping bounds are enough unless there is a segment
+		Geom *geom = loose->geom[ii];
+		if ((geom->tag == GEOM_SEGMENT || with->tag == GEOM_SEGMENT) && !G_Intersects(geom, with)) {
+			continue;
+		}
+		qr->cnt++;
+		if (qr->visit && !qr->visit(geom, qr->arg)) {
+			qr->stop = 1;
+		}
+	}
+
+	QX_Intersect(loose->nw, with, 0, qr);
+	QX_Intersect(loose->ne, with, 0, qr);
+	QX_Intersect(loose->sw, with, 0, qr);
+	QX_Intersect(loose->se, with, 0, qr);
+}
+
+void QX_QueryRect(Quad *quad, QueryRect *qr)
+{
+	Geom window = { .tag = GEOM_RECT };
+
+	window.rect.left = qr->left;
+	window.rect.top = qr->top;
+	window.rect.width = qr->right - qr->left;
+	window.rect.height = qr->bottom - qr->top;
+
+	QX_Intersect(quad, &window, 1, qr);
+}
+
+// The first point of a loose tree at (xf, yf), exactly or within
+// almost(), looked for in the quads whose reach holds it
+int QX_Find(Quad *quad, float xf, float yf, int exact, int root, Geom **found)
+{
+	if (quad == NULL) {
+		return 0;
+	}
+	if (!root && (
+	    xf < quad->left - quad->width / 2 - 0.1f || xf > quad->left + quad->width * 1.5f + 0.1f ||
+	    yf < quad->top - quad->height / 2 - 0.1f || yf > quad->top + quad->height * 1.5f + 0.1f)) {
+		return 0;
+	}
+
+	Loose *loose = &quad->loose;
+
+	for (int ii = 0; ii < loose->full; ii++) {
+		Geom *geom = loose->geom[ii];
+		if (geom->tag != GEOM_POINT) {
+			continue;
+		}
+		if (exact ? geom->pt.xf == xf && geom->pt.yf == yf : almost(geom->pt.xf, xf) && almost(geom->pt.yf, yf)) {
+			*found = geom;
+			return 1;
+		}
+	}
+
+	return
+		QX_Find(loose->nw, xf, yf, exact, 0, found) ||
+		QX_Find(loose->ne, xf, yf, exact, 0, found) ||
+		QX_Find(loose->sw, xf, yf, exact, 0, found) ||
+		QX_Find(loose->se, xf, yf, exact, 0, found);
+}
+
+// Offer the geoms a loose quad holds itself, and queue its children as
+// cells over their reach
+void QX_Nearest(Quad *quad, Nearest *nn)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LOOSE);
+
+	Loose *loose = &quad->loose;
+	Quad *kids[4] = { loose->nw, loose->ne, loose->sw, loose->se };
+
+	float dd;
+
+	// the bounds are the geom itself, unless it is a segment
+	for (int ii = 0; ii < loose->full; ii++) {
+		Geom *geom = loose->geom[ii];
+		if (geom->tag == GEOM_SEGMENT) {
+			dd = G_SegDist(&geom->seg, nn->xf, nn->yf);
+		}
+		else {
+			dd = Cell_Dist(nn->xf, nn->yf, loose->left[ii], loose->top[ii], loose->right[ii], loose->bottom[ii]);
+		}
+		QK_Offer(nn, geom, ii, dd);
+	}
+	for (int ii = 0; ii < 4; ii++) {
+		Quad *kid = kids[ii];
+		if (kid) {
+			QK_PushCell(nn, kid, 0, kid->left - kid->width / 2, kid->top - kid->height / 2,
+				kid->left + kid->width * 1.5f, kid->top + kid->height * 1.5f);
+		}
+	}
+}
+
+// Report every geom of a loose tree that touches geom, see G_Intersects.
+// Returns the number of geoms reported.
+int Q_Intersect(Quad *quad, Geom *geom, QVisit visit, void *arg)
+{
+	assert(quad);
+	assert(geom);
+
+	QueryRect qr = { 0 };
+	Box box;
+
+	if (quad->tag != QUAD_LOOSE) {
+		fprintf(stderr, "BUG: Q_Intersect: not a loose tree\n");
+		exit(1);
+	}
+
+	G_Bounds(geom, &box);
+	qr.left = box.left;
+	qr.top = box.top;
+	qr.right = box.right;
+	qr.bottom = box.bottom;
+	qr.visit = visit;
+	qr.arg = arg;
+
+	QX_Intersect(quad, geom, 1, &qr);
+
+	return qr.cnt;
+}
+
+// Move the points with coordinate < centre to the front of geoms.
+// Returns the number of such points.
+int G_Partition(Geom **geoms, int cnt, float centre, int yaxis)
+{
+	assert(geoms || cnt == 0);
+
+	Geom *tmp;
+	int lo, hi;
+
+	lo = 0;
+	hi = cnt - 1;
+	while (lo <= hi) {
+		if ((yaxis ? geoms[lo]->pt.yf : geoms[lo]->pt.xf) < centre) {
+			lo++;
+		}
+		else {
+			tmp = geoms[lo];
+			geoms[lo] = geoms[hi];
+			geoms[hi--] = tmp;
+		}
+	}
+
+	return lo;
+}
+
+// The child of a split at (centrex, centrey) that holds geom, in News
+// order: 0 nw, 1 ne, 2 sw, 3 se
+int G_Kid(Geom *geom, float centrex, float centrey)
+{
+	return !(geom->pt.xf < centrex) + 2 * !(geom->pt.yf < centrey);
+}
+
+// Add the number of points for each child of (centrex, centrey) to cnts
+void G_Count(Geom **geoms, int cnt, float centrex, float centrey, int *cnts)
+{
+	for (int ii = 0; ii < cnt; ii++) {
+		cnts[G_Kid(geoms[ii], centrex, centrey)]++;
+	}
+}
+
+// Copy each point to the next slot of its child in out, keeping order.
+// offs holds each child's next slot and is advanced.
+void G_Scatter(Geom **geoms, int cnt, float centrex, float centrey, Geom **out, int *offs)
+{
+	for (int ii = 0; ii < cnt; ii++) {
+		out[offs[G_Kid(geoms[ii], centrex, centrey)]++] = geoms[ii];
+	}
+}
+
+// Order geoms by child of (centrex, centrey) and set the size of each
+// child's run in cnts. Up to GEOMBLOCK points are partitioned in place.
+// More are copied into tmp, which must be as large, in a stable order
+// that does not depend on how the copy is divided up between threads.
+// Returns the array holding the result, geoms or tmp.
+Geom **G_Split(Geom **geoms, Geom **tmp, int cnt, float centrex, float centrey, int *cnts)
+{
+	int offs[4];
+
+	if (cnt <= GEOMBLOCK) {
+		// same order as News: north before south, west before east
+		int ns = G_Partition(geoms, cnt, centrey, 1);
+		int nw = G_Partition(geoms, ns, centrex, 0);
+		int sw = G_Partition(geoms + ns, cnt - ns, centrex, 0);
+		cnts[0] = nw;
+		cnts[1] = ns - nw;
+		cnts[2] = sw;
+		cnts[3] = cnt - ns - sw;
+		return geoms;
+	}
+
+	assert(tmp);
+
+	memset(cnts, 0, 4 * sizeof(int));
+	G_Count(geoms, cnt, centrex, centrey, cnts);
+	offs[0] = 0;
+	for (int ii = 1; ii < 4; ii++) {
+		offs[ii] = offs[ii - 1] + cnts[ii - 1];
+	}
+	G_Scatter(geoms, cnt, centrex, centrey, tmp, offs);
+
+	return tmp;
+}
+
+// The four empty leaves of a split of quad at (centrex, centrey)
+void QB_Kids(Quad *quad, float centrex, float centrey, Quad **kids)
+{
+	assert(quad);
+
+	Tree *tree = quad->tree;
+	float left = quad->left;
+	float top = quad->top;
+	float width = quad->width;
+	float height = quad->height;
+
+	kids[0] = TL_New(tree, left, top, centrex - left, centrey - top);
+	kids[1] = TL_New(tree, centrex, top, left + width - centrex, centrey - top);
+	kids[2] = TL_New(tree, left, centrey, centrex - left, top + height - centrey);
+	kids[3] = TL_New(tree, centrex, centrey, left + width - centrex, top + height - centrey);
+}
+
+// Turn quad, an empty leaf, into a node over kids split at (centrex,
+// centrey). Concurrent writers can reach the kids from then on, so they
+// should be filled first.
+void QB_Node(Quad *quad, float centrex, float centrey, Quad **kids)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+	assert(quad->leaf.full == 0);
+
+	L_Release(quad->tree, &quad->leaf);
+
+	Node *node = &quad->node;
+	memset(node, 0, sizeof(Node));
+	node->centrex = centrex;
+	node->centrey = centrey;
+	node->nw = kids[0];
+	node->ne = kids[1];
+	node->sw = kids[2];
+	node->se = kids[3];
+	PUBLISH(&quad->tag, QUAD_NODE);
+	T_COUNT(quad, splits);
+}
+
+// Turn quad, an empty leaf, into the root of a subtree over geoms. tmp
+// is scratch space for G_Split, needed for more than GEOMBLOCK points.
+void QB_FillWith(Quad *quad, Geom **geoms, Geom **tmp, int cnt)
+{
+	assert(quad);
+	assert(quad->tag == QUAD_LEAF);
+	assert(quad->leaf.full == 0);
+	assert(geoms || cnt == 0);
+
+	float centrex, centrey;
+	int cnts[4];
+
+	if (cnt > T_LeafSize(quad->tree)) {
+		G_Centre(quad, geoms, cnt, &centrex, &centrey);
+		if (!Q_TooSmall(quad, centrex, centrey)) {
+			Geom **split = G_Split(geoms, tmp, cnt, centrex, centrey, cnts);
+			Geom **spare = split == geoms ? tmp : geoms;
+			Quad *kids[4];
+
+			QB_Kids(quad, centrex, centrey, kids);
+			for (int ii = 0, off = 0; ii < 4; off += cnts[ii++]) {
+				QB_FillWith(kids[ii], split + off, spare ? spare + off : NULL, cnts[ii]);
+			}
+			QB_Node(quad, centrex, centrey, kids);
+
+			return;
+		}
+
+		QL_SplitSmall(quad);
+		QL_Resize(quad, cnt);
+	}
+
+	for (int ii = 0; ii < cnt; ii++) {
+		QL_Add(quad, geoms[ii]);
+	}
+}
+
+void QB_Fill(Quad *quad, Geom **geoms, int cnt)
+{
+	Geom **tmp = NULL;
+
+	if (cnt > GEOMBLOCK && (tmp = malloc(cnt * sizeof(Geom *))) == NULL) {
+		fprintf(stderr, "BUG: QB_Fill: no memory\n");
+		exit(1);
+	}
+
+	QB_FillWith(quad, geoms, tmp, cnt);
+
+	free(tmp);
+}
+
+Quad *QB_Build(Tree *tree, Geom **geoms, int cnt, float left, float top, float width, float height)
+{
+	Quad *quad = TL_New(tree, left, top, width, height);
+
+	QB_Fill(quad, geoms, cnt);
+
+	return quad;
+}
+
+Geom **QB_Copy(Geom **geoms, int cnt)
+{
+	Geom **work = NULL;
+
+	if (cnt) {
+		if ((work = malloc(cnt * sizeof(Geom *))) == NULL) {
+			fprintf(stderr, "BUG: QB_Copy: no memory\n");
+			exit(1);
+		}
+		memcpy(work, geoms, cnt * sizeof(Geom *));
+	}
+
+	return work;
+}
+
+// Build a tree over cnt points in one pass. The points are partitioned
+// top down with the same centre and extent rules as Q_Add, so every leaf
+// is created at its final size and no point is copied through a leaf
+// that is later split. The caller's array is not modified.
+Quad *Q_Build(Geom **geoms, int cnt, float left, float top, float width, float height)
+{
+	assert(geoms || cnt == 0);
+
+	Geom **work = QB_Copy(geoms, cnt);
+	Quad *quad = QB_Build(NULL, work, cnt, left, top, width, height);
+
+	free(work);
+
+	return quad;
+}
+
+// As Q_Build, with the quads drawn from a new tree's arena
+Tree *T_Build(Geom **geoms, int cnt, float left, float top, float width, float height)
+{
+	assert(geoms || cnt == 0);
+
+	Tree *tree = T_New(left, top, width, height);
+
+	T_Fill(NULL, tree, geoms, cnt);
+
+	return tree;
+}
+
+// A build on a pool. A task owns one empty leaf and the points for it.
+// Above QBGRAIN points the centre sums and the split are made a
+// GEOMBLOCK at a time on the pool, then the four children become tasks.
+// Each worker allocates from its own tree, so the arena is never shared,
+// and quads are pointed at the real tree when they are complete.
+#define QBGRAIN (1 << 14)
+
+typedef struct tBuild Build;
+typedef struct tBuildTask BuildTask;
+typedef struct tBlockTask BlockTask;
+
+struct tBuild {
+	Tree *tree;		// tree being built, NULL for calloc
+	Tree *local;		// one per worker
+};
+
+struct tBuildTask {
+	Build *build;
+	Quad *quad;
+	Geom **geoms, **tmp;
+	int cnt;
+};
+
+struct tBlockTask {
+	Geom **geoms, **out;
+	int cnt;
+	float centrex, centrey;
+	float xfsum, yfsum;
+	int cnts[4];		// counts, then the next slot of each child in out
+};
+
+// Point a subtree at the tree it belongs to
+void QB_Own(Quad *quad, Tree *tree)
+{
+	quad->tree = tree;
+	if (quad->tag == QUAD_NODE) {
+		QB_Own(quad->node.nw, tree);
+		QB_Own(quad->node.ne, tree);
+		QB_Own(quad->node.sw, tree);
+		QB_Own(quad->node.se, tree);
+	}
+}
+
+void QB_SumTask(Worker *worker, void *arg)
+{
+	BlockTask *bt = arg;
+
+	G_Sum(bt->geoms, bt->cnt, &bt->xfsum, &bt->yfsum);
+}
+
+void QB_CountTask(Worker *worker, void *arg)
+{
+	BlockTask *bt = arg;
+
+	G_Count(bt->geoms, bt->cnt, bt->centrex, bt->centrey, bt->cnts);
+}
+
+void QB_ScatterTask(Worker *worker, void *arg)
+{
+	BlockTask *bt = arg;
+
+	G_Scatter(bt->geoms, bt->cnt, bt->centrex, bt->centrey, bt->out, bt->cnts);
+}
+
+// Run task over every GEOMBLOCK of bts and wait for them all
+void QB_Blocks(Worker *worker, PoolTask task, BlockTask *bts, int nblock)
+{
+	int group = 0;
+
+	for (int bb = 0; bb < nblock; bb++) {
+		W_Spawn(worker, task, &bts[bb], &group);
+	}
+	W_Wait(worker, &group);
+}
+
+// As G_Split for more than GEOMBLOCK points: each block copies its
+// points to its own slots of each child's run
+void QB_Split(Worker *worker, BlockTask *bts, int nblock, float centrex, float centrey, int *cnts)
+{
+	int offs[4];
+
+	for (int bb = 0; bb < nblock; bb++) {
+		bts[bb].centrex = centrex;
+		bts[bb].centrey = centrey;
+	}
+	QB_Blocks(worker, QB_CountTask, bts, nblock);
+
+	memset(cnts, 0, 4 * sizeof(int));
+	for (int bb = 0; bb < nblock; bb++) {
+		for (int ii = 0; ii < 4; ii++) {
+			cnts[ii] += bts[bb].cnts[ii];
+		}
+	}
+	offs[0] = 0;
+	for (int ii = 1; ii < 4; ii++) {
+		offs[ii] = offs[ii - 1] + cnts[ii - 1];
+	}
+	for (int bb = 0; bb < nblock; bb++) {
+		for (int ii = 0; ii < 4; ii++) {
+			int cc = bts[bb].cnts[ii];
+			bts[bb].cnts[ii] = offs[ii];
+			offs[ii] += cc;
+		}
+	}
+
+	QB_Blocks(worker, QB_ScatterTask, bts, nblock);
+}
+
+void QB_Task(Worker *worker, void *arg);
+
+void QB_Spawn(Worker *worker, Build *build, Quad *quad, Geom **geoms, Geom **tmp, int cnt, int *group)
+{
+	BuildTask *bt = malloc(sizeof(BuildTask));
+
+	if (bt == NULL) {
+		fprintf(stderr, "BUG: QB_Spawn: no memory\n");
+		exit(1);
+	}
+	bt->build = build;
+	bt->quad = quad;
+	bt->geoms = geoms;
+	bt->tmp = tmp;
+	bt->cnt = cnt;
+
+	W_Spawn(worker, QB_Task, bt, group);
+}
+
+// As QB_FillWith, with the same result
+void QB_Task(Worker *worker, void *arg)
+{
+	BuildTask *bt = arg;
+	Build *build = bt->build;
+	Quad *quad = bt->quad;
+	Geom **geoms = bt->geoms;
+	Geom **tmp = bt->tmp;
+	Geom **split, **spare;
+	int cnt = bt->cnt;
+	int nblock = (cnt + GEOMBLOCK - 1) / GEOMBLOCK;
+	BlockTask *bts;
+	float xfsum, yfsum;
+	float centrex, centrey;
+	int cnts[4];
+	Quad *kids[4];
+	int group = 0;
+
+	free(bt);
+
+	quad->tree = build->tree ? &build->local[worker->id] : NULL;
+
+	if (cnt <= QBGRAIN) {
+		QB_FillWith(quad, geoms, tmp, cnt);
+		if (build->tree) {
+			QB_Own(quad, build->tree);
+		}
+		return;
+	}
+
+	if ((bts = calloc(nblock, sizeof(BlockTask))) == NULL) {
+		fprintf(stderr, "BUG: QB_Task: no memory\n");
+		exit(1);
+	}
+	for (int bb = 0; bb < nblock; bb++) {
+		bts[bb].geoms = geoms + bb * GEOMBLOCK;
+		bts[bb].cnt = cnt - bb * GEOMBLOCK < GEOMBLOCK ? cnt - bb * GEOMBLOCK : GEOMBLOCK;
+		bts[bb].out = tmp;
+	}
+
+	// as G_Centre
+	if (Q_Policy(quad) == Split_Mean) {
+		QB_Blocks(worker, QB_SumTask, bts, nblock);
+		xfsum = yfsum = 0.0;
+		for (int bb = 0; bb < nblock; bb++) {
+			xfsum += bts[bb].xfsum;
+			yfsum += bts[bb].yfsum;
 		}
-		else {
-			QL_Add(quad, geom);
+		Centre(xfsum, yfsum, cnt, &centrex, &centrey);
+	}
+	else {
+		G_Centre(quad, geoms, cnt, &centrex, &centrey);
+	}
+
+	if (Q_TooSmall(quad, centrex, centrey)) {
+		free(bts);
+		QB_FillWith(quad, geoms, tmp, cnt);
+		if (build->tree) {
+			QB_Own(quad, build->tree);
 		}
-		break;
-	case QUAD_SMALL:
-		if (leaf->full == leaf->size) {
-			QL_Grow(quad);
+		return;
+	}
+
+	if (cnt <= GEOMBLOCK) {
+		split = G_Split(geoms, tmp, cnt, centrex, centrey, cnts);
+	}
+	else {
+		QB_Split(worker, bts, nblock, centrex, centrey, cnts);
+		split = tmp;
+	}
+	free(bts);
+
+	QB_Kids(quad, centrex, centrey, kids);
+	QB_Node(quad, centrex, centrey, kids);
+	quad->tree = build->tree;
+
+	spare = split == geoms ? tmp : geoms;
+	for (int ii = 0, off = 0; ii < 4; off += cnts[ii++]) {
+		QB_Spawn(worker, build, kids[ii], split + off, spare ? spare + off : NULL, cnts[ii], &group);
+	}
+	W_Wait(worker, &group);
+}
+
+Quad *QB_BuildPool(Pool *pool, Tree *tree, Geom **geoms, int cnt, float left, float top, float width, float height)
+{
+	Quad *quad = TL_New(tree, left, top, width, height);
+	Geom **tmp = NULL;
+	Build build;
+	BuildTask *bt;
+
+	if (cnt > GEOMBLOCK && (tmp = malloc(cnt * sizeof(Geom *))) == NULL) {
+		fprintf(stderr, "BUG: QB_BuildPool: no memory\n");
+		exit(1);
+	}
+
+	build.tree = tree;
+	build.local = NULL;
+	if (tree && (build.local = calloc(pool->nworker, sizeof(Tree))) == NULL) {
+		fprintf(stderr, "BUG: QB_BuildPool: no memory\n");
+		exit(1);
+	}
+	for (int ii = 0; tree && ii < pool->nworker; ii++) {
+		A_Init(&build.local[ii].arena);
+		build.local[ii].config = tree->config;
+		build.local[ii].split = tree->split;
+	}
+
+	if ((bt = malloc(sizeof(BuildTask))) == NULL) {
+		fprintf(stderr, "BUG: QB_BuildPool: no memory\n");
+		exit(1);
+	}
+	bt->build = &build;
+	bt->quad = quad;
+	bt->geoms = geoms;
+	bt->tmp = tmp;
+	bt->cnt = cnt;
+	W_Run(pool, QB_Task, bt);
+
+	for (int ii = 0; tree && ii < pool->nworker; ii++) {
+		A_Adopt(&tree->arena, &build.local[ii].arena);
+		tree->counts.splits += build.local[ii].counts.splits;
+		tree->counts.smallsplits += build.local[ii].counts.smallsplits;
+		tree->counts.resizes += build.local[ii].counts.resizes;
+	}
+
+	free(build.local);
+	free(tmp);
+
+	return quad;
+}
+
+// As Q_Build, on a pool of threads. The tree is the same as Q_Build
+// would make. A NULL pool builds on the calling thread.
+Quad *Q_BuildPool(Pool *pool, Geom **geoms, int cnt, float left, float top, float width, float height)
+{
+	assert(geoms || cnt == 0);
+
+	if (pool == NULL) {
+		return Q_Build(geoms, cnt, left, top, width, height);
+	}
+
+	Geom **work = QB_Copy(geoms, cnt);
+	Quad *quad = QB_BuildPool(pool, NULL, work, cnt, left, top, width, height);
+
+	free(work);
+
+	return quad;
+}
+
+// Throw away the quads of a tree, but not its points, and build it again
+// over geoms, as Q_Build, splitting with the tree's policy. On pool if
+// there is one.
+void T_Fill(Pool *pool, Tree *tree, Geom **geoms, int cnt)
+{
+	assert(tree);
+	assert(tree->epoch == NULL);
+	assert(geoms || cnt == 0);
+
+	Quad *root = tree->root;
+	float left = root->left;
+	float top = root->top;
+	float width = root->width;
+	float height = root->height;
+
+	if (root->tag == QUAD_LOOSE) {
+		T_Reset(tree);
+		Q_AddBatch(tree->root, geoms, cnt);
+		return;
+	}
+
+	Geom **work = QB_Copy(geoms, cnt);
+
+	Q_Free(root);
+	if (pool) {
+		tree->root = QB_BuildPool(pool, tree, work, cnt, left, top, width, height);
+	}
+	else {
+		tree->root = QB_Build(tree, work, cnt, left, top, width, height);
+	}
+
+	if (tree->hash) {
+		H_Clear(tree->hash);
+		for (int ii = 0; ii < cnt; ii++) {
+			H_Add(tree->hash, geoms[ii]);
 		}
-		QL_Add(quad, geom);
-		break;
-	case QUAD_NODE:
-		switch (News(node->centrex, node->centrey, pt->xf, pt->yf)) {
-		case NEWS_NW:
-			news = node->nw;
-			break;
-		case NEWS_NE:
-			news = node->ne;
-			break;
-		case NEWS_SW:
-			news = node->sw;
-			break;
-		case NEWS_SE:
-			news = node->se;
-			break;
-		default:
-			fprintf(stderr, "BUG: Q_Add: unknown news\n");
+	}
+
+	free(work);
+}
+
+// As T_Build, on a pool of threads
+Tree *T_BuildPool(Pool *pool, Geom **geoms, int cnt, float left, float top, float width, float height)
+{
+	assert(geoms || cnt == 0);
+
+	Tree *tree = T_New(left, top, width, height);
+
+	T_Fill(pool, tree, geoms, cnt);
+
+	return tree;
+}
+
+// Give existing points new coordinates. A point that a descent to its
+// new position would find in the same leaf is updated in place; the rest
+// are removed, as Q_Remove, and added again together, as Q_AddBatch.
+// Returns the number of points that changed leaf.
+int Q_Move(Quad *quad, Geom **geoms, Pt *pts, int cnt)
+{
+	assert(quad);
+	assert(geoms || cnt == 0);
+	assert(pts || cnt == 0);
+
+	Geom **moved = NULL;
+	int nmoved = 0;
+	Geom *geom;
+	Quad *leaf;
+	Pt *pt;
+
+	if (quad->tree && quad->tree->epoch) {
+		return QS_Move(quad, geoms, pts, cnt);
+	}
+	if (quad->tag == QUAD_LOOSE) {
+		for (int ii = 0; ii < cnt; ii++) {
+			geom = geoms[ii];
+			assert(geom->tag == GEOM_POINT);
+			leaf = geom->quad;
+			if (!QX_Remove(quad, geom)) {
+				fprintf(stderr, "BUG: Q_Move: geom not in tree\n");
+				exit(1);
+			}
+			geom->pt = pts[ii];
+			QX_Add(quad, geom);
+			nmoved += geom->quad != leaf;
+		}
+		return nmoved;
+	}
+
+	for (int ii = 0; ii < cnt; ii++) {
+		geom = geoms[ii];
+		pt = &pts[ii];
+		assert(geom);
+		assert(geom->tag == GEOM_POINT);
+		assert(geom->quad);
+
+		// the descent decides, as leaf->left + leaf->width may round to
+		// the other side of the centre that bounds the leaf
+		leaf = geom->quad;
+		if (Q_Leaf(quad, pt->xf, pt->yf, NULL) == leaf) {
+			if (leaf->tree && leaf->tree->hash) {
+				H_Remove(leaf->tree->hash, geom);
+			}
+			geom->pt = *pt;
+			QL_Set(leaf, geom->slot, pt->xf, pt->yf, pt->zf);
+			if (leaf->tree && leaf->tree->hash) {
+				H_Add(leaf->tree->hash, geom);
+			}
+			continue;
+		}
+
+		if (moved == NULL && (moved = malloc((cnt - ii) * sizeof(Geom *))) == NULL) {
+			fprintf(stderr, "BUG: Q_Move: no memory\n");
+			exit(1);
+		}
+		if (!Q_Remove(quad, geom)) {
+			fprintf(stderr, "BUG: Q_Move: geom not in tree\n");
 			exit(1);
 		}
-		Q_Add(news, geom);
+		geom->pt = *pt;
+		moved[nmoved++] = geom;
+	}
+
+	Q_AddBatch(quad, moved, nmoved);
+	free(moved);
+
+	return nmoved;
+}
+
+#define FMAGIC "QUADTREE"
+#define FVERSION 1
+#define FALIGN(off) (((off) + 15) & ~(uint64_t) 15)
+
+void QF_Count(Quad *quad, uint32_t *nnode, uint32_t *npt)
+{
+	assert(quad);
+
+	switch (quad->tag) {
+	case QUAD_NODE:
+		*nnode += 4;
+		QF_Count(quad->node.nw, nnode, npt);
+		QF_Count(quad->node.ne, nnode, npt);
+		QF_Count(quad->node.sw, nnode, npt);
+		QF_Count(quad->node.se, nnode, npt);
+		break;
+	case QUAD_LEAF:
+	case QUAD_SMALL:
+		*npt += quad->leaf.full;
 		break;
 	default:
-		fprintf(stderr, "BUG: Q_Add: unknown tag: %d\n", quad->tag);
+		fprintf(stderr, "BUG: QF_Count: unknown tag: %d\n", quad->tag);
 		exit(1);
 	}
 }
 
-int Q_Find(Quad *quad, float xf, float yf, Geom **found)
+// Copy quad into node idx. Children are given the next four free node
+// slots and points the next free run of the columns.
+void QF_Lay(Frozen *frozen, Quad *quad, uint32_t idx, uint32_t *nextnode, uint32_t *nextpt)
 {
-	assert(quad);
-	assert(found);
+	FNode *fn = &frozen->node[idx];
 
 	switch (quad->tag) {
 	case QUAD_NODE:
-		Node *node = &quad->node;
-		switch (News(node->centrex, node->centrey, xf, yf)) {
-		case NEWS_NW:
-			quad = node->nw;
-			break;
-		case NEWS_NE:
-			quad = node->ne;
-			break;
-		case NEWS_SW:
-			quad = node->sw;
-			break;
-		case NEWS_SE:
-			quad = node->se;
-			break;
-		default:
-			fprintf(stderr, "BUG: Q_Find: unknown news\n");
-			exit(1);
-		}
-		return Q_Find(quad, xf, yf, found);
+		fn->centrex = quad->node.centrex;
+		fn->centrey = quad->node.centrey;
+		fn->first = *nextnode;
+		fn->cnt = FNODE;
+		*nextnode += 4;
+		QF_Lay(frozen, quad->node.nw, fn->first, nextnode, nextpt);
+		QF_Lay(frozen, quad->node.ne, fn->first + 1, nextnode, nextpt);
+		QF_Lay(frozen, quad->node.sw, fn->first + 2, nextnode, nextpt);
+		QF_Lay(frozen, quad->node.se, fn->first + 3, nextnode, nextpt);
+		break;
 	case QUAD_LEAF:
-	case QUAD_SMALL:
-		return QL_Find(quad, xf, yf, found);
+	case QUAD_SMALL: {
+		Leaf *leaf = &quad->leaf;
+		fn->centrex = fn->centrey = 0;
+		fn->first = *nextpt;
+		fn->cnt = leaf->full;
+		memcpy(frozen->xf + fn->first, leaf->xf, leaf->full * sizeof(float));
+		memcpy(frozen->yf + fn->first, leaf->yf, leaf->full * sizeof(float));
+		memcpy(frozen->zf + fn->first, leaf->zf, leaf->full * sizeof(float));
+		if (frozen->geom) {
+			memcpy(frozen->geom + fn->first, leaf->geom, leaf->full * sizeof(Geom *));
+		}
+		*nextpt += leaf->full;
+		break;
+	}
 	default:
-		fprintf(stderr, "BUG: Q_Find: unknown tag: %d\n", quad->tag);
+		fprintf(stderr, "BUG: QF_Lay: unknown tag: %d\n", quad->tag);
+		exit(1);
+	}
+}
+
+// Point the handle at the sections of the block starting at head
+void F_Attach(Frozen *frozen, FHead *head)
+{
+	char *block = (char *) head;
+
+	frozen->head = head;
+	frozen->node = (FNode *) (block + head->nodeoff);
+	frozen->xf = (float *) (block + head->xoff);
+	frozen->yf = (float *) (block + head->yoff);
+	frozen->zf = (float *) (block + head->zoff);
+}
+
+// Make a read-only copy of the tree below quad. The copy does not refer
+// to the tree, which may go on changing or be freed. The Geoms are
+// shared, as payload. Frozen trees are of points: returns NULL for a
+// loose tree.
+Frozen *Q_Freeze(Quad *quad)
+{
+	assert(quad);
+
+	if (quad->tag == QUAD_LOOSE) {
+		return NULL;
+	}
+
+	Frozen *frozen;
+	FHead head;
+	uint32_t nextnode, nextpt;
+
+	memset(&head, 0, sizeof(FHead));
+	memcpy(head.magic, FMAGIC, sizeof(head.magic));
+	head.version = FVERSION;
+	head.nnode = 1;
+	QF_Count(quad, &head.nnode, &head.npt);
+	head.left = quad->left;
+	head.top = quad->top;
+	head.width = quad->width;
+	head.height = quad->height;
+
+	head.nodeoff = FALIGN(sizeof(FHead));
+	head.xoff = FALIGN(head.nodeoff + (uint64_t) head.nnode * sizeof(FNode));
+	head.yoff = FALIGN(head.xoff + (uint64_t) head.npt * sizeof(float));
+	head.zoff = FALIGN(head.yoff + (uint64_t) head.npt * sizeof(float));
+	head.size = FALIGN(head.zoff + (uint64_t) head.npt * sizeof(float));
+
+	if ((frozen = calloc(1, sizeof(Frozen))) == NULL) {
+		fprintf(stderr, "BUG: Q_Freeze: no memory\n");
+		exit(1);
+	}
+	FHead *block = calloc(1, head.size);
+	frozen->geom = calloc(head.npt + 1, sizeof(Geom *));
+	if (block == NULL || frozen->geom == NULL) {
+		fprintf(stderr, "BUG: Q_Freeze: no memory\n");
 		exit(1);
 	}
+	*block = head;
+	F_Attach(frozen, block);
+
+	nextnode = 1;
+	nextpt = 0;
+	QF_Lay(frozen, quad, 0, &nextnode, &nextpt);
+	assert(nextnode == head.nnode);
+	assert(nextpt == head.npt);
+
+	return frozen;
+}
+
+void F_Free(Frozen *frozen)
+{
+	if (frozen == NULL) {
+		return;
+	}
+
+	if (frozen->mapped) {
+		munmap(frozen->head, frozen->mapped);
+	}
+	else {
+		free(frozen->head);
+	}
+	free(frozen->geom);
+	free(frozen);
+}
+
+// Write the block to path. It is written to path.tmp and renamed over
+// path, so processes opening path see either the old tree or the new.
+// Returns 1 on success, 0 with errno set on failure.
+int F_Write(Frozen *frozen, char *path)
+{
+	assert(frozen);
+	assert(path);
+
+	size_t len = strlen(path);
+	char *tmp = malloc(len + 5);
+	FILE *fp;
+	int ok;
+
+	if (tmp == NULL) {
+		return 0;
+	}
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		free(tmp);
+		return 0;
+	}
+	ok = fwrite(frozen->head, frozen->head->size, 1, fp) == 1;
+	ok = fclose(fp) == 0 && ok;
+	ok = ok && rename(tmp, path) == 0;
+	if (!ok) {
+		int err = errno;
+		unlink(tmp);
+		errno = err;
+	}
+
+	free(tmp);
+
+	return ok;
+}
+
+// The header describes a block of size bytes whose sections all fit
+int FH_Valid(FHead *head, uint64_t size)
+{
+	uint64_t npt = head->npt;
+
+	return
+		memcmp(head->magic, FMAGIC, sizeof(head->magic)) == 0 &&
+		head->version == FVERSION &&
+		head->size == size &&
+		head->nnode >= 1 &&
+		head->nodeoff >= sizeof(FHead) && head->nodeoff % 16 == 0 &&
+		head->nodeoff + (uint64_t) head->nnode * sizeof(FNode) <= size &&
+		head->xoff % 16 == 0 && head->xoff + npt * sizeof(float) <= size &&
+		head->yoff % 16 == 0 && head->yoff + npt * sizeof(float) <= size &&
+		head->zoff % 16 == 0 && head->zoff + npt * sizeof(float) <= size;
+}
+
+// Map a file written by F_Write and query it in place. The mapping is
+// read-only and shared, so every process that opens the same file uses
+// the same pages of the page cache. The file must come from a trusted
+// writer: only the header is checked.
+// Returns NULL with errno set on failure.
+Frozen *Q_Open(char *path)
+{
+	assert(path);
+
+	Frozen *frozen;
+	struct stat st;
+	void *block;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t) sizeof(FHead)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	block = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (block == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (!FH_Valid(block, st.st_size)) {
+		munmap(block, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((frozen = calloc(1, sizeof(Frozen))) == NULL) {
+		munmap(block, st.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	F_Attach(frozen, block);
+	frozen->mapped = st.st_size;
+
+	return frozen;
+}
+
+// Same choice as News: 0 nw, 1 ne, 2 sw, 3 se
+int FN_Kid(FNode *fn, float xf, float yf)
+{
+	return !(xf < fn->centrex) + 2 * !(yf < fn->centrey);
+}
+
+// Returns the index of the point within almost() of (xf, yf), or -1
+int F_Find(Frozen *frozen, float xf, float yf)
+{
+	assert(frozen);
+
+	FNode *fn = frozen->node;
+	int ii;
+
+	while (fn->cnt == FNODE) {
+		fn = &frozen->node[fn->first + FN_Kid(fn, xf, yf)];
+	}
+
+	ii = S_Find(frozen->xf + fn->first, frozen->yf + fn->first, fn->cnt, xf, yf);
+
+	return ii < 0 ? -1 : (int) fn->first + ii;
+}
+
+typedef struct tFQueryRect FQueryRect;
+
+struct tFQueryRect {
+	float left, top, right, bottom;
+	FVisit visit;
+	void *arg;
+	int cnt;
+	int stop;
+};
+
+void FN_QueryRect(Frozen *frozen, uint32_t idx, FQueryRect *qr)
+{
+	FNode *fn = &frozen->node[idx];
+	int hits[SCANCHUNK];
+	int cnt, nhit;
+
+	if (qr->stop) {
+		return;
+	}
+
+	if (fn->cnt == FNODE) {
+		// as QN_QueryRect
+		if (qr->top < fn->centrey) {
+			if (qr->left < fn->centrex) {
+				FN_QueryRect(frozen, fn->first, qr);
+			}
+			if (qr->right > fn->centrex) {
+				FN_QueryRect(frozen, fn->first + 1, qr);
+			}
+		}
+		if (qr->bottom > fn->centrey) {
+			if (qr->left < fn->centrex) {
+				FN_QueryRect(frozen, fn->first + 2, qr);
+			}
+			if (qr->right > fn->centrex) {
+				FN_QueryRect(frozen, fn->first + 3, qr);
+			}
+		}
+		return;
+	}
+
+	for (uint32_t from = 0; from < fn->cnt && !qr->stop; from += SCANCHUNK) {
+		cnt = fn->cnt - from < SCANCHUNK ? fn->cnt - from : SCANCHUNK;
+		nhit = S_Rect(frozen->xf + fn->first + from, frozen->yf + fn->first + from, cnt, qr->left, qr->top, qr->right, qr->bottom, hits);
+		for (int ii = 0; ii < nhit && !qr->stop; ii++) {
+			qr->cnt++;
+			if (qr->visit && !qr->visit(frozen, fn->first + from + hits[ii], qr->arg)) {
+				qr->stop = 1;
+			}
+		}
+	}
+}
+
+// As Q_QueryRect
+int F_QueryRect(Frozen *frozen, float left, float top, float width, float height, FVisit visit, void *arg)
+{
+	assert(frozen);
+
+	FQueryRect qr;
+
+	if (width <= 0 || height <= 0) {
+		return 0;
+	}
+
+	qr.left = left;
+	qr.top = top;
+	qr.right = left + width;
+	qr.bottom = top + height;
+	qr.visit = visit;
+	qr.arg = arg;
+	qr.cnt = 0;
+	qr.stop = 0;
+
+	FN_QueryRect(frozen, 0, &qr);
+
+	return qr.cnt;
+}
+
+typedef struct tFQueryBuf FQueryBuf;
+
+struct tFQueryBuf {
+	int *out;
+	int max, full;
+};
+
+int F_QueryBufVisit(Frozen *frozen, int idx, void *arg)
+{
+	FQueryBuf *buf = arg;
+
+	if (buf->full < buf->max) {
+		buf->out[buf->full] = idx;
+	}
+	buf->full++;
+
+	return 1;
+}
+
+// As Q_QueryRectBuf, storing point indexes
+int F_QueryRectBuf(Frozen *frozen, float left, float top, float width, float height, int *out, int max)
+{
+	assert(frozen);
+	assert(out || max == 0);
+
+	FQueryBuf buf;
+
+	buf.out = out;
+	buf.max = max;
+	buf.full = 0;
+
+	F_QueryRect(frozen, left, top, width, height, F_QueryBufVisit, &buf);
+
+	return buf.full;
+}
+
+// As Q_Nearest, storing point indexes
+int F_Nearest(Frozen *frozen, float xf, float yf, int k, int *out)
+{
+	assert(frozen);
+	assert(out);
+
+	Nearest nn;
+	Cell cell;
+	FNode *fn;
+	float dx, dy;
+
+	if (k <= 0) {
+		return 0;
+	}
+
+	QK_Init(&nn, xf, yf, k, NULL, out);
+	QK_PushCell(&nn, NULL, 0, -INFINITY, -INFINITY, INFINITY, INFINITY);
+
+	while (nn.ncell > 0) {
+		QK_PopCell(&nn, &cell);
+		if (QK_Done(&nn, &cell)) {
+			break;
+		}
+
+		fn = &frozen->node[cell.node];
+		if (fn->cnt == FNODE) {
+			QK_PushKids(&nn, &cell, fn->centrex, fn->centrey, NULL, fn->first);
+			continue;
+		}
+		for (uint32_t ii = fn->first; ii < fn->first + fn->cnt; ii++) {
+			dx = frozen->xf[ii] - xf;
+			dy = frozen->yf[ii] - yf;
+			QK_Offer(&nn, NULL, ii, dx * dx + dy * dy);
+		}
+	}
+
+	return QK_Finish(&nn);
 }
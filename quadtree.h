@@ -1,12 +1,27 @@
 #ifndef QUADTREE_H
 #define QUADTREE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
 typedef struct tPoint Pt;
+typedef struct tRect Rect;
+typedef struct tSegment Seg;
 typedef struct tGeom Geom;
+typedef struct tQuad Quad;
 
+// Points go in any tree. Rects and segments, which have extent, only go
+// in loose trees, see T_NewLoose. Loose trees take the same adds, moves,
+// finds and nearest queries, which match points only in Q_Find, but
+// Q_Freeze returns NULL for one, the joins refuse one and T_Share,
+// T_Writers and T_Hash are not for them.
 enum {
 	GEOM_NONE,
 	GEOM_POINT,
+	GEOM_RECT,
+	GEOM_SEGMENT,
 	GEOM_LAST
 };
 
@@ -14,44 +29,364 @@ struct tPoint {
 	float xf, yf, zf;
 };
 
+struct tRect {
+	float left, top, width, height;
+};
+
+struct tSegment {
+	float x0, y0, x1, y1;
+};
+
+// A geom is in at most one tree at a time. quad and slot say where, and
+// are kept up to date as points move between leaves.
 struct tGeom {
 	int tag;
 	union {
 		Pt pt;
+		Rect rect;
+		Seg seg;
 	};
+	Quad *quad;		// leaf holding the geom, NULL when not in a tree
+	int slot;		// index of the geom in that leaf
 };
 
 typedef struct tLeaf Leaf;
 typedef struct tNode Node;
-typedef struct tQuad Quad;
+typedef struct tLoose Loose;
+typedef struct tChunk Chunk;
+typedef struct tArena Arena;
+typedef struct tTree Tree;
+typedef struct tEpoch Epoch;
+typedef struct tRetired Retired;
+typedef struct tHash Hash;
+typedef struct tConfig Config;
+typedef struct tHashEntry HashEntry;
+typedef struct tCounts Counts;
+typedef struct tStats Stats;
+typedef struct tTrace Trace;
 
 enum {
 	QUAD_NONE,
 	QUAD_LEAF,
 	QUAD_SMALL,
 	QUAD_NODE,
+	QUAD_LOOSE,
 	QUAD_LAST
 };
 
+// Defaults for T_New, and for quads from plain calloc, see Config
 #define LEAFMINSIZE 10
+#define LEAFGROWTH 1.5
+#define QUADMINEXTENT 10
 
+// Coordinates are held inline, one column per axis, so scans never leave
+// the leaf. geom is the payload column: the geometry each point was added
+// with, returned by lookups. All four columns share one block.
+//
+// A small leaf, which can grow without bound, also hashes its points by
+// position so that lookups need not scan it. index holds a chain of slots
+// per bucket, see QL_Index.
 struct tLeaf {
 	int size, full;
 	Geom **geom;
+	float *xf, *yf, *zf;
+	int *index;		// NULL unless QUAD_SMALL
 };
 
 struct tNode {
-	int centrex, centrey;
+	float centrex, centrey;
+	Quad *nw, *ne, *sw, *se;
+};
+
+// A quad of a loose tree. Each geom is held by the smallest quad that
+// has its centre and is at least as wide and as high as it, so no geom
+// is held twice. A geom may reach past its quad by up to half the quad's
+// width or height, and queries look that far around each quad. bounds
+// holds the left, top, right and bottom of every geom, one column each,
+// in one block with the payload. Children are made when first needed.
+struct tLoose {
+	int size, full;
+	Geom **geom;
+	float *left, *top, *right, *bottom;
 	Quad *nw, *ne, *sw, *se;
 };
 
 struct tQuad {
 	int tag;
-	int left, top, width, height;
+	float left, top, width, height;
+	int lock;		// held by a writer adding to the leaf, see T_Writers
+	Tree *tree;		// NULL for quads from plain calloc
 	union {
 		Leaf leaf;
 		Node node;
+		Loose loose;
 	};
 };
 
+// Blocks are rounded up to a size class, see A_Class, and recycled
+// through one free list per class. Chunks are kept across A_Reset so a
+// reset tree refills without going back to malloc.
+#define ARENACHUNK (1 << 20)
+#define ARENACLASSES 128
+
+struct tChunk {
+	Chunk *next;
+	size_t size;
+};
+
+struct tArena {
+	Chunk *chunks;		// all regular chunks, oldest first
+	Chunk *chunk;		// chunk being carved
+	char *next, *end;
+	Chunk *large;		// blocks too big for a chunk
+	void *free[ARENACLASSES];
+	size_t bytes;		// bytes obtained from malloc
+};
+
+// A shared tree has one writer and up to EPOCHREADERS readers, which take
+// no locks. The writer never changes a quad in place in a way a reader
+// could see half done: it builds a replacement and publishes it with one
+// store. What it replaces is retired, and released once every reader
+// that might still hold it has left the tree.
+#define EPOCHREADERS 64
+
+struct tRetired {
+	void *ptr;
+	size_t size;
+	uint64_t epoch;		// epoch it was retired in
+};
+
+struct tEpoch {
+	uint64_t epoch;		// advanced by the writer
+	int nreader;		// reader slots handed out
+	Retired *retired;
+	int nretired, maxretired;
+	// epoch each reader entered in, 0 outside, one cache line each
+	struct {
+		uint64_t epoch;
+		char pad[56];
+	} reader[EPOCHREADERS];
+};
+
+// The shape of the leaves of a tree, fixed when it is made. Leaves of 16,
+// 32 or 64 points are looked up by scans of a fixed length.
+struct tConfig {
+	int leafsize;		// points a leaf holds before it splits
+	float growth;		// factor a small leaf grows by when full
+	float minextent;	// no split leaves a child narrower than this
+};
+
+// Running totals of what a tree has done to its leaves, since it was
+// made. Kept with relaxed atomics, as writers may run side by side.
+struct tCounts {
+	long splits;		// leaves split into a node of four leaves
+	long smallsplits;	// leaves made small, being too narrow to split
+	long resizes;		// small leaves moved to a new block
+};
+
+#define STATSDEPTH 32
+#define STATSFILL 10
+
+// The shape of a tree at one moment, see Q_Stats. Every quad of a loose
+// tree holds geoms, and counts as a leaf of them, children or not.
+struct tStats {
+	long nnode, nleaf, nsmall, npt;
+	int maxdepth;
+	int maxsmall;		// slots in the largest small leaf
+	long depth[STATSDEPTH];	// leaves at each depth, the last also counts deeper ones
+	long fill[STATSFILL + 1];	// leaves by full * STATSFILL / size
+	size_t bytes;		// taken from malloc, see Q_Stats
+	Counts counts;		// zero for quads from plain calloc
+};
+
+#ifdef QUAD_TRACE
+
+// Timings of the operations of each thread, built in with -DQUAD_TRACE
+// and left out otherwise. A thread's trace is made on its first traced
+// operation and kept until exit, and only that thread writes to it, so
+// recording takes no locks and no atomic read-modify-writes. Readers may
+// see a histogram a few operations behind.
+//
+// Reading the clock costs about as much as a find, so only one add or
+// find in TRACESAMPLE of each thread is timed. Every split and grow is
+// timed, and every add and find counted by depth.
+//
+// Every histogram has a bin per power of two: bin b counts values v with
+// 2^b <= v < 2^(b+1), bin 0 also counting 0, the last bin counting
+// anything larger.
+
+enum {
+	TRACE_ADD,		// Q_Add
+	TRACE_FIND,		// Q_Find
+	TRACE_SPLIT,		// QL_Split and QS_Split, within an add
+	TRACE_GROW,		// QL_Grow, within an add
+	TRACE_LAST
+};
+
+#define TRACEBINS 32
+#define TRACESAMPLE 16
+
+struct tTrace {
+	Trace *next;		// the trace of another thread
+	long ns[TRACE_LAST][TRACEBINS];	// operations timed, by nanoseconds taken
+	long depth[TRACE_FIND + 1][TRACEBINS];	// adds and finds by nodes descended through
+	long scan[TRACEBINS];	// leaf scans of finds by points scanned
+};
+
+typedef void (*TraceVisit)(Trace *trace, void *arg);
+
+#endif // QUAD_TRACE
+
+// The exact positions of the points of a tree, so that asking whether a
+// point is there need not descend the tree, see T_Hash. Open addressing
+// with linear probing in one array, coordinates held in the entries so a
+// probe stays in the array. A NULL geom marks a free entry.
+struct tHashEntry {
+	float xf, yf;
+	Geom *geom;
+};
+
+struct tHash {
+	HashEntry *entry;
+	int size, full;		// size is a power of two
+};
+
+// Picks where a leaf over (left, top, width, height) is split, from the
+// coordinates of its cnt points. It may reorder xf and yf.
+typedef void (*SplitPolicy)(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey);
+
+struct tTree {
+	Arena arena;
+	Quad *root;
+	Config config;
+	SplitPolicy split;	// NULL for Split_Mean, see T_Split
+	Epoch *epoch;		// NULL unless the tree is shared
+	int writers;		// concurrent writers allowed, see T_Writers
+	Hash *hash;		// NULL unless hashed, see T_Hash
+	Counts counts;
+	int lock;		// on the arena, while writers are allowed
+};
+
+typedef struct tFNode FNode;
+typedef struct tFHead FHead;
+typedef struct tFrozen Frozen;
+
+// A frozen tree is a read-only copy of a tree in one block. Nodes sit in
+// one array and points in per-axis columns in traversal order, and every
+// link is an index, so the block does not depend on where it is loaded.
+
+#define FNODE 0xffffffffu
+
+// The four children of a node are stored together: nw, ne, sw, se.
+struct tFNode {
+	float centrex, centrey;
+	uint32_t first;		// first child of a node, first point of a leaf
+	uint32_t cnt;		// number of points in a leaf, FNODE for a node
+};
+
+// Offsets are in bytes from the start of the header. The block is also
+// the file format, in native byte order, so a file can be mapped and
+// queried where it lies.
+struct tFHead {
+	char magic[8];
+	uint32_t version;
+	uint32_t nnode, npt;
+	float left, top, width, height;
+	uint32_t pad;
+	uint64_t nodeoff, xoff, yoff, zoff;
+	uint64_t size;
+};
+
+struct tFrozen {
+	FHead *head;
+	FNode *node;
+	float *xf, *yf, *zf;
+	Geom **geom;		// payload by point index, NULL if opened from a file
+	size_t mapped;		// length of the file mapping, 0 if on the heap
+};
+
+// Called once for each geometry reported by a query.
+// Return 1 to continue the query, 0 to stop it early.
+typedef int (*QVisit)(Geom *geom, void *arg);
+
+// Called once for each pair reported by a join, from any thread of the
+// pool it runs on. Return 1 to continue the join, 0 to stop it early.
+typedef int (*QPair)(Geom *aa, Geom *bb, void *arg);
+
+// As QVisit, for a frozen tree, which reports points by index
+typedef int (*FVisit)(Frozen *frozen, int idx, void *arg);
+
+void A_Init(Arena *arena);
+void *A_Alloc(Arena *arena, size_t size);
+void A_Release(Arena *arena, void *ptr, size_t size);
+void A_Adopt(Arena *arena, Arena *src);
+void A_Reset(Arena *arena);
+void A_Free(Arena *arena);
+
+Tree *T_New(float left, float top, float width, float height);
+Tree *T_NewConfig(Config *config, float left, float top, float width, float height);
+Tree *T_NewLoose(float left, float top, float width, float height);
+Tree *T_Build(Geom **geoms, int cnt, float left, float top, float width, float height);
+Tree *T_BuildPool(Pool *pool, Geom **geoms, int cnt, float left, float top, float width, float height);
+Geom *TP_New(Tree *tree, float xf, float yf, float zf);
+void T_Reset(Tree *tree);
+void T_Free(Tree *tree);
+void T_Share(Tree *tree);
+void T_Writers(Tree *tree, int on);
+void T_Split(Tree *tree, SplitPolicy split);
+void T_Fill(Pool *pool, Tree *tree, Geom **geoms, int cnt);
+void T_Hash(Tree *tree, int on);
+int T_FindExact(Tree *tree, float xf, float yf, Geom **found);
+int T_Reader(Tree *tree);
+Quad *T_Enter(Tree *tree, int reader);
+void T_Leave(Tree *tree, int reader);
+void T_Collect(Tree *tree);
+
+void Split_Mean(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey);
+void Split_Median(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey);
+void Split_Mid(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey);
+void Split_Slide(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey);
+
+Geom *P_New(float xf, float yf, float zf);
+Geom *Rect_New(float left, float top, float width, float height);
+Geom *Seg_New(float x0, float y0, float x1, float y1);
+int G_Intersects(Geom *aa, Geom *bb);
+Quad *L_New(float left, float top, float width, float height);
+Quad *N_New(float left, float top, float width, float height);
+void Q_Init(Quad *quad, int tag, float left, float top, float width, float height);
+void Q_Add(Quad *quad, Geom *geom);
+void Q_AddBatch(Quad *quad, Geom **geoms, int cnt);
+int Q_Remove(Quad *quad, Geom *geom);
+int Q_Move(Quad *quad, Geom **geoms, Pt *pts, int cnt);
+Quad *Q_Build(Geom **geoms, int cnt, float left, float top, float width, float height);
+Quad *Q_BuildPool(Pool *pool, Geom **geoms, int cnt, float left, float top, float width, float height);
+void Q_Free(Quad *quad);
+int Q_Find(Quad *quad, float xf, float yf, Geom **found);
+int Q_FindBatch(Quad *quad, float *xf, float *yf, int cnt, Geom **found);
+int Q_QueryRect(Quad *quad, float left, float top, float width, float height, QVisit visit, void *arg);
+int Q_QueryRectBuf(Quad *quad, float left, float top, float width, float height, Geom **out, int max);
+int Q_Nearest(Quad *quad, float xf, float yf, int k, Geom **out);
+int Q_Intersect(Quad *quad, Geom *geom, QVisit visit, void *arg);
+long Q_SelfJoin(Pool *pool, Quad *quad, float dist, QPair visit, void *arg);
+long Q_Join(Pool *pool, Quad *aa, Quad *bb, float dist, QPair visit, void *arg);
+int Q_FindPool(Pool *pool, Quad *quad, float *xf, float *yf, int cnt, Geom **found, int chunk);
+int Q_NearestPool(Pool *pool, Quad *quad, float *xf, float *yf, int cnt, int k, Geom **out, int *nout, int chunk);
+int Q_QueryRectPool(Pool *pool, Quad *quad, float *left, float *top, float *width, float *height, int cnt, Geom **out, int max, int *nout, int chunk);
+void Q_Stats(Quad *quad, Stats *stats);
+
+#ifdef QUAD_TRACE
+void Trace_Each(TraceVisit visit, void *arg);
+void Trace_Sum(Trace *sum);
+void Trace_Dump(void);
+#endif
+
+Frozen *Q_Freeze(Quad *quad);
+int F_Find(Frozen *frozen, float xf, float yf);
+int F_QueryRect(Frozen *frozen, float left, float top, float width, float height, FVisit visit, void *arg);
+int F_QueryRectBuf(Frozen *frozen, float left, float top, float width, float height, int *out, int max);
+int F_Nearest(Frozen *frozen, float xf, float yf, int k, int *out);
+int F_Write(Frozen *frozen, char *path);
+Frozen *Q_Open(char *path);
+void F_Free(Frozen *frozen);
+
 #endif // QUADTREE_H
@@ -0,0 +1,246 @@
+/*
+
+Time the tree on generated point sets, so that a change can be measured
+against a baseline taken the same way.
+
+usage: quadtree_bench [maxpts] [leafsize] [seed]
+
+Runs every distribution at 10^3, 10^4, ... points up to maxpts (default
+10^6, up to 10^8 given the memory), into trees with leaves of leafsize
+points (default LEAFMINSIZE). The distributions are:
+
+	uniform		spread evenly over the tree
+	gauss		gaussian clusters around a few dozen centres
+	road		strung along line segments, a little off the line
+	dup		piled on a thousand positions
+
+Prints one line per distribution and size:
+
+	dist npts insert_mpps find_p50_ns find_p90_ns find_p99_ns find_mpps rect_kqps depth bytes_pt
+
+insert is Q_Add of every point into an empty tree, in millions of points
+a second. The find percentiles time single Q_Find calls of points in the
+tree, and find_mpps a run of them back to back. rect is Q_QueryRect of
+windows that would hold 64 points if the points were uniform, in
+thousands of queries a second. depth is that of the deepest leaf, and
+bytes_pt everything the tree took from malloc over the number of points.
+
+Built with make DEFS=-DQUAD_TRACE, it ends with the lines of Trace_Dump.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "quadtree.h"
+
+#define BENCHEXTENT 1000.0
+#define BENCHSAMPLE 10000	// single finds timed for the percentiles
+#define BENCHFINDS 1000000	// finds timed back to back
+#define BENCHRECTS 10000
+
+double Bench_Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+volatile int Bench_Sink;
+
+// uniform in [0, 1)
+double Bench_Unit(void)
+{
+	return rand() / (RAND_MAX + 1.0);
+}
+
+float Bench_Clamp(double vf)
+{
+	return vf < 0 ? 0 : vf >= BENCHEXTENT ? BENCHEXTENT - 0.001 : vf;
+}
+
+void Bench_Uniform(float *xf, float *yf, int npts)
+{
+	for (int ii = 0; ii < npts; ii++) {
+		xf[ii] = Bench_Unit() * BENCHEXTENT;
+		yf[ii] = Bench_Unit() * BENCHEXTENT;
+	}
+}
+
+void Bench_Gauss(float *xf, float *yf, int npts)
+{
+	double centrex[32], centrey[32], sigma[32];
+
+	for (int cc = 0; cc < 32; cc++) {
+		centrex[cc] = Bench_Unit() * BENCHEXTENT;
+		centrey[cc] = Bench_Unit() * BENCHEXTENT;
+		sigma[cc] = BENCHEXTENT * (0.002 + Bench_Unit() * 0.02);
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		int cc = rand() % 32;
+		// Box-Muller
+		double rr = sqrt(-2 * log(1 - Bench_Unit())) * sigma[cc];
+		double aa = 2 * M_PI * Bench_Unit();
+		xf[ii] = Bench_Clamp(centrex[cc] + rr * cos(aa));
+		yf[ii] = Bench_Clamp(centrey[cc] + rr * sin(aa));
+	}
+}
+
+void Bench_Road(float *xf, float *yf, int npts)
+{
+	double ends[64][4];
+
+	for (int rr = 0; rr < 64; rr++) {
+		for (int ee = 0; ee < 4; ee++) {
+			ends[rr][ee] = Bench_Unit() * BENCHEXTENT;
+		}
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		int rr = rand() % 64;
+		double along = Bench_Unit();
+		xf[ii] = Bench_Clamp(ends[rr][0] + (ends[rr][2] - ends[rr][0]) * along + Bench_Unit() * 0.5 - 0.25);
+		yf[ii] = Bench_Clamp(ends[rr][1] + (ends[rr][3] - ends[rr][1]) * along + Bench_Unit() * 0.5 - 0.25);
+	}
+}
+
+void Bench_Dup(float *xf, float *yf, int npts)
+{
+	float spotx[1000], spoty[1000];
+
+	Bench_Uniform(spotx, spoty, 1000);
+	for (int ii = 0; ii < npts; ii++) {
+		int ss = rand() % 1000;
+		xf[ii] = spotx[ss];
+		yf[ii] = spoty[ss];
+	}
+}
+
+typedef struct tDist Dist;
+
+struct tDist {
+	char *name;
+	void (*make)(float *xf, float *yf, int npts);
+};
+
+Dist Dists[] = {
+	{ "uniform", Bench_Uniform },
+	{ "gauss", Bench_Gauss },
+	{ "road", Bench_Road },
+	{ "dup", Bench_Dup },
+	{ NULL, NULL }
+};
+
+int Bench_Visit(Geom *geom, void *arg)
+{
+	(*(int *) arg)++;
+	return 1;
+}
+
+int Bench_Compare(const void *aa, const void *bb)
+{
+	double da = *(const double *) aa, db = *(const double *) bb;
+
+	return da < db ? -1 : da > db;
+}
+
+void Bench_Run(Dist *dist, int npts, Config *config)
+{
+	float *xf = malloc(npts * sizeof(float));
+	float *yf = malloc(npts * sizeof(float));
+	double *sample = malloc(BENCHSAMPLE * sizeof(double));
+	Tree *tree = T_NewConfig(config, 0, 0, BENCHEXTENT, BENCHEXTENT);
+	Geom *found;
+	double start;
+	int sink = 0;
+
+	if (xf == NULL || yf == NULL || sample == NULL) {
+		fprintf(stderr, "quadtree_bench: no memory for %d points\n", npts);
+		exit(1);
+	}
+
+	dist->make(xf, yf, npts);
+
+	// the points are allocated beforehand so that only Q_Add is timed
+	Geom **geoms = malloc(npts * sizeof(Geom *));
+	if (geoms == NULL) {
+		fprintf(stderr, "quadtree_bench: no memory for %d points\n", npts);
+		exit(1);
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = TP_New(tree, xf[ii], yf[ii], ii);
+	}
+
+	start = Bench_Now();
+	for (int ii = 0; ii < npts; ii++) {
+		Q_Add(tree->root, geoms[ii]);
+	}
+	double insert = npts / (Bench_Now() - start) * 1e3;
+
+	for (int ii = 0; ii < BENCHSAMPLE; ii++) {
+		int pp = rand() % npts;
+		start = Bench_Now();
+		sink += Q_Find(tree->root, xf[pp], yf[pp], &found);
+		sample[ii] = Bench_Now() - start;
+	}
+	qsort(sample, BENCHSAMPLE, sizeof(double), Bench_Compare);
+
+	start = Bench_Now();
+	for (int ii = 0; ii < BENCHFINDS; ii++) {
+		int pp = (int) ((long long) ii * 7919 % npts);
+		sink += Q_Find(tree->root, xf[pp], yf[pp], &found);
+	}
+	double finds = BENCHFINDS / (Bench_Now() - start) * 1e3;
+
+	float side = BENCHEXTENT * sqrt(64.0 / npts);
+	start = Bench_Now();
+	for (int ii = 0; ii < BENCHRECTS; ii++) {
+		int pp = rand() % npts;
+		Q_QueryRect(tree->root, xf[pp] - side / 2, yf[pp] - side / 2, side, side, Bench_Visit, &sink);
+	}
+	double rects = BENCHRECTS / (Bench_Now() - start) * 1e6;
+
+	Bench_Sink = sink;
+
+	Stats stats;
+	Q_Stats(tree->root, &stats);
+
+	printf("%s %d %.3f %.0f %.0f %.0f %.3f %.1f %d %.1f\n", dist->name, npts, insert,
+		sample[BENCHSAMPLE / 2], sample[BENCHSAMPLE * 9 / 10], sample[BENCHSAMPLE * 99 / 100],
+		finds, rects, stats.maxdepth, (double) stats.bytes / npts);
+	fflush(stdout);
+
+	T_Free(tree);
+	free(geoms);
+	free(sample);
+	free(yf);
+	free(xf);
+}
+
+int main(int argc, char **argv)
+{
+	long long maxpts = argc > 1 ? atoll(argv[1]) : 1000000;
+	Config config = { argc > 2 ? atoi(argv[2]) : LEAFMINSIZE, LEAFGROWTH, QUADMINEXTENT };
+	int seed = argc > 3 ? atoi(argv[3]) : 1;
+
+	if (maxpts < 1000 || maxpts > 100000000 || config.leafsize < 1) {
+		fprintf(stderr, "usage: quadtree_bench [maxpts] [leafsize] [seed]\n");
+		return 1;
+	}
+
+	printf("dist npts insert_mpps find_p50_ns find_p90_ns find_p99_ns find_mpps rect_kqps depth bytes_pt\n");
+	for (Dist *dist = Dists; dist->name; dist++) {
+		for (long long npts = 1000; npts <= maxpts; npts *= 10) {
+			srand(seed);
+			Bench_Run(dist, npts, &config);
+		}
+	}
+#ifdef QUAD_TRACE
+	Trace_Dump();
+#endif
+
+	return 0;
+}
@@ -3,17 +3,17 @@
 Geom *P_New(float xf, float yf, float zf)
 
 int almost(int aa, float bb)
-int News(int centrex, int centrey, float xf, float yf)
-void Q_Init(Quad *quad, int tag, int left, int top, int width, int height)
-Quad *L_New(int left, int top, int width, int height)
-Quad *N_New(int left, int top, int width, int height)
+int News(float centrex, float centrey, float xf, float yf)
+void Q_Init(Quad *quad, int tag, float left, float top, float width, float height)
+Quad *L_New(float left, float top, float width, float height)
+Quad *N_New(float left, float top, float width, float height)
 
-void QL_Centre(Quad *quad, int *centrex, int *centrey)
+void QL_Centre(Quad *quad, float *centrex, float *centrey)
 
 void QL_Resize(Quad *quad, int newsize)
 void QL_Grow(Quad *quad)
 
-void QL_SplitLarge(Quad *quad, int centrex, int centrey)
+void QL_SplitLarge(Quad *quad, float centrex, float centrey)
 void QL_SplitSmall(Quad *quad)
 void QL_Split(Quad *quad)
 
@@ -26,9 +26,13 @@ void QL_Add(Quad *quad, Geom *geom)
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "quadtree_test.h"
+#include "scan.h"
 
 char *Util_G_Tag(int tag)
 {
@@ -117,8 +121,8 @@ void QN_Dump(Quad *quad)
 	Node *node = &quad->node;
 
 	printf("Node @ %p\n", node);
-	printf("\tcentrex: %d\n", node->centrex);
-	printf("\tcentrey: %d\n", node->centrey);
+	printf("\tcentrex: %f\n", node->centrex);
+	printf("\tcentrey: %f\n", node->centrey);
 	printf("\tnw: %p\n", node->nw);
 	printf("\tne: %p\n", node->ne);
 	printf("\tsw: %p\n", node->sw);
@@ -144,10 +148,10 @@ void Q_Dump(Quad *quad)
 
 	printf("Quad @ %p\n", quad);
 	printf("\ttag: %d (%s)\n", quad->tag, Util_Q_Tag(quad->tag));
-	printf("\tleft: %d\n", quad->left);
-	printf("\ttop: %d\n", quad->top);
-	printf("\twidth: %d\n", quad->width);
-	printf("\theight: %d\n", quad->height);
+	printf("\tleft: %f\n", quad->left);
+	printf("\ttop: %f\n", quad->top);
+	printf("\twidth: %f\n", quad->width);
+	printf("\theight: %f\n", quad->height);
 
 	switch (quad->tag) {
 	case QUAD_SMALL:
@@ -178,7 +182,7 @@ void Util_LeafAddPoint(Quad *quad, Geom *geom)
 	assert(leaf->size > 0);
 	assert(leaf->full < leaf->size);
 
-	leaf->geom[leaf->full++] = geom;
+	QL_Add(quad, geom);
 }
 
 int Test(void)
@@ -252,8 +256,8 @@ int TestNews(void)
 		{ 20, 20, NEWS_SE},
 		{ -1, 0, NEWS_NONE },
 	};
-	int centrex = 10;
-	int centrey = 10;
+	float centrex = 10;
+	float centrey = 10;
 	float xf, yf;
 
 	for (int ii = 0; tests[ii].xf > 0; ii++) {
@@ -342,7 +346,7 @@ int TestQL_Centre(void)
 {
 	int ok = 1;
 
-	int centrex, centrey;
+	float centrex, centrey;
 	Quad *quad;
 	Geom *geom;
 
@@ -397,6 +401,37 @@ int TestQL_Resize(void)
 	return ok;
 }
 
+int TestQL_Columns(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 100, 100);
+	Leaf *leaf = &quad->leaf;
+	Geom *geoms[LEAFMINSIZE];
+
+	for (int ii = 0; ii < LEAFMINSIZE; ii++) {
+		geoms[ii] = P_New(ii, ii + 100, ii + 200);
+		QL_Add(quad, geoms[ii]);
+	}
+
+	// only small quads should be resized
+	quad->tag = QUAD_SMALL;
+	QL_Resize(quad, 40);
+
+	if ((char *) leaf->xf != (char *) (leaf->geom + 40) || leaf->yf != leaf->xf + 40 || leaf->zf != leaf->yf + 40) {
+		printf("failed to pack columns into one block\n");
+		return 0;
+	}
+	for (int ii = 0; ii < LEAFMINSIZE; ii++) {
+		if (leaf->geom[ii] != geoms[ii] || leaf->xf[ii] != ii || leaf->yf[ii] != ii + 100 || leaf->zf[ii] != ii + 200) {
+			printf("failed to keep point %d across resize\n", ii);
+			return 0;
+		}
+	}
+
+	return ok;
+}
+
 int TestQL_Grow(void)
 {
 	int ok = 1;
@@ -419,7 +454,7 @@ int TestQL_Grow(void)
 	return ok;
 }
 
-// void QL_SplitLarge(Quad *quad, int centrex, int centrey)
+// void QL_SplitLarge(Quad *quad, float centrex, float centrey)
 // void QL_SplitSmall(Quad *quad)
 // void QL_Split(Quad *quad)
 
@@ -456,7 +491,7 @@ int HelpQ_Expect(Quad *quad, Quad *expect)
 	return 1;
 }
 
-int HelpQN_Expect(Quad *quad, int left, int top, int width, int height, int centrex, int centrey)
+int HelpQN_Expect(Quad *quad, float left, float top, float width, float height, float centrex, float centrey)
 {
 	assert(quad);
 
@@ -475,7 +510,7 @@ int HelpQN_Expect(Quad *quad, int left, int top, int width, int height, int cent
 	return HelpQ_Expect(quad, &expect);
 }
 
-int HelpQL_Expect(Quad *quad, int left, int top, int width, int height, int size, int full)
+int HelpQL_Expect(Quad *quad, float left, float top, float width, float height, int size, int full)
 {
 	assert(quad);
 
@@ -514,7 +549,7 @@ int TestQL_SplitLarge(void)
 	// Q_Dump(quad);
 	// (1, 1) (99, 1) (1, 99) (99, 99) (5, 5) (95, 5) (5, 95) (95, 95)
 
-	int centrex, centrey;
+	float centrex, centrey;
 	QL_Centre(quad, &centrex, &centrey);	
 	// printf("...(%d, %d)\n", centrex, centrey);
 	// 50, 50
@@ -762,6 +797,114 @@ int TestQ_Find02(void)
 	return ok;
 }
 
+int Help_CheckTree(Quad *quad);
+
+// The point Q_Find should report: the first in its leaf, as a scan finds
+Geom *Help_FirstNear(Geom *geom, float xf, float yf)
+{
+	Leaf *leaf = &geom->quad->leaf;
+	int ii = S_Find(leaf->xf, leaf->yf, leaf->full, xf, yf);
+
+	return ii < 0 ? NULL : leaf->geom[ii];
+}
+
+int TestQ_Find03(void)
+{
+	int ok = 1;
+
+	// a yard: points every quarter unit over a few units, many twice
+	int side = 16;
+	int npts = side * side * 3;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom **moves = calloc(npts, sizeof(Geom *));
+	Pt *pts = calloc(npts, sizeof(Pt));
+	Tree *tree = T_New(0, 0, 100, 100);
+	Geom *found;
+	int nmove;
+
+	assert(geoms);
+	assert(moves);
+	assert(pts);
+
+	for (int ii = 0; ii < npts; ii++) {
+		int cell = ii % (side * side);
+		geoms[ii] = TP_New(tree, 48 + cell % side * 0.25, 48 + cell / side * 0.25, ii);
+		Q_Add(tree->root, geoms[ii]);
+	}
+	if (geoms[0]->quad->tag != QUAD_SMALL || Help_CheckTree(tree->root) != npts) {
+		printf("failed to make a small leaf\n");
+		return 0;
+	}
+
+	for (int round = 0; round < 2; round++) {
+		for (int ii = 0; ii < npts; ii++) {
+			float xf = geoms[ii]->pt.xf;
+			float yf = geoms[ii]->pt.yf;
+			if (geoms[ii]->quad == NULL) {
+				continue;
+			}
+			if (!Q_Find(tree->root, xf, yf, &found) || found != Help_FirstNear(geoms[ii], xf, yf)) {
+				printf("failed to find the first point near (%f, %f)\n", xf, yf);
+				return 0;
+			}
+			// between points, out of almost()'s reach of any
+			if (Q_Find(tree->root, xf + 0.125, yf + 0.125, &found)) {
+				printf("found a point near (%f, %f)\n", xf + 0.125, yf + 0.125);
+				return 0;
+			}
+		}
+
+		// take some points out and move others, within the leaf
+		for (int ii = round; ii < npts; ii += 3) {
+			Q_Remove(tree->root, geoms[ii]);
+		}
+		nmove = 0;
+		for (int ii = 2; ii < npts; ii += 3) {
+			moves[nmove] = geoms[ii];
+			pts[nmove] = geoms[ii]->pt;
+			pts[nmove].xf += 0.5;
+			nmove++;
+		}
+		Q_Move(tree->root, moves, pts, nmove);
+		if (Help_CheckTree(tree->root) != npts - npts / 3 * (round + 1)) {
+			printf("failed to update the small leaf\n");
+			return 0;
+		}
+	}
+
+	// cells of coordinates beyond the range of int, in a small leaf far
+	// outside the root
+	if (QL_Cell(3e9) < QL_Cell(1e8) || QL_Cell(-3e9) > QL_Cell(-1e8) || QL_Cell(3e9) + 1 <= QL_Cell(3e9)) {
+		printf("failed to keep far cells in order\n");
+		return 0;
+	}
+	T_Reset(tree);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = P_New(ii % 2 ? 3e9 : 3e9 + 1024, -3e9, ii);
+		Q_Add(tree->root, geoms[ii]);
+	}
+	if (geoms[0]->quad->tag != QUAD_SMALL || Help_CheckTree(tree->root) != npts) {
+		printf("failed to make a small leaf far out\n");
+		return 0;
+	}
+	if (!Q_Find(tree->root, 3e9, -3e9, &found) || found != geoms[1] ||
+	    !Q_Find(tree->root, 3e9 + 1024, -3e9, &found) || found != geoms[0] ||
+	    Q_Find(tree->root, 3e9 + 512, -3e9, &found)) {
+		printf("failed to look up points far out\n");
+		return 0;
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+
+	free(pts);
+	free(moves);
+	free(geoms);
+	T_Free(tree);
+
+	return ok;
+}
+
 int TestQ_Find(void)
 {
 	int ok = 1;
@@ -772,6 +915,2900 @@ int TestQ_Find(void)
 	if (!TestQ_Find02()) {
 		return 0;
 	}
+	if (!TestQ_Find03()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+int Help_CountVisit(Geom *geom, void *arg)
+{
+	int *cnt = arg;
+
+	(*cnt)++;
+
+	return *cnt < 3;
+}
+
+int TestQ_QueryRect01(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 100, 100);
+	Geom *out[4];
+	int npts = 1000;
+	int cnt;
+
+	Help_AddPoints(quad, npts);
+
+	// each of the four diagonals puts five points in the box
+	cnt = Q_QueryRectBuf(quad, 40, 40, 20, 20, out, 4);
+	if (cnt != 20) {
+		printf("failed to count points in rect: %d\n", cnt);
+		return 0;
+	}
+	for (int ii = 0; ii < 4; ii++) {
+		if (out[ii]->pt.xf < 40 || out[ii]->pt.xf >= 60 || out[ii]->pt.yf < 40 || out[ii]->pt.yf >= 60) {
+			printf("found point outside rect\n");
+			return 0;
+		}
+	}
+
+	if (Q_QueryRectBuf(quad, 300, -300, 10, 10, out, 4) != 0) {
+		printf("found points in empty rect\n");
+		return 0;
+	}
+
+	cnt = 0;
+	if (Q_QueryRect(quad, 0, 0, 100, 100, Help_CountVisit, &cnt) != 3 || cnt != 3) {
+		printf("failed to stop query early\n");
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_QueryRect02(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 100, 100);
+	int npts = 100;
+
+	Help_AddPoints(quad, npts);
+
+	// points beyond the root bounds are filed in the edge quadrants
+	Q_Add(quad, P_New(150, 150, 0));
+	Q_Add(quad, P_New(-50, 150, 0));
+
+	if (Q_QueryRectBuf(quad, 140, 140, 20, 20, NULL, 0) != 1) {
+		printf("failed to find point beyond the root\n");
+		return 0;
+	}
+	if (Q_QueryRectBuf(quad, -1000, -1000, 2000, 2000, NULL, 0) != npts + 2) {
+		printf("failed to find all points\n");
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_QueryRect(void)
+{
+	int ok = 1;
+
+	if (!TestQ_QueryRect01()) {
+		return 0;
+	}
+	if (!TestQ_QueryRect02()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_Nearest01(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 100, 100);
+	Geom *out[3];
+
+	if (Q_Nearest(quad, 50, 50, 3, out) != 0) {
+		printf("found neighbours in empty tree\n");
+		return 0;
+	}
+
+	Q_Add(quad, P_New(10, 10, 0));
+	Q_Add(quad, P_New(20, 20, 0));
+
+	if (Q_Nearest(quad, 50, 50, 3, out) != 2) {
+		printf("failed to return short result\n");
+		return 0;
+	}
+	if (out[0]->pt.xf != 20 || out[1]->pt.xf != 10) {
+		printf("failed to order neighbours\n");
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_Nearest02(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 1000, 1000);
+	int npts = 5000;
+	int k = 7;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom *out[7];
+	float best[7];
+	float xf, yf, dx, dy, dd;
+
+	assert(geoms);
+
+	srand(1);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, 0);
+		Q_Add(quad, geoms[ii]);
+	}
+
+	for (int qq = 0; qq < 100; qq++) {
+		xf = rand() % 120000 / 100.0 - 100;
+		yf = rand() % 120000 / 100.0 - 100;
+
+		// brute force the k best distances
+		for (int jj = 0; jj < k; jj++) {
+			best[jj] = INFINITY;
+		}
+		for (int ii = 0; ii < npts; ii++) {
+			dx = geoms[ii]->pt.xf - xf;
+			dy = geoms[ii]->pt.yf - yf;
+			dd = dx * dx + dy * dy;
+			for (int jj = 0; jj < k; jj++) {
+				if (dd < best[jj]) {
+					float tmp = best[jj];
+					best[jj] = dd;
+					dd = tmp;
+				}
+			}
+		}
+
+		if (Q_Nearest(quad, xf, yf, k, out) != k) {
+			printf("failed to find k neighbours\n");
+			return 0;
+		}
+		for (int jj = 0; jj < k; jj++) {
+			dx = out[jj]->pt.xf - xf;
+			dy = out[jj]->pt.yf - yf;
+			if (dx * dx + dy * dy != best[jj]) {
+				printf("failed to find neighbour %d of (%f, %f)\n", jj, xf, yf);
+				return 0;
+			}
+		}
+	}
+
+	free(geoms);
+
+	return ok;
+}
+
+int TestQ_Nearest(void)
+{
+	int ok = 1;
+
+	if (!TestQ_Nearest01()) {
+		return 0;
+	}
+	if (!TestQ_Nearest02()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_QueryPool(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 1000, 1000);
+	int npts = 20000;
+	int nq = 3000;
+	int kk = 3;
+	int max = 8;
+	float *xf = calloc(nq, sizeof(float));
+	float *yf = calloc(nq, sizeof(float));
+	float *side = calloc(nq, sizeof(float));
+	Geom **found = calloc(nq, sizeof(Geom *));
+	Geom **out = calloc(nq * max, sizeof(Geom *));
+	int *nout = calloc(nq, sizeof(int));
+	Geom *expect[8];
+	Geom *geom;
+	int nfound, total;
+
+	assert(xf && yf && side && found && out && nout);
+
+	srand(13);
+	Help_AddPoints(quad, npts);
+	for (int qq = 0; qq < nq; qq++) {
+		xf[qq] = rand() % 2 ? rand() % 1000 : rand() % 100000 / 100.0;
+		yf[qq] = rand() % 2 ? rand() % 1000 : rand() % 100000 / 100.0;
+		side[qq] = rand() % 20;
+	}
+
+	for (int nthread = 0; nthread <= 4; nthread += 4) {
+		Pool *pool = nthread ? W_New(nthread) : NULL;
+		int chunk = nthread ? 100 : 0;
+
+		nfound = Q_FindPool(pool, quad, xf, yf, nq, found, chunk);
+		total = 0;
+		for (int qq = 0; qq < nq; qq++) {
+			if (Q_Find(quad, xf[qq], yf[qq], &geom) != (found[qq] != NULL) || (found[qq] && found[qq] != geom)) {
+				printf("failed to find query %d on %d threads\n", qq, nthread);
+				return 0;
+			}
+			total += found[qq] != NULL;
+		}
+		if (nfound != total) {
+			printf("failed to count found points: %d != %d\n", nfound, total);
+			return 0;
+		}
+
+		total = Q_NearestPool(pool, quad, xf, yf, nq, kk, out, nout, chunk);
+		if (total != nq * kk) {
+			printf("failed to find nearest points: %d\n", total);
+			return 0;
+		}
+		for (int qq = 0; qq < nq; qq++) {
+			if (Q_Nearest(quad, xf[qq], yf[qq], kk, expect) != nout[qq] || memcmp(expect, out + qq * kk, kk * sizeof(Geom *)) != 0) {
+				printf("failed nearest query %d on %d threads\n", qq, nthread);
+				return 0;
+			}
+		}
+
+		Q_QueryRectPool(pool, quad, xf, yf, side, side, nq, out, max, nout, chunk);
+		for (int qq = 0; qq < nq; qq++) {
+			int cnt = Q_QueryRectBuf(quad, xf[qq], yf[qq], side[qq], side[qq], expect, max);
+			int stored = cnt < max ? cnt : max;
+			if (cnt != nout[qq] || memcmp(expect, out + qq * max, stored * sizeof(Geom *)) != 0) {
+				printf("failed window query %d on %d threads\n", qq, nthread);
+				return 0;
+			}
+		}
+
+		W_Free(pool);
+	}
+
+	free(xf);
+	free(yf);
+	free(side);
+	free(found);
+	free(out);
+	free(nout);
+	Q_Free(quad);
+
+	return ok;
+}
+
+/*
+Check that every point lies on the correct side of every split above it
+and that no plain leaf has been overfilled.
+Returns the number of points in the tree, or -1.
+*/
+// Every point of a small leaf is chained once, in order, in its bucket
+int Help_CheckIndex(Leaf *leaf)
+{
+	int nbucket = L_Buckets(leaf->size);
+	int *head = leaf->index;
+	int *next = head + 2 * nbucket;
+	int cnt = 0;
+
+	if (head == NULL) {
+		printf("small leaf without an index\n");
+		return 0;
+	}
+	for (int bb = 0; bb < nbucket; bb++) {
+		for (int ii = head[bb], prev = -1; ii >= 0; prev = ii, ii = next[ii]) {
+			if (ii <= prev || ii >= leaf->full || QL_Bucket(nbucket, QL_Cell(leaf->xf[ii]), QL_Cell(leaf->yf[ii])) != bb) {
+				printf("slot %d misplaced in the index\n", ii);
+				return 0;
+			}
+			cnt++;
+		}
+	}
+	if (cnt != leaf->full) {
+		printf("index holds %d of %d points\n", cnt, leaf->full);
+		return 0;
+	}
+
+	return 1;
+}
+
+int Help_CheckRegion(Quad *quad, float left, float top, float right, float bottom)
+{
+	assert(quad);
+
+	int cnt, sub;
+
+	switch (quad->tag) {
+	case QUAD_NODE:
+		cnt = 0;
+		Node *node = &quad->node;
+		Quad *kids[4] = { node->nw, node->ne, node->sw, node->se };
+		float regions[4][4] = {
+			{ left, top, node->centrex, node->centrey },
+			{ node->centrex, top, right, node->centrey },
+			{ left, node->centrey, node->centrex, bottom },
+			{ node->centrex, node->centrey, right, bottom },
+		};
+		for (int ii = 0; ii < 4; ii++) {
+			if (kids[ii] == NULL) {
+				printf("node has missing child\n");
+				return -1;
+			}
+			sub = Help_CheckRegion(kids[ii], regions[ii][0], regions[ii][1], regions[ii][2], regions[ii][3]);
+			if (sub < 0) {
+				return -1;
+			}
+			cnt += sub;
+		}
+		return cnt;
+	case QUAD_LEAF:
+	case QUAD_SMALL: {
+		Leaf *leaf = &quad->leaf;
+		if (leaf->full > leaf->size || (quad->tag == QUAD_LEAF && leaf->full > T_LeafSize(quad->tree))) {
+			printf("leaf overfilled: %d/%d\n", leaf->full, leaf->size);
+			return -1;
+		}
+		if (quad->tag == QUAD_SMALL && !Help_CheckIndex(leaf)) {
+			return -1;
+		}
+		for (int ii = 0; ii < leaf->full; ii++) {
+			Pt *pt = &leaf->geom[ii]->pt;
+			if (leaf->geom[ii]->quad != quad || leaf->geom[ii]->slot != ii) {
+				printf("point (%f, %f) has a stale back reference\n", leaf->xf[ii], leaf->yf[ii]);
+				return -1;
+			}
+			if (pt->xf != leaf->xf[ii] || pt->yf != leaf->yf[ii] || pt->zf != leaf->zf[ii]) {
+				printf("point (%f, %f) out of step with its geom\n", leaf->xf[ii], leaf->yf[ii]);
+				return -1;
+			}
+			if (pt->xf < left || pt->xf >= right || pt->yf < top || pt->yf >= bottom) {
+				printf("point (%f, %f) outside its region\n", pt->xf, pt->yf);
+				return -1;
+			}
+		}
+		return leaf->full;
+	}
+	default:
+		printf("unknown tag: %d\n", quad->tag);
+		return -1;
+	}
+}
+
+int Help_CheckTree(Quad *quad)
+{
+	return Help_CheckRegion(quad, -INFINITY, -INFINITY, INFINITY, INFINITY);
+}
+
+int TestQ_Build01(void)
+{
+	int ok = 1;
+
+	Quad *quad = Q_Build(NULL, 0, 0, 0, 100, 100);
+
+	if (!HelpQL_Expect(quad, 0, 0, 100, 100, LEAFMINSIZE, 0)) {
+		printf("failed to build empty tree\n");
+		return 0;
+	}
+
+	// too close together to split
+	Geom *geoms[LEAFMINSIZE * 3];
+	for (int ii = 0; ii < LEAFMINSIZE * 3; ii++) {
+		geoms[ii] = P_New(50 + ii * 0.01, 50, 0);
+	}
+	quad = Q_Build(geoms, LEAFMINSIZE * 3, 45, 45, 10, 10);
+	if (quad->tag != QUAD_SMALL || quad->leaf.full != LEAFMINSIZE * 3) {
+		printf("failed to build small leaf\n");
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_Build02(void)
+{
+	int ok = 1;
+
+	int npts = 20000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom *found;
+
+	assert(geoms);
+
+	srand(2);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+	}
+
+	Quad *quad = Q_Build(geoms, npts, 0, 0, 1000, 1000);
+
+	if (quad->tag != QUAD_NODE) {
+		printf("failed to split root\n");
+		return 0;
+	}
+	if (Help_CheckTree(quad) != npts) {
+		printf("failed to place all points\n");
+		return 0;
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		if (!Q_Find(quad, geoms[ii]->pt.xf, geoms[ii]->pt.yf, &found)) {
+			printf("failed to find point %d\n", ii);
+			return 0;
+		}
+	}
+
+	// the tree still accepts incremental inserts
+	Q_Add(quad, P_New(1.5, 1.5, 0));
+	if (!Q_Find(quad, 1.5, 1.5, &found) || Help_CheckTree(quad) != npts + 1) {
+		printf("failed to add to built tree\n");
+		return 0;
+	}
+
+	free(geoms);
+
+	return ok;
+}
+
+/*
+Check that two trees have the same shape and hold the same points in the
+same order.
+*/
+int Help_SameTree(Quad *aa, Quad *bb)
+{
+	if (aa->tag != bb->tag || aa->left != bb->left || aa->top != bb->top || aa->width != bb->width || aa->height != bb->height) {
+		printf("quads differ at (%f, %f)\n", aa->left, aa->top);
+		return 0;
+	}
+
+	if (aa->tag == QUAD_NODE) {
+		if (aa->node.centrex != bb->node.centrex || aa->node.centrey != bb->node.centrey) {
+			printf("centres differ at (%f, %f)\n", aa->left, aa->top);
+			return 0;
+		}
+		return
+			Help_SameTree(aa->node.nw, bb->node.nw) &&
+			Help_SameTree(aa->node.ne, bb->node.ne) &&
+			Help_SameTree(aa->node.sw, bb->node.sw) &&
+			Help_SameTree(aa->node.se, bb->node.se);
+	}
+
+	if (aa->leaf.full != bb->leaf.full || memcmp(aa->leaf.geom, bb->leaf.geom, aa->leaf.full * sizeof(Geom *)) != 0) {
+		printf("leaves differ at (%f, %f)\n", aa->left, aa->top);
+		return 0;
+	}
+
+	return 1;
+}
+
+int TestQ_BuildPool(void)
+{
+	int ok = 1;
+
+	int npts = 300000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Tree *serial, *tree;
+	Quad *quad;
+
+	assert(geoms);
+
+	// mostly uniform, with a dense cluster that ends up in small leaves
+	srand(12);
+	for (int ii = 0; ii < npts; ii++) {
+		if (ii % 5 == 0) {
+			geoms[ii] = P_New(700 + rand() % 1000 / 1000.0, 300 + rand() % 1000 / 1000.0, ii);
+		}
+		else {
+			geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		}
+	}
+
+	serial = T_Build(geoms, npts, 0, 0, 1000, 1000);
+
+	for (int nthread = 1; nthread <= 4; nthread += 3) {
+		Pool *pool = W_New(nthread);
+
+		tree = T_BuildPool(pool, geoms, npts, 0, 0, 1000, 1000);
+		if (Help_CheckTree(tree->root) != npts || !Help_SameTree(serial->root, tree->root)) {
+			printf("failed to build the same tree on %d threads\n", nthread);
+			return 0;
+		}
+		// every quad belongs to the tree, and T_Reset can reuse its memory
+		T_Reset(tree);
+		Q_AddBatch(tree->root, geoms, 1000);
+		if (Help_CheckTree(tree->root) != 1000) {
+			printf("failed to reuse built tree\n");
+			return 0;
+		}
+		T_Free(tree);
+
+		quad = Q_BuildPool(pool, geoms, npts, 0, 0, 1000, 1000);
+		if (!Help_SameTree(serial->root, quad)) {
+			printf("failed to build the same calloc tree on %d threads\n", nthread);
+			return 0;
+		}
+		Q_Free(quad);
+
+		W_Free(pool);
+	}
+
+	tree = T_BuildPool(NULL, geoms, 100, 0, 0, 1000, 1000);
+	if (Help_CheckTree(tree->root) != 100) {
+		printf("failed to build without a pool\n");
+		return 0;
+	}
+	T_Free(tree);
+
+	T_Free(serial);
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+
+	return ok;
+}
+
+int TestQ_Build(void)
+{
+	int ok = 1;
+
+	if (!TestQ_Build01()) {
+		return 0;
+	}
+	if (!TestQ_Build02()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestA_Alloc(void)
+{
+	int ok = 1;
+
+	Arena arena;
+	char *aa, *bb, *cc;
+
+	A_Init(&arena);
+
+	aa = A_Alloc(&arena, 24);
+	bb = A_Alloc(&arena, 24);
+	if (aa == NULL || bb == NULL || bb - aa != 32) {
+		printf("failed to carve blocks by size class\n");
+		return 0;
+	}
+	memset(aa, 0xff, 24);
+
+	// each class is the smallest that fits, quads and geoms nearly exactly
+	for (size_t size = 1; size < 100000; size++) {
+		int cls = A_Class(size);
+		if (A_Size(cls) < size || A_Size(cls) % 16 || (cls > 0 && A_Size(cls - 1) >= size)) {
+			printf("size %zu in class %d of %zu\n", size, cls, A_Size(cls));
+			return 0;
+		}
+		if (size > 128 && A_Size(cls) > size + size / 4) {
+			printf("size %zu rounded up to %zu\n", size, A_Size(cls));
+			return 0;
+		}
+	}
+	if (A_Size(A_Class(sizeof(Quad))) >= sizeof(Quad) + 16 || A_Size(A_Class(sizeof(Geom))) >= sizeof(Geom) + 16) {
+		printf("quads or geoms padded past the next 16 bytes\n");
+		return 0;
+	}
+
+	A_Release(&arena, aa, 24);
+	cc = A_Alloc(&arena, 20);
+	if (cc != aa || cc[0] != 0 || cc[23] != 0) {
+		printf("failed to recycle zeroed block\n");
+		return 0;
+	}
+
+	cc = A_Alloc(&arena, ARENACHUNK);
+	if (cc == NULL || arena.large == NULL) {
+		printf("failed to allocate large block\n");
+		return 0;
+	}
+
+	A_Reset(&arena);
+	if (arena.large != NULL) {
+		printf("failed to release large block\n");
+		return 0;
+	}
+	if (A_Alloc(&arena, 24) != aa) {
+		printf("failed to reuse chunk after reset\n");
+		return 0;
+	}
+
+	A_Free(&arena);
+	if (arena.chunks != NULL || arena.bytes != 0) {
+		printf("failed to free arena\n");
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestT_New(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int npts = 20000;
+	Geom *found;
+	size_t bytes;
+
+	if (!HelpQL_Expect(tree->root, 0, 0, 1000, 1000, LEAFMINSIZE, 0) || tree->root->tree != tree) {
+		printf("failed to create root\n");
+		return 0;
+	}
+
+	for (int round = 0; round < 2; round++) {
+		srand(3);
+		for (int ii = 0; ii < npts; ii++) {
+			Q_Add(tree->root, TP_New(tree, rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii));
+		}
+		if (Help_CheckTree(tree->root) != npts) {
+			printf("failed to fill tree\n");
+			return 0;
+		}
+		Q_Add(tree->root, TP_New(tree, 500.5, 500.5, 0));
+		if (!Q_Find(tree->root, 500.5, 500.5, &found)) {
+			printf("failed to find point\n");
+			return 0;
+		}
+
+		// a reset tree refills from the chunks it already holds
+		if (round == 0) {
+			bytes = tree->arena.bytes;
+			T_Reset(tree);
+			if (tree->root->tag != QUAD_LEAF || tree->root->leaf.full != 0) {
+				printf("failed to reset tree\n");
+				return 0;
+			}
+		}
+		else if (tree->arena.bytes > bytes) {
+			printf("failed to reuse arena: %zu > %zu\n", tree->arena.bytes, bytes);
+			return 0;
+		}
+	}
+
+	T_Free(tree);
+
+	return ok;
+}
+
+int TestT_Share01(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int npts = 5000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Pt *pts = calloc(npts, sizeof(Pt));
+	Geom *found;
+	Quad *root;
+	int reader;
+
+	assert(geoms && pts);
+
+	T_Share(tree);
+	reader = T_Reader(tree);
+
+	srand(8);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = TP_New(tree, rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+	}
+	for (int ii = 0; ii < LEAFMINSIZE; ii++) {
+		Q_Add(tree->root, geoms[ii]);
+	}
+
+	// a reader keeps the tree it entered, even once the writer replaces it
+	root = T_Enter(tree, reader);
+	Q_AddBatch(tree->root, geoms + LEAFMINSIZE, npts - LEAFMINSIZE);
+	T_Collect(tree);
+	T_Collect(tree);
+	if (tree->root == root || root->tag != QUAD_LEAF || root->leaf.full != LEAFMINSIZE) {
+		printf("failed to keep old root for reader\n");
+		return 0;
+	}
+	if (!Q_Find(root, geoms[0]->pt.xf, geoms[0]->pt.yf, &found) || found != geoms[0]) {
+		printf("failed to find point in old root\n");
+		return 0;
+	}
+	T_Leave(tree, reader);
+
+	if (Help_CheckTree(tree->root) != npts) {
+		printf("failed to fill shared tree\n");
+		return 0;
+	}
+
+	for (int ii = 0; ii < npts; ii += 2) {
+		if (!Q_Remove(tree->root, geoms[ii])) {
+			printf("failed to remove point %d\n", ii);
+			return 0;
+		}
+	}
+	if (Help_CheckTree(tree->root) != npts - npts / 2) {
+		printf("failed to remove from shared tree\n");
+		return 0;
+	}
+
+	for (int ii = 1; ii < npts; ii += 2) {
+		pts[ii] = geoms[ii]->pt;
+		pts[ii].xf += ii % 10 == 1 ? 300 : 0.01;
+		pts[ii].zf = -1;
+	}
+	for (int ii = 1; ii < npts; ii += 2) {
+		Q_Move(tree->root, &geoms[ii], &pts[ii], 1);
+	}
+	if (Help_CheckTree(tree->root) != npts - npts / 2) {
+		printf("failed to move in shared tree\n");
+		return 0;
+	}
+	for (int ii = 1; ii < npts; ii += 2) {
+		if (!Q_Find(tree->root, pts[ii].xf, pts[ii].yf, &found) || found->pt.zf != -1) {
+			printf("failed to find moved point %d\n", ii);
+			return 0;
+		}
+	}
+
+	// a batch of moves within their leaves copies each leaf once; with a
+	// reader inside nothing is released, so every copy stays retired
+	Stats stats;
+	Q_Stats(tree->root, &stats);
+	int nmove = 0;
+	for (int ii = 1; ii < npts; ii += 2) {
+		// those moved beyond the root are held by quads that do not
+		// cover them, and would be added again
+		if (geoms[ii]->pt.xf >= 1000) {
+			continue;
+		}
+		geoms[nmove] = geoms[ii];
+		pts[nmove] = geoms[ii]->pt;
+		pts[nmove].zf = -2;
+		nmove++;
+	}
+	root = T_Enter(tree, reader);
+	int nretired = tree->epoch->nretired;
+	if (Q_Move(tree->root, geoms, pts, nmove) != 0) {
+		printf("failed to keep moved points in their leaves\n");
+		return 0;
+	}
+	if (tree->epoch->nretired - nretired > 2 * stats.nleaf) {
+		printf("moves within %ld leaves retired %d blocks\n", stats.nleaf, tree->epoch->nretired - nretired);
+		return 0;
+	}
+	T_Leave(tree, reader);
+	for (int ii = 0; ii < nmove; ii++) {
+		if (!Q_Find(tree->root, pts[ii].xf, pts[ii].yf, &found) || found->pt.zf != -2) {
+			printf("failed to find point %d moved in its leaf\n", ii);
+			return 0;
+		}
+	}
+
+	// with no reader inside, everything retired is released
+	T_Collect(tree);
+	T_Collect(tree);
+	T_Collect(tree);
+	if (tree->epoch->nretired != 0) {
+		printf("failed to release retired blocks: %d\n", tree->epoch->nretired);
+		return 0;
+	}
+
+	free(geoms);
+	free(pts);
+	T_Free(tree);
+
+	return ok;
+}
+
+typedef struct tHelpShared HelpShared;
+
+struct tHelpShared {
+	Tree *tree;
+	Geom **geoms;
+	int added;
+	int stop;
+	int failed;
+	int seed;
+};
+
+void *Help_SharedReader(void *arg)
+{
+	HelpShared *hs = arg;
+	unsigned seed = hs->seed;
+	int reader = T_Reader(hs->tree);
+	Geom *out[4];
+	Geom *found;
+	Quad *root;
+	Pt *pt;
+
+	while (!__atomic_load_n(&hs->stop, __ATOMIC_ACQUIRE)) {
+		int added = __atomic_load_n(&hs->added, __ATOMIC_ACQUIRE);
+		if (added == 0) {
+			continue;
+		}
+		pt = &hs->geoms[rand_r(&seed) % added]->pt;
+
+		root = T_Enter(hs->tree, reader);
+		if (!Q_Find(root, pt->xf, pt->yf, &found) || Q_QueryRectBuf(root, pt->xf, pt->yf, 0.01, 0.01, out, 4) < 1) {
+			__atomic_store_n(&hs->failed, 1, __ATOMIC_RELEASE);
+		}
+		T_Leave(hs->tree, reader);
+	}
+
+	return NULL;
+}
+
+// readers on other threads always find what the writer has added
+int TestT_Share02(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int npts = 50000;
+	int nchurn = 500;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom **churn = calloc(nchurn, sizeof(Geom *));
+	HelpShared hs[3];
+	pthread_t threads[3];
+
+	assert(geoms && churn);
+
+	srand(11);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = TP_New(tree, 100 + rand() % 90000 / 100.0, 100 + rand() % 90000 / 100.0, ii);
+	}
+	// points in a corner the readers never look at, added and removed
+	for (int ii = 0; ii < nchurn; ii++) {
+		churn[ii] = TP_New(tree, rand() % 10000 / 100.0, rand() % 10000 / 100.0, -ii);
+	}
+
+	T_Share(tree);
+	for (int tt = 0; tt < 3; tt++) {
+		hs[tt].tree = tree;
+		hs[tt].geoms = geoms;
+		hs[tt].added = 0;
+		hs[tt].stop = 0;
+		hs[tt].failed = 0;
+		hs[tt].seed = tt + 1;
+		pthread_create(&threads[tt], NULL, Help_SharedReader, &hs[tt]);
+	}
+
+	for (int ii = 0; ii < npts; ii++) {
+		Q_Add(tree->root, geoms[ii]);
+		for (int tt = 0; tt < 3; tt++) {
+			__atomic_store_n(&hs[tt].added, ii + 1, __ATOMIC_RELEASE);
+		}
+		if (ii % 10 == 0) {
+			Geom *geom = churn[ii / 10 % nchurn];
+			if (geom->quad) {
+				Q_Remove(tree->root, geom);
+			}
+			else {
+				Q_Add(tree->root, geom);
+			}
+		}
+	}
+
+	for (int tt = 0; tt < 3; tt++) {
+		__atomic_store_n(&hs[tt].stop, 1, __ATOMIC_RELEASE);
+		pthread_join(threads[tt], NULL);
+		if (hs[tt].failed) {
+			printf("reader %d failed to find a published point\n", tt);
+			ok = 0;
+		}
+	}
+
+	if (Help_CheckTree(tree->root) < npts) {
+		printf("failed to keep shared tree consistent\n");
+		return 0;
+	}
+
+	free(geoms);
+	free(churn);
+	T_Free(tree);
+
+	return ok;
+}
+
+int TestT_Share(void)
+{
+	return TestT_Share01() && TestT_Share02();
+}
+
+typedef struct tHelpWriter HelpWriter;
+
+struct tHelpWriter {
+	Tree *tree;
+	Geom **geoms;
+	int cnt;
+	int batch;
+};
+
+void *Help_Writer(void *arg)
+{
+	HelpWriter *hw = arg;
+
+	if (hw->batch) {
+		for (int ii = 0; ii < hw->cnt; ii += 1000) {
+			Q_AddBatch(hw->tree->root, hw->geoms + ii, hw->cnt - ii < 1000 ? hw->cnt - ii : 1000);
+		}
+	}
+	else {
+		for (int ii = 0; ii < hw->cnt; ii++) {
+			Q_Add(hw->tree->root, hw->geoms[ii]);
+		}
+	}
+
+	return NULL;
+}
+
+int TestT_Writers(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int nthread = 4;
+	int npts = 20000;
+	Geom **geoms = calloc(nthread * npts, sizeof(Geom *));
+	HelpWriter hw[4];
+	pthread_t threads[4];
+	Geom *found;
+
+	assert(geoms);
+
+	// each writer has a quadrant of its own, and a strip shared by all
+	srand(14);
+	for (int tt = 0; tt < nthread; tt++) {
+		for (int ii = 0; ii < npts; ii++) {
+			float xf, yf;
+			if (ii % 4 == 0) {
+				xf = rand() % 100000 / 100.0;
+				yf = 490 + rand() % 2000 / 100.0;
+			}
+			else {
+				xf = tt % 2 * 500 + rand() % 50000 / 100.0;
+				yf = tt / 2 * 500 + rand() % 50000 / 100.0;
+			}
+			geoms[tt * npts + ii] = TP_New(tree, xf, yf, tt * npts + ii);
+		}
+	}
+
+	T_Writers(tree, 1);
+	for (int tt = 0; tt < nthread; tt++) {
+		hw[tt].tree = tree;
+		hw[tt].geoms = geoms + tt * npts;
+		hw[tt].cnt = npts;
+		hw[tt].batch = tt == 0;
+		pthread_create(&threads[tt], NULL, Help_Writer, &hw[tt]);
+	}
+	for (int tt = 0; tt < nthread; tt++) {
+		pthread_join(threads[tt], NULL);
+	}
+	T_Writers(tree, 0);
+
+	if (Help_CheckTree(tree->root) != nthread * npts) {
+		printf("failed to add from %d writers\n", nthread);
+		return 0;
+	}
+	for (int ii = 0; ii < nthread * npts; ii++) {
+		if (!Q_Find(tree->root, geoms[ii]->pt.xf, geoms[ii]->pt.yf, &found)) {
+			printf("failed to find point %d\n", ii);
+			return 0;
+		}
+	}
+
+	free(geoms);
+	T_Free(tree);
+
+	return ok;
+}
+
+int TestT_Split01(void)
+{
+	int ok = 1;
+
+	struct {
+		SplitPolicy split;
+		float xf[4];
+		float yf[4];
+		int cnt;
+		float centrex, centrey;
+	} tests[] = {
+		// mean, not truncated
+		{ Split_Mean, { 0, 10, 11 }, { 1, 2, 2 }, 3, 7, 5.0 / 3 },
+		{ Split_Median, { 100, 1, 3, 2 }, { 5, 5, 5, 5 }, 4, 2.5, 5 },
+		{ Split_Median, { 100, 1, 3 }, { 9, 7, 8 }, 3, 3, 8 },
+		{ Split_Mid, { 1, 2 }, { 1, 2 }, 2, 50, 50 },
+		// all to one side, slid up to them
+		{ Split_Slide, { 10, 20, 30 }, { 60, 70, 80 }, 3, 30, 70 },
+		{ Split_Slide, { 10, 90, 10 }, { 60, 60, 60 }, 3, 50, 50 },
+		{ NULL },
+	};
+	float centrex, centrey;
+
+	for (int ii = 0; tests[ii].split; ii++) {
+		tests[ii].split(tests[ii].xf, tests[ii].yf, tests[ii].cnt, 0, 0, 100, 100, &centrex, &centrey);
+		if (centrex != tests[ii].centrex || centrey != tests[ii].centrey) {
+			printf("split %d at (%f, %f), expected (%f, %f)\n", ii, centrex, centrey, tests[ii].centrex, tests[ii].centrey);
+			ok = 0;
+		}
+	}
+
+	return ok;
+}
+
+// Points in small leaves, which are scanned from end to end
+int Help_SmallPoints(Quad *quad)
+{
+	if (quad->tag == QUAD_NODE) {
+		return
+			Help_SmallPoints(quad->node.nw) +
+			Help_SmallPoints(quad->node.ne) +
+			Help_SmallPoints(quad->node.sw) +
+			Help_SmallPoints(quad->node.se);
+	}
+	return quad->tag == QUAD_SMALL ? quad->leaf.full : 0;
+}
+
+int TestT_Split02(void)
+{
+	int ok = 1;
+
+	SplitPolicy splits[] = { Split_Mean, Split_Median, Split_Mid, Split_Slide };
+	int npts = 40000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Pool *pool = W_New(4);
+	Tree *tree, *built;
+	Geom *found;
+	int small[4];
+
+	assert(geoms);
+
+	// clustered around a few centres
+	srand(16);
+	for (int ii = 0; ii < npts; ii++) {
+		float xf = 100 + ii % 4 * 250 + (rand() % 1000 - rand() % 1000) / 8.0;
+		float yf = 100 + ii % 3 * 300 + (rand() % 1000 - rand() % 1000) / 8.0;
+		geoms[ii] = P_New(xf, yf, ii);
+	}
+
+	for (int pp = 0; pp < 4; pp++) {
+		tree = T_New(0, 0, 1000, 1000);
+		T_Split(tree, splits[pp]);
+		for (int ii = 0; ii < npts / 10; ii++) {
+			Q_Add(tree->root, geoms[ii]);
+		}
+		if (Help_CheckTree(tree->root) != npts / 10) {
+			printf("failed to add with policy %d\n", pp);
+			return 0;
+		}
+		for (int ii = 0; ii < npts / 10; ii++) {
+			if (!Q_Find(tree->root, geoms[ii]->pt.xf, geoms[ii]->pt.yf, &found)) {
+				printf("failed to find point %d with policy %d\n", ii, pp);
+				return 0;
+			}
+		}
+		// the midpoints keep clear of the clusters' edges
+		small[pp] = Help_SmallPoints(tree->root);
+		if (pp >= 2 && small[pp] >= small[0]) {
+			printf("policy %d left %d points in small leaves, the mean %d\n", pp, small[pp], small[0]);
+			return 0;
+		}
+
+		// a rebuild takes the same policy, on a pool or not
+		T_Fill(NULL, tree, geoms, npts);
+		if (Help_CheckTree(tree->root) != npts) {
+			printf("failed to rebuild with policy %d\n", pp);
+			return 0;
+		}
+		built = T_New(0, 0, 1000, 1000);
+		T_Split(built, splits[pp]);
+		T_Fill(pool, built, geoms, npts);
+		if (Help_CheckTree(built->root) != npts || !Help_SameTree(tree->root, built->root)) {
+			printf("failed to rebuild with policy %d\n", pp);
+			return 0;
+		}
+		T_Free(built);
+		T_Free(tree);
+	}
+
+	W_Free(pool);
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+
+	return ok;
+}
+
+int TestT_Split(void)
+{
+	int ok = 1;
+
+	if (!TestT_Split01()) {
+		return 0;
+	}
+	if (!TestT_Split02()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+// Each point is found exactly where it is, and nowhere near it
+int Help_FindsExactly(Tree *tree, Geom **geoms, int npts)
+{
+	Geom *found;
+
+	for (int ii = 0; ii < npts; ii++) {
+		Pt *pt = &geoms[ii]->pt;
+		if (geoms[ii]->quad == NULL) {
+			if (T_FindExact(tree, pt->xf, pt->yf, &found)) {
+				printf("found removed point %d\n", ii);
+				return 0;
+			}
+			continue;
+		}
+		if (!T_FindExact(tree, pt->xf, pt->yf, &found) || found != geoms[ii]) {
+			printf("failed to find point %d exactly\n", ii);
+			return 0;
+		}
+		if (T_FindExact(tree, pt->xf + 0.01, pt->yf, &found)) {
+			printf("found a point next to %d\n", ii);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Every quad of the tree is checked against its config: full leaves hold
+// leafsize points, small leaves have grown from leafsize by growth, and no
+// split made a quad narrower than minextent. Returns the number of small
+// leaves, or -1.
+int Help_CheckConfig(Quad *quad, Config *config)
+{
+	int cnt = 0, sub;
+
+	switch (quad->tag) {
+	case QUAD_NODE: {
+		Quad *kids[4] = { quad->node.nw, quad->node.ne, quad->node.sw, quad->node.se };
+		for (int ii = 0; ii < 4; ii++) {
+			if (kids[ii]->width < config->minextent || kids[ii]->height < config->minextent) {
+				printf("quad of %g by %g is under %g\n", kids[ii]->width, kids[ii]->height, config->minextent);
+				return -1;
+			}
+			if ((sub = Help_CheckConfig(kids[ii], config)) < 0) {
+				return -1;
+			}
+			cnt += sub;
+		}
+		return cnt;
+	}
+	case QUAD_LEAF:
+		if (quad->leaf.size != config->leafsize) {
+			printf("leaf of %d slots, not %d\n", quad->leaf.size, config->leafsize);
+			return -1;
+		}
+		return 0;
+	case QUAD_SMALL: {
+		int size = config->leafsize;
+		while (size < quad->leaf.size) {
+			size = size * config->growth;
+		}
+		if (size != quad->leaf.size) {
+			printf("small leaf of %d slots did not grow from %d\n", quad->leaf.size, config->leafsize);
+			return -1;
+		}
+		return 1;
+	}
+	default:
+		printf("unknown tag: %d\n", quad->tag);
+		return -1;
+	}
+}
+
+int TestT_NewConfig01(void)
+{
+	int npts = 5000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom *found;
+
+	assert(geoms);
+
+	for (int ii = 0; ii < npts; ii++) {
+		// half spread out, half piled on a few spots
+		if (ii % 2) {
+			geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		}
+		else {
+			geoms[ii] = P_New(200 + ii % 5, 300, ii);
+		}
+	}
+
+	int leafsizes[] = { 16, 32, 64, 0 };
+	for (int ll = 0; leafsizes[ll]; ll++) {
+		Config config = { leafsizes[ll], 2, 4 };
+		Tree *tree = T_NewConfig(&config, 0, 0, 1000, 1000);
+
+		for (int ii = 0; ii < npts; ii++) {
+			Q_Add(tree->root, geoms[ii]);
+		}
+		if (Help_CheckTree(tree->root) != npts) {
+			printf("failed to check tree of leafsize %d\n", config.leafsize);
+			return 0;
+		}
+		if (Help_CheckConfig(tree->root, &config) <= 0) {
+			printf("failed to keep to config of leafsize %d\n", config.leafsize);
+			return 0;
+		}
+		for (int ii = 1; ii < npts; ii += 2) {
+			if (!Q_Find(tree->root, geoms[ii]->pt.xf, geoms[ii]->pt.yf, &found)) {
+				printf("failed to find point %d with leafsize %d\n", ii, config.leafsize);
+				return 0;
+			}
+		}
+		if (Q_Find(tree->root, -1, -1, &found)) {
+			printf("found a point outside with leafsize %d\n", config.leafsize);
+			return 0;
+		}
+		T_Free(tree);
+	}
+
+	// with no minimum extent, a pile of points on one spot still stops
+	// splitting once a split would leave a child of no width
+	Config none = { 8, 2, 0 };
+	Tree *pile = T_NewConfig(&none, 0, 0, 1000, 1000);
+	for (int ii = 0; ii < 100; ii++) {
+		geoms[ii]->pt.xf = geoms[ii]->pt.yf = 5;
+		Q_Add(pile->root, geoms[ii]);
+	}
+	if (Help_CheckTree(pile->root) != 100 || Help_CheckConfig(pile->root, &none) <= 0) {
+		printf("failed to pile points with no minimum extent\n");
+		return 0;
+	}
+	T_Free(pile);
+
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+
+	return 1;
+}
+
+// The fixed scans against the plain ones, slots past full filled with
+// points that must not be found
+int TestT_NewConfig02(void)
+{
+	float xs[64], ys[64];
+
+	for (int ii = 0; ii < 64; ii++) {
+		xs[ii] = ii * 10;
+		ys[ii] = 1000 - ii * 10;
+	}
+
+	for (Scan *scan = Scans; scan->name; scan++) {
+		if (!scan->supported()) {
+			continue;
+		}
+		S_Use(scan);
+		for (int size = 16; size <= 64; size *= 2) {
+			ScanFixed fixed = S_Fixed(size);
+			if (fixed == NULL || S_Fixed(size + 1) != NULL) {
+				printf("%s: no fixed scan for %d\n", scan->name, size);
+				return 0;
+			}
+			// empty, a few, half and full, and either side of those
+			int fulls[] = { 0, 1, size / 4 - 1, size / 2, size / 2 + 1, size - 1, size };
+			for (int ff = 0; ff < 7; ff++) {
+				int full = fulls[ff];
+				for (int ii = -1; ii <= size; ii++) {
+					float xf = ii * 10, yf = 1000 - ii * 10;
+					if (fixed(xs, ys, full, xf, yf) != scan->find(xs, ys, full, xf, yf)) {
+						printf("%s: fixed scan of %d/%d differs at %d\n", scan->name, full, size, ii);
+						return 0;
+					}
+				}
+			}
+		}
+	}
+	S_Use(NULL);
+
+	return 1;
+}
+
+int TestT_NewConfig(void)
+{
+	int ok = 1;
+
+	if (!TestT_NewConfig01()) {
+		return 0;
+	}
+	if (!TestT_NewConfig02()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestT_Hash(void)
+{
+	int ok = 1;
+
+	int npts = 20000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom **moves = calloc(npts, sizeof(Geom *));
+	Pt *pts = calloc(npts, sizeof(Pt));
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	Geom *found;
+	int nmove = 0;
+
+	assert(geoms);
+	assert(moves);
+	assert(pts);
+
+	// distinct points, a quarter of them packed into a yard
+	for (int ii = 0; ii < npts; ii++) {
+		if (ii % 4 == 0) {
+			geoms[ii] = P_New(500 + ii % 100 * 0.02, 500 + ii / 100 * 0.02, ii);
+		}
+		else {
+			geoms[ii] = P_New(ii % 997 + ii / 997 * 0.001, ii % 991 + ii / 991 * 0.001, ii);
+		}
+	}
+
+	// hashed part way through, then kept up to date
+	for (int ii = 0; ii < npts / 2; ii++) {
+		Q_Add(tree->root, geoms[ii]);
+	}
+	T_Hash(tree, 1);
+	Q_AddBatch(tree->root, geoms + npts / 2, npts / 2);
+	if (tree->hash->full != npts || !Help_FindsExactly(tree, geoms, npts)) {
+		printf("failed to hash added points\n");
+		return 0;
+	}
+
+	for (int ii = 0; ii < npts; ii += 3) {
+		Q_Remove(tree->root, geoms[ii]);
+	}
+	for (int ii = 1; ii < npts; ii += 3) {
+		moves[nmove] = geoms[ii];
+		pts[nmove] = geoms[ii]->pt;
+		pts[nmove].xf += ii % 2 ? 0.0005 : 50;
+		nmove++;
+	}
+	Q_Move(tree->root, moves, pts, nmove);
+	if (tree->hash->full != Help_CheckTree(tree->root) || !Help_FindsExactly(tree, geoms, npts)) {
+		printf("failed to keep the hash up to date\n");
+		return 0;
+	}
+
+	// a signed zero is the same position
+	geoms[0]->pt.xf = -0.0;
+	geoms[0]->pt.yf = 0.0;
+	Q_Add(tree->root, geoms[0]);
+	if (!T_FindExact(tree, 0.0, -0.0, &found) || found != geoms[0]) {
+		printf("failed to find a signed zero\n");
+		return 0;
+	}
+
+	// and the same answers without the hash
+	T_Hash(tree, 0);
+	if (!Help_FindsExactly(tree, geoms, npts)) {
+		printf("failed to find exactly without a hash\n");
+		return 0;
+	}
+
+	T_Hash(tree, 1);
+	T_Reset(tree);
+	if (tree->hash->full != 0 || T_FindExact(tree, geoms[1]->pt.xf, geoms[1]->pt.yf, &found)) {
+		printf("failed to empty the hash\n");
+		return 0;
+	}
+	T_Fill(NULL, tree, geoms, npts);
+	if (tree->hash->full != npts || !Help_FindsExactly(tree, geoms, npts)) {
+		printf("failed to hash a rebuilt tree\n");
+		return 0;
+	}
+
+	T_Free(tree);
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(pts);
+	free(moves);
+	free(geoms);
+
+	return ok;
+}
+
+// The totals of stats agree with each other and with the tree. Returns
+// 0 if not.
+int Help_CheckStats(Stats *stats, Quad *quad)
+{
+	long bydepth = 0, byfill = 0;
+
+	for (int ii = 0; ii < STATSDEPTH; ii++) {
+		bydepth += stats->depth[ii];
+	}
+	for (int ii = 0; ii <= STATSFILL; ii++) {
+		byfill += stats->fill[ii];
+	}
+	if (stats->nleaf != 3 * stats->nnode + 1 || bydepth != stats->nleaf || byfill != stats->nleaf) {
+		printf("stats: %ld nodes, %ld leaves, %ld by depth, %ld by fill\n", stats->nnode, stats->nleaf, bydepth, byfill);
+		return 0;
+	}
+	if (stats->npt != Help_CheckTree(quad) || stats->depth[stats->maxdepth] == 0 || stats->bytes == 0) {
+		printf("stats: %ld points, %ld leaves at max depth %d, %zu bytes\n", stats->npt, stats->depth[stats->maxdepth], stats->maxdepth, stats->bytes);
+		return 0;
+	}
+
+	return 1;
+}
+
+int TestQ_Stats(void)
+{
+	int ok = 1;
+
+	int npts = 20000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	Stats stats;
+
+	assert(geoms);
+
+	// uniform, with a tenth piled on one spot
+	srand(21);
+	for (int ii = 0; ii < npts; ii++) {
+		if (ii % 10 == 0) {
+			geoms[ii] = P_New(300, 300, ii);
+		}
+		else {
+			geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		}
+	}
+
+	// every node came from a split and every small leaf from a small split
+	for (int ii = 0; ii < npts; ii++) {
+		Q_Add(tree->root, geoms[ii]);
+	}
+	Q_Stats(tree->root, &stats);
+	if (!Help_CheckStats(&stats, tree->root) || stats.npt != npts) {
+		printf("failed stats of added tree\n");
+		return 0;
+	}
+	if (stats.counts.splits != stats.nnode || stats.counts.smallsplits != stats.nsmall || stats.nsmall == 0) {
+		printf("failed counts: %ld splits of %ld nodes, %ld small splits of %ld\n",
+			stats.counts.splits, stats.nnode, stats.counts.smallsplits, stats.nsmall);
+		return 0;
+	}
+	if (stats.maxsmall < npts / 10 || stats.counts.resizes == 0 || stats.bytes != tree->arena.bytes) {
+		printf("failed small stats: largest %d, %ld resizes, %zu bytes\n", stats.maxsmall, stats.counts.resizes, stats.bytes);
+		return 0;
+	}
+
+	// a subtree, with depths counted from its top, and counts that
+	// outlive a reset
+	int maxdepth = stats.maxdepth;
+	Q_Stats(tree->root->node.nw, &stats);
+	if (!Help_CheckStats(&stats, tree->root->node.nw) || stats.maxdepth >= maxdepth) {
+		printf("failed stats of a subtree\n");
+		return 0;
+	}
+	long splits = tree->counts.splits;
+	T_Reset(tree);
+	Q_Stats(tree->root, &stats);
+	if (stats.nleaf != 1 || stats.npt != 0 || stats.maxdepth != 0 || stats.counts.splits != splits) {
+		printf("failed stats of reset tree\n");
+		return 0;
+	}
+	T_Free(tree);
+
+	// building and batches count the nodes they make as splits
+	tree = T_Build(geoms, npts, 0, 0, 1000, 1000);
+	Q_Stats(tree->root, &stats);
+	if (!Help_CheckStats(&stats, tree->root) || stats.counts.splits != stats.nnode || stats.nnode == 0) {
+		printf("failed counts of built tree: %ld splits of %ld nodes\n", stats.counts.splits, stats.nnode);
+		return 0;
+	}
+	T_Free(tree);
+	tree = T_New(0, 0, 1000, 1000);
+	Q_AddBatch(tree->root, geoms, npts / 2);
+	Q_AddBatch(tree->root, geoms + npts / 2, npts - npts / 2);
+	Q_Stats(tree->root, &stats);
+	if (!Help_CheckStats(&stats, tree->root) || stats.counts.splits != stats.nnode) {
+		printf("failed counts of batch tree: %ld splits of %ld nodes\n", stats.counts.splits, stats.nnode);
+		return 0;
+	}
+	T_Free(tree);
+
+	// a parallel build counts the splits of every worker
+	Pool *pool = W_New(4);
+	tree = T_BuildPool(pool, geoms, npts, 0, 0, 1000, 1000);
+	Q_Stats(tree->root, &stats);
+	if (!Help_CheckStats(&stats, tree->root) || stats.counts.smallsplits != stats.nsmall || stats.counts.splits != stats.nnode) {
+		printf("failed stats of built tree\n");
+		return 0;
+	}
+	T_Free(tree);
+	W_Free(pool);
+
+	// a calloc tree has no counts but its size is known
+	Quad *quad = Q_Build(geoms, npts, 0, 0, 1000, 1000);
+	Q_Stats(quad, &stats);
+	if (!Help_CheckStats(&stats, quad) || stats.counts.smallsplits != 0 || stats.bytes < npts * sizeof(Geom *)) {
+		printf("failed stats of calloc tree\n");
+		return 0;
+	}
+	Q_Free(quad);
+
+	// every quad of a loose tree is a leaf of geoms
+	Tree *loose = T_NewLoose(0, 0, 1000, 1000);
+	Geom *rects[500];
+	long bydepth = 0;
+	for (int ii = 0; ii < 500; ii++) {
+		rects[ii] = Rect_New(rand() % 1000, rand() % 1000, ii % 50 ? 2 : 300, 2);
+		Q_Add(loose->root, rects[ii]);
+	}
+	Q_Stats(loose->root, &stats);
+	for (int ii = 0; ii < STATSDEPTH; ii++) {
+		bydepth += stats.depth[ii];
+	}
+	if (stats.npt != 500 || stats.nnode != 0 || stats.nleaf < 2 || bydepth != stats.nleaf ||
+	    stats.maxdepth == 0 || stats.bytes < 500 * sizeof(Geom *)) {
+		printf("failed stats of loose tree: %ld geoms in %ld leaves\n", stats.npt, stats.nleaf);
+		return 0;
+	}
+	T_Free(loose);
+	for (int ii = 0; ii < 500; ii++) {
+		free(rects[ii]);
+	}
+
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+
+	return ok;
+}
+
+#ifdef QUAD_TRACE
+
+// Counts the traces of threads
+void Help_CountTrace(Trace *trace, void *arg)
+{
+	(*(int *) arg)++;
+}
+
+long Help_Binned(long *bins)
+{
+	long cnt = 0;
+
+	for (int ii = 0; ii < TRACEBINS; ii++) {
+		cnt += bins[ii];
+	}
+
+	return cnt;
+}
+
+void *Help_TraceFinds(void *arg)
+{
+	Tree *tree = arg;
+	Geom *found;
+
+	// traced into this thread's own trace
+	for (int ii = 0; ii < 100; ii++) {
+		Q_Find(tree->root, ii, ii, &found);
+	}
+
+	return NULL;
+}
+
+int TestTrace(void)
+{
+	int ok = 1;
+
+	int npts = 10000;
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	Geom *found;
+	Trace before, after;
+	int nthread = 0;
+	pthread_t thread;
+
+	Trace_Sum(&before);
+
+	srand(22);
+	for (int ii = 0; ii < npts; ii++) {
+		// a few piled up, to make small leaves grow
+		if (ii % 8 == 0) {
+			Q_Add(tree->root, TP_New(tree, 600, 600, ii));
+		}
+		else {
+			Q_Add(tree->root, TP_New(tree, rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii));
+		}
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		Q_Find(tree->root, 600, 600, &found);
+	}
+	if (pthread_create(&thread, NULL, Help_TraceFinds, tree) != 0) {
+		printf("failed to start a thread\n");
+		return 0;
+	}
+	pthread_join(thread, NULL);
+
+	Trace_Sum(&after);
+	Trace_Each(Help_CountTrace, &nthread);
+
+	long adds = Help_Binned(after.depth[TRACE_ADD]) - Help_Binned(before.depth[TRACE_ADD]);
+	long finds = Help_Binned(after.depth[TRACE_FIND]) - Help_Binned(before.depth[TRACE_FIND]);
+	long timed = Help_Binned(after.ns[TRACE_ADD]) + Help_Binned(after.ns[TRACE_FIND]) -
+		Help_Binned(before.ns[TRACE_ADD]) - Help_Binned(before.ns[TRACE_FIND]);
+	long splits = Help_Binned(after.ns[TRACE_SPLIT]) - Help_Binned(before.ns[TRACE_SPLIT]);
+	long grows = Help_Binned(after.ns[TRACE_GROW]) - Help_Binned(before.ns[TRACE_GROW]);
+	if (adds != npts || finds != npts + 100 || nthread < 2) {
+		printf("failed to trace %d adds and %d finds on 2 threads: %ld, %ld on %d\n", npts, npts + 100, adds, finds, nthread);
+		return 0;
+	}
+	if (splits != tree->counts.splits + tree->counts.smallsplits || grows == 0) {
+		printf("failed to trace splits and grows: %ld, %ld\n", splits, grows);
+		return 0;
+	}
+	// one in TRACESAMPLE on each of the two threads
+	if (timed < (adds + finds) / TRACESAMPLE - 2 || timed > (adds + finds) / TRACESAMPLE) {
+		printf("failed to time %ld of %ld\n", timed, adds + finds);
+		return 0;
+	}
+	if (after.depth[TRACE_FIND][0] - before.depth[TRACE_FIND][0] == finds) {
+		printf("failed to trace find depths\n");
+		return 0;
+	}
+
+	T_Free(tree);
+
+	return ok;
+}
+
+#endif // QUAD_TRACE
+
+// Every geom of a loose quad and its children is held where it should
+// be: centred in the quad's cell unless the quad is the root, no wider or
+// higher than the cell, with bounds and a back reference to match.
+// Returns the number of geoms, or -1.
+int Help_CheckLoose(Quad *quad, int root)
+{
+	if (quad == NULL) {
+		return 0;
+	}
+	if (quad->tag != QUAD_LOOSE) {
+		printf("loose tree has tag %d\n", quad->tag);
+		return -1;
+	}
+
+	Loose *loose = &quad->loose;
+	Quad *kids[4] = { loose->nw, loose->ne, loose->sw, loose->se };
+	int cnt = loose->full, sub;
+
+	for (int ii = 0; ii < loose->full; ii++) {
+		Geom *geom = loose->geom[ii];
+		float width = loose->right[ii] - loose->left[ii];
+		float height = loose->bottom[ii] - loose->top[ii];
+		float centrex = loose->left[ii] + width / 2;
+		float centrey = loose->top[ii] + height / 2;
+		if (geom->quad != quad || geom->slot != ii) {
+			printf("stale back reference in loose quad\n");
+			return -1;
+		}
+		if (root) {
+			continue;
+		}
+		if (width > quad->width || height > quad->height ||
+		    centrex < quad->left || centrex >= quad->left + quad->width ||
+		    centrey < quad->top || centrey >= quad->top + quad->height) {
+			printf("geom of %g by %g at %g, %g in quad of %g by %g at %g, %g\n",
+				width, height, centrex, centrey, quad->width, quad->height, quad->left, quad->top);
+			return -1;
+		}
+	}
+	for (int ii = 0; ii < 4; ii++) {
+		if ((sub = Help_CheckLoose(kids[ii], 0)) < 0) {
+			return -1;
+		}
+		cnt += sub;
+	}
+
+	return cnt;
+}
+
+typedef struct tSeen Seen;
+
+// What a query reported, to be compared against every geom
+struct tSeen {
+	Geom **geoms;
+	int npts;
+	int *seen;
+};
+
+int Help_SeeGeom(Geom *geom, void *arg)
+{
+	Seen *seen = arg;
+
+	for (int ii = 0; ii < seen->npts; ii++) {
+		if (seen->geoms[ii] == geom) {
+			seen->seen[ii]++;
+			return 1;
+		}
+	}
+	seen->seen[0] = -1000000;
+
+	return 1;
+}
+
+// A query reports each geom in the tree that touches with, once
+int Help_Intersects(Tree *tree, Seen *seen, Geom *with)
+{
+	memset(seen->seen, 0, seen->npts * sizeof(int));
+
+	if (with->tag == GEOM_RECT) {
+		Q_QueryRect(tree->root, with->rect.left, with->rect.top, with->rect.width, with->rect.height, Help_SeeGeom, seen);
+	}
+	else {
+		Q_Intersect(tree->root, with, Help_SeeGeom, seen);
+	}
+
+	for (int ii = 0; ii < seen->npts; ii++) {
+		int want = seen->geoms[ii]->quad && G_Intersects(seen->geoms[ii], with);
+		if (seen->seen[ii] != want) {
+			printf("geom %d of tag %d reported %d times, not %d\n", ii, seen->geoms[ii]->tag, seen->seen[ii], want);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int TestQ_Loose01(void)
+{
+	int ok = 1;
+
+	// crossing, parallel, collinear and touching segments
+	Geom *cross = Seg_New(0, 0, 10, 10);
+	Geom *tests[][2] = {
+		{ Seg_New(0, 10, 10, 0), (Geom *) 1 },
+		{ Seg_New(1, 0, 11, 10), NULL },
+		{ Seg_New(5, 5, 20, 20), (Geom *) 1 },
+		{ Seg_New(11, 11, 20, 20), NULL },
+		{ Seg_New(10, 10, 20, 0), (Geom *) 1 },
+		{ Seg_New(0, 1, 4, 5), NULL },
+		// a rect the segment crosses without an end inside, and one
+		// its bounds overlap but the segment passes by
+		{ Rect_New(4, -10, 2, 30), (Geom *) 1 },
+		{ Rect_New(8, 0, 2, 1), NULL },
+		{ P_New(3, 3, 0), (Geom *) 1 },
+		{ P_New(3, 4, 0), NULL },
+	};
+
+	for (int ii = 0; ii < (int) (sizeof(tests) / sizeof(tests[0])); ii++) {
+		if (G_Intersects(cross, tests[ii][0]) != (tests[ii][1] != NULL) ||
+		    G_Intersects(tests[ii][0], cross) != (tests[ii][1] != NULL)) {
+			printf("failed intersection %d\n", ii);
+			return 0;
+		}
+		free(tests[ii][0]);
+	}
+	free(cross);
+
+	Geom *aa = Rect_New(0, 0, 10, 10), *bb = Rect_New(10, 5, 10, 10), *cc = Rect_New(10.5, 5, 10, 10);
+	if (!G_Intersects(aa, bb) || G_Intersects(aa, cc)) {
+		printf("failed rect intersections\n");
+		return 0;
+	}
+	free(aa);
+	free(bb);
+	free(cc);
+
+	return ok;
+}
+
+int TestQ_Loose02(void)
+{
+	int ok = 1;
+
+	int npts = 3000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	int *seen = calloc(npts, sizeof(int));
+	Seen see = { geoms, npts, seen };
+	Tree *tree = T_NewLoose(0, 0, 1000, 1000);
+	Geom *with;
+
+	assert(geoms);
+	assert(seen);
+
+	// footprints and roads of every size, some poking out of the tree
+	srand(23);
+	for (int ii = 0; ii < npts; ii++) {
+		float xf = rand() % 110000 / 100.0 - 50, yf = rand() % 110000 / 100.0 - 50;
+		float size = ii % 50 == 0 ? rand() % 500 : rand() % 1000 / 100.0;
+		switch (ii % 3) {
+		case 0:
+			geoms[ii] = Rect_New(xf, yf, size, size * (rand() % 4 + 1) / 2);
+			break;
+		case 1:
+			geoms[ii] = Seg_New(xf, yf, xf + size * (rand() % 3 - 1), yf + size * (rand() % 3 - 1));
+			break;
+		default:
+			geoms[ii] = P_New(xf, yf, ii);
+		}
+		Q_Add(tree->root, geoms[ii]);
+	}
+	if (Help_CheckLoose(tree->root, 1) != npts) {
+		printf("failed to check loose tree\n");
+		return 0;
+	}
+
+	for (int round = 0; round < 2; round++) {
+		for (int qq = 0; qq < 100; qq++) {
+			float xf = rand() % 100000 / 100.0, yf = rand() % 100000 / 100.0;
+			float size = qq % 10 == 0 ? rand() % 400 : rand() % 4000 / 100.0;
+			with = qq % 2 ? Rect_New(xf, yf, size, size) : Seg_New(xf, yf, xf + size, yf - size / 2);
+			if (!Help_Intersects(tree, &see, with)) {
+				printf("failed query %d in round %d\n", qq, round);
+				return 0;
+			}
+			free(with);
+		}
+
+		// and again with a third gone
+		for (int ii = round; ii < npts; ii += 3) {
+			if (!Q_Remove(tree->root, geoms[ii]) || Q_Remove(tree->root, geoms[ii])) {
+				printf("failed to remove geom %d once\n", ii);
+				return 0;
+			}
+		}
+		if (Help_CheckLoose(tree->root, 1) != npts - (round + 1) * npts / 3) {
+			printf("failed to check loose tree after removal\n");
+			return 0;
+		}
+	}
+
+	// a buffer, and a reset back to an empty loose root
+	Geom *out[5] = { NULL };
+	int want = 0;
+	with = Rect_New(0, 0, 1000, 1000);
+	for (int ii = 0; ii < npts; ii++) {
+		want += geoms[ii]->quad && G_Intersects(geoms[ii], with);
+	}
+	free(with);
+	if (Q_QueryRectBuf(tree->root, 0, 0, 1000, 1000, out, 5) != want || out[4] == NULL) {
+		printf("failed to fill a buffer\n");
+		return 0;
+	}
+	T_Reset(tree);
+	if (tree->root->tag != QUAD_LOOSE || tree->root->loose.full != 0) {
+		printf("failed to reset loose tree\n");
+		return 0;
+	}
+
+	T_Free(tree);
+
+	free(seen);
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+
+	return ok;
+}
+
+// The square of the distance from a point to a geom, worked out apart
+// from the tree
+double Help_GeomDist(Geom *geom, double xf, double yf)
+{
+	if (geom->tag == GEOM_POINT) {
+		return (geom->pt.xf - xf) * (geom->pt.xf - xf) + (geom->pt.yf - yf) * (geom->pt.yf - yf);
+	}
+	if (geom->tag == GEOM_RECT) {
+		Rect *rect = &geom->rect;
+		double dx = xf < rect->left ? rect->left - xf : xf > rect->left + rect->width ? xf - rect->left - rect->width : 0;
+		double dy = yf < rect->top ? rect->top - yf : yf > rect->top + rect->height ? yf - rect->top - rect->height : 0;
+		return dx * dx + dy * dy;
+	}
+
+	Seg *seg = &geom->seg;
+	double dx = seg->x1 - seg->x0, dy = seg->y1 - seg->y0;
+	double along = dx || dy ? ((xf - seg->x0) * dx + (yf - seg->y0) * dy) / (dx * dx + dy * dy) : 0;
+
+	along = along < 0 ? 0 : along > 1 ? 1 : along;
+	dx = seg->x0 + along * dx - xf;
+	dy = seg->y0 + along * dy - yf;
+
+	return dx * dx + dy * dy;
+}
+
+// Ascending distances, for qsort
+int Help_CompareDist(const void *aa, const void *bb)
+{
+	double da = *(const double *) aa, db = *(const double *) bb;
+
+	return (da > db) - (da < db);
+}
+
+// Point queries, batch adds and moves on a loose tree holding points,
+// rects and segments
+int TestQ_Loose03(void)
+{
+	int ok = 1;
+
+	int npts = 2000, nq = 300, kk = 5;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom **found = calloc(nq, sizeof(Geom *));
+	Geom **out = calloc(nq * kk, sizeof(Geom *));
+	Pt *pts = calloc(npts, sizeof(Pt));
+	double *dists = calloc(npts, sizeof(double));
+	float *xf = calloc(nq, sizeof(float)), *yf = calloc(nq, sizeof(float));
+	int *nout = calloc(nq, sizeof(int));
+	Tree *tree = T_NewLoose(0, 0, 1000, 1000);
+	Pool *pool = W_New(4);
+	Geom *expect[5], *geom;
+	int nfound, nmoved, want;
+
+	assert(geoms && found && out && pts && dists && xf && yf && nout);
+
+	// every third a point, some outside the root, half added in a batch
+	srand(29);
+	for (int ii = 0; ii < npts; ii++) {
+		float x0 = rand() % 110000 / 100.0 - 50, y0 = rand() % 110000 / 100.0 - 50;
+		float size = ii % 40 == 0 ? rand() % 300 : rand() % 1000 / 100.0;
+		switch (ii % 3) {
+		case 0:
+			geoms[ii] = Rect_New(x0, y0, size, size);
+			break;
+		case 1:
+			geoms[ii] = Seg_New(x0, y0, x0 + size, y0 - size);
+			break;
+		default:
+			geoms[ii] = P_New(x0, y0, ii);
+		}
+		if (ii >= npts / 2) {
+			Q_Add(tree->root, geoms[ii]);
+		}
+	}
+	Q_AddBatch(tree->root, geoms, npts / 2);
+	if (Help_CheckLoose(tree->root, 1) != npts) {
+		printf("failed to check loose tree after batch add\n");
+		return 0;
+	}
+
+	for (int round = 0; round < 2; round++) {
+		// queries on points, near them and away from them
+		for (int qq = 0; qq < nq; qq++) {
+			geom = geoms[(qq * 3 + 2) % npts];
+			xf[qq] = qq % 3 == 2 ? rand() % 100000 / 100.0 : geom->pt.xf + (qq % 3) * 0.05;
+			yf[qq] = qq % 3 == 2 ? rand() % 100000 / 100.0 : geom->pt.yf;
+		}
+		for (int qq = 0; qq < nq; qq++) {
+			want = 0;
+			for (int ii = 2; ii < npts; ii += 3) {
+				float dx = geoms[ii]->pt.xf - xf[qq], dy = geoms[ii]->pt.yf - yf[qq];
+				want |= dx * dx < 0.01 && dy * dy < 0.01;
+			}
+			geom = NULL;
+			if (Q_Find(tree->root, xf[qq], yf[qq], &geom) != want || (want && (geom->tag != GEOM_POINT ||
+			    !((geom->pt.xf - xf[qq]) * (geom->pt.xf - xf[qq]) < 0.01 && (geom->pt.yf - yf[qq]) * (geom->pt.yf - yf[qq]) < 0.01)))) {
+				printf("failed to find loose query %d in round %d\n", qq, round);
+				return 0;
+			}
+			found[qq] = geom;
+			if (qq % 3 == 0 && (!T_FindExact(tree, xf[qq], yf[qq], &geom) || geom != geoms[(qq * 3 + 2) % npts])) {
+				printf("failed to find loose query %d exactly in round %d\n", qq, round);
+				return 0;
+			}
+		}
+		nfound = 0;
+		for (int qq = 0; qq < nq; qq++) {
+			nfound += found[qq] != NULL;
+		}
+		memcpy(out, found, nq * sizeof(Geom *));
+		if (Q_FindBatch(tree->root, xf, yf, nq, found) != nfound || memcmp(out, found, nq * sizeof(Geom *)) != 0 ||
+		    Q_FindPool(pool, tree->root, xf, yf, nq, found, 50) != nfound || memcmp(out, found, nq * sizeof(Geom *)) != 0) {
+			printf("failed to find loose batch in round %d\n", round);
+			return 0;
+		}
+
+		// the k nearest, by distance as ties may come in any order
+		for (int qq = 0; qq < nq; qq++) {
+			for (int ii = 0; ii < npts; ii++) {
+				dists[ii] = Help_GeomDist(geoms[ii], xf[qq], yf[qq]);
+			}
+			qsort(dists, npts, sizeof(double), Help_CompareDist);
+			if (Q_Nearest(tree->root, xf[qq], yf[qq], kk, expect) != kk) {
+				printf("failed to find %d nearest in loose tree\n", kk);
+				return 0;
+			}
+			for (int ii = 0; ii < kk; ii++) {
+				double got = Help_GeomDist(expect[ii], xf[qq], yf[qq]);
+				if (fabs(got - dists[ii]) > 0.001 * (1 + dists[ii])) {
+					printf("failed nearest %d of loose query %d: %g != %g\n", ii, qq, got, dists[ii]);
+					return 0;
+				}
+			}
+		}
+		if (Q_NearestPool(pool, tree->root, xf, yf, nq, kk, out, nout, 50) != nq * kk) {
+			printf("failed to find nearest in loose tree on a pool\n");
+			return 0;
+		}
+		for (int qq = 0; qq < nq; qq++) {
+			if (Q_Nearest(tree->root, xf[qq], yf[qq], kk, expect) != nout[qq] || memcmp(expect, out + qq * kk, kk * sizeof(Geom *)) != 0) {
+				printf("failed nearest loose query %d on a pool\n", qq);
+				return 0;
+			}
+		}
+
+		// move the points, a few far and the rest a little
+		want = 0;
+		for (int ii = 2, jj = 0; ii < npts; ii += 3, jj++) {
+			geom = geoms[ii];
+			pts[jj] = geom->pt;
+			if (jj % 10 == 0) {
+				pts[jj].xf = rand() % 100000 / 100.0;
+				pts[jj].yf = rand() % 100000 / 100.0;
+			}
+			else {
+				pts[jj].xf += rand() % 200 / 100.0 - 1;
+			}
+			out[jj] = geom;
+			want++;
+		}
+		nmoved = Q_Move(tree->root, out, pts, want);
+		if (nmoved < 0 || nmoved > want || Help_CheckLoose(tree->root, 1) != npts) {
+			printf("failed to move %d points in loose tree: %d\n", want, nmoved);
+			return 0;
+		}
+		for (int jj = 0; jj < want; jj++) {
+			if (out[jj]->pt.xf != pts[jj].xf || !T_FindExact(tree, pts[jj].xf, pts[jj].yf, &geom) ||
+			    geom->pt.xf != pts[jj].xf || geom->pt.yf != pts[jj].yf) {
+				printf("failed to find moved point %d in loose tree\n", jj);
+				return 0;
+			}
+		}
+	}
+
+	if (Q_Freeze(tree->root) != NULL) {
+		printf("failed to refuse to freeze a loose tree\n");
+		return 0;
+	}
+	T_Fill(pool, tree, geoms, npts);
+	if (tree->root->tag != QUAD_LOOSE || Help_CheckLoose(tree->root, 1) != npts) {
+		printf("failed to fill loose tree\n");
+		return 0;
+	}
+
+	W_Free(pool);
+	T_Free(tree);
+
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+	free(found);
+	free(out);
+	free(pts);
+	free(dists);
+	free(xf);
+	free(yf);
+	free(nout);
+
+	return ok;
+}
+
+int TestQ_Loose(void)
+{
+	int ok = 1;
+
+	if (!TestQ_Loose01()) {
+		return 0;
+	}
+	if (!TestQ_Loose02()) {
+		return 0;
+	}
+	if (!TestQ_Loose03()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+typedef struct tPairSum PairSum;
+
+// What a join reported: how many pairs, a sum that identifies them, and
+// how many more it may report before it is stopped
+struct tPairSum {
+	long cnt, sum;
+	int npts;
+	long limit;
+};
+
+long Help_PairKey(Geom *aa, Geom *bb, int npts)
+{
+	long ia = aa->pt.zf, ib = bb->pt.zf;
+
+	return ia < ib ? ia * npts + ib : ib * npts + ia;
+}
+
+int Help_SumPair(Geom *aa, Geom *bb, void *arg)
+{
+	PairSum *ps = arg;
+
+	__atomic_fetch_add(&ps->sum, Help_PairKey(aa, bb, ps->npts), __ATOMIC_RELAXED);
+
+	return __atomic_add_fetch(&ps->cnt, 1, __ATOMIC_RELAXED) < ps->limit;
+}
+
+int TestQ_SelfJoin(void)
+{
+	int ok = 1;
+
+	int npts = 4000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	float dists[] = { 0, 3, 25, -1 };
+
+	assert(geoms);
+
+	// spread out, on a line, and piled up, so that leaves are of every kind
+	srand(24);
+	for (int ii = 0; ii < npts; ii++) {
+		if (ii % 4 == 0) {
+			geoms[ii] = P_New(100 + ii % 7, 900, ii);
+		}
+		else if (ii % 4 == 1) {
+			geoms[ii] = P_New(ii / 4.0, 500 + rand() % 100 / 100.0, ii);
+		}
+		else {
+			geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		}
+		Q_Add(tree->root, geoms[ii]);
+	}
+
+	Pool *pool = W_New(4);
+
+	for (int dd = 0; dists[dd] >= 0; dd++) {
+		float dist = dists[dd];
+		PairSum want = { 0, 0, npts, 0 };
+		for (int ii = 0; ii < npts; ii++) {
+			for (int jj = ii + 1; jj < npts; jj++) {
+				float dx = geoms[ii]->pt.xf - geoms[jj]->pt.xf, dy = geoms[ii]->pt.yf - geoms[jj]->pt.yf;
+				if (dx * dx + dy * dy <= dist * dist) {
+					want.cnt++;
+					want.sum += Help_PairKey(geoms[ii], geoms[jj], npts);
+				}
+			}
+		}
+		for (int pp = 0; pp < 2; pp++) {
+			PairSum got = { 0, 0, npts, want.cnt + 1 };
+			long cnt = Q_SelfJoin(pp ? pool : NULL, tree->root, dist, Help_SumPair, &got);
+			if (cnt != want.cnt || got.cnt != want.cnt || got.sum != want.sum) {
+				printf("failed to join within %g %s: %ld pairs, %ld reported, want %ld\n",
+					dist, pp ? "on a pool" : "alone", cnt, got.cnt, want.cnt);
+				return 0;
+			}
+		}
+		if (want.cnt == 0) {
+			printf("no pairs within %g to join\n", dist);
+			return 0;
+		}
+	}
+
+	// stopped early, after one pair alone and after a few on the pool
+	PairSum one = { 0, 0, npts, 1 };
+	if (Q_SelfJoin(NULL, tree->root, 25, Help_SumPair, &one) != 1) {
+		printf("failed to stop a join\n");
+		return 0;
+	}
+	PairSum few = { 0, 0, npts, 10 };
+	if (Q_SelfJoin(pool, tree->root, 25, Help_SumPair, &few) > 1000) {
+		printf("failed to stop a join on a pool\n");
+		return 0;
+	}
+
+	W_Free(pool);
+	T_Free(tree);
+	for (int ii = 0; ii < npts; ii++) {
+		free(geoms[ii]);
+	}
+	free(geoms);
+
+	return ok;
+}
+
+// An id for a geom of a join: zf for points, the corner for the others,
+// whose corners the tests keep apart
+long Help_GeomKey(Geom *geom)
+{
+	switch (geom->tag) {
+	case GEOM_POINT:
+		return geom->pt.zf;
+	case GEOM_RECT:
+		return (long) geom->rect.left * 1000 + (long) geom->rect.top;
+	default:
+		return (long) geom->seg.x0 * 1000 + (long) geom->seg.y0;
+	}
+}
+
+// As Help_SumPair, keeping which tree each geom came from
+int Help_SumJoin(Geom *aa, Geom *bb, void *arg)
+{
+	PairSum *ps = arg;
+
+	__atomic_fetch_add(&ps->sum, Help_GeomKey(aa) * 1000003 + Help_GeomKey(bb), __ATOMIC_RELAXED);
+
+	return __atomic_add_fetch(&ps->cnt, 1, __ATOMIC_RELAXED) < ps->limit;
+}
+
+// Join geomsa, all points in aa, with geomsb in bb, and compare with
+// every pair worked out by hand
+int Help_CheckJoin(Pool *pool, Quad *aa, Geom **geomsa, int npta, Quad *bb, Geom **geomsb, int nptb, float dist)
+{
+	PairSum want = { 0, 0, 0, 0 };
+
+	for (int ii = 0; ii < npta; ii++) {
+		for (int jj = 0; jj < nptb; jj++) {
+			double d2 = Help_GeomDist(geomsb[jj], geomsa[ii]->pt.xf, geomsa[ii]->pt.yf);
+			if (d2 <= dist * dist) {
+				want.cnt++;
+				want.sum += Help_GeomKey(geomsa[ii]) * 1000003 + Help_GeomKey(geomsb[jj]);
+			}
+		}
+	}
+	for (int pp = 0; pp < 2; pp++) {
+		PairSum got = { 0, 0, 0, want.cnt + 1 };
+		long cnt = Q_Join(pp ? pool : NULL, aa, bb, dist, Help_SumJoin, &got);
+		if (cnt != want.cnt || got.cnt != want.cnt || got.sum != want.sum) {
+			printf("failed to join within %g %s: %ld pairs, %ld reported, want %ld\n",
+				dist, pp ? "on a pool" : "alone", cnt, got.cnt, want.cnt);
+			return 0;
+		}
+	}
+	if (want.cnt == 0) {
+		printf("no pairs within %g to join\n", dist);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Two point trees over different bounds, split at different centres
+int TestQ_Join01(void)
+{
+	int npta = 3000, nptb = 2000;
+	Geom **geomsa = calloc(npta, sizeof(Geom *));
+	Geom **geomsb = calloc(nptb, sizeof(Geom *));
+	Config config = { 32, LEAFGROWTH, QUADMINEXTENT };
+	Tree *treea = T_New(0, 0, 1000, 1000);
+	Tree *treeb = T_NewConfig(&config, -200, 300, 700, 700);
+	float dists[] = { 0, 3, 25, -1 };
+
+	assert(geomsa && geomsb);
+
+	T_Split(treeb, Split_Mid);
+
+	srand(25);
+	for (int ii = 0; ii < npta; ii++) {
+		if (ii % 3 == 0) {
+			geomsa[ii] = P_New(300 + ii % 11, 600, ii);
+		}
+		else {
+			geomsa[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		}
+		Q_Add(treea->root, geomsa[ii]);
+	}
+	// some on points of aa, some outside the bounds of bb
+	for (int ii = 0; ii < nptb; ii++) {
+		if (ii % 4 == 0) {
+			geomsb[ii] = P_New(geomsa[ii]->pt.xf, geomsa[ii]->pt.yf, ii);
+		}
+		else {
+			geomsb[ii] = P_New(rand() % 120000 / 100.0 - 100, rand() % 120000 / 100.0 - 100, ii);
+		}
+		Q_Add(treeb->root, geomsb[ii]);
+	}
+
+	Pool *pool = W_New(4);
+
+	for (int dd = 0; dists[dd] >= 0; dd++) {
+		if (!Help_CheckJoin(pool, treea->root, geomsa, npta, treeb->root, geomsb, nptb, dists[dd])) {
+			return 0;
+		}
+	}
+
+	// stopped early, after one pair alone and after a few on the pool
+	PairSum one = { 0, 0, 0, 1 };
+	if (Q_Join(NULL, treea->root, treeb->root, 25, Help_SumJoin, &one) != 1) {
+		printf("failed to stop a join\n");
+		return 0;
+	}
+	PairSum few = { 0, 0, 0, 10 };
+	if (Q_Join(pool, treea->root, treeb->root, 25, Help_SumJoin, &few) > 1000) {
+		printf("failed to stop a join on a pool\n");
+		return 0;
+	}
+
+	W_Free(pool);
+	T_Free(treeb);
+	T_Free(treea);
+	for (int ii = 0; ii < npta; ii++) {
+		free(geomsa[ii]);
+	}
+	for (int ii = 0; ii < nptb; ii++) {
+		free(geomsb[ii]);
+	}
+	free(geomsb);
+	free(geomsa);
+
+	return 1;
+}
+
+// Points against the rects and segments of a loose tree
+int TestQ_Join02(void)
+{
+	int npta = 3000, nloose = 300;
+	Geom **geomsa = calloc(npta, sizeof(Geom *));
+	Geom **geomsb = calloc(nloose, sizeof(Geom *));
+	Tree *treea = T_New(0, 0, 1000, 1000);
+	Tree *treeb = T_NewLoose(0, 0, 1000, 1000);
+	float dists[] = { 0, 2.5, 20, -1 };
+
+	assert(geomsa && geomsb);
+
+	srand(25);
+	for (int ii = 0; ii < npta; ii++) {
+		geomsa[ii] = P_New(rand() % 1000, rand() % 1000, ii);
+		Q_Add(treea->root, geomsa[ii]);
+	}
+	// corners apart for Help_GeomKey; small and large, a few outside
+	for (int ii = 0; ii < nloose; ii++) {
+		float left = ii * 3 % 997 + (ii % 50 == 0 ? 1000 : 0), top = ii * 7 % 991;
+		float width = ii % 10 == 0 ? rand() % 400 : rand() % 20, height = ii % 10 == 0 ? rand() % 400 : rand() % 20;
+		if (ii % 3 == 0) {
+			geomsb[ii] = Seg_New(left, top, left + width, top + height - 10);
+		}
+		else {
+			geomsb[ii] = Rect_New(left, top, width, height);
+		}
+		Q_Add(treeb->root, geomsb[ii]);
+	}
+
+	Pool *pool = W_New(4);
+
+	for (int dd = 0; dists[dd] >= 0; dd++) {
+		if (!Help_CheckJoin(pool, treea->root, geomsa, npta, treeb->root, geomsb, nloose, dists[dd])) {
+			return 0;
+		}
+	}
+
+	W_Free(pool);
+	T_Free(treeb);
+	T_Free(treea);
+	for (int ii = 0; ii < npta; ii++) {
+		free(geomsa[ii]);
+	}
+	for (int ii = 0; ii < nloose; ii++) {
+		free(geomsb[ii]);
+	}
+	free(geomsb);
+	free(geomsa);
+
+	return 1;
+}
+
+int TestQ_Join(void)
+{
+	int ok = 1;
+
+	if (!TestQ_Join01()) {
+		return 0;
+	}
+	if (!TestQ_Join02()) {
+		return 0;
+	}
+
+	return ok;
+}
+
+int TestQ_Free(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 100, 100);
+
+	Help_AddPoints(quad, 1000);
+	Q_Free(quad);
+
+	// subtrees of an arena tree go back on the free lists
+	Tree *tree = T_New(0, 0, 100, 100);
+	Quad *sub = TL_New(tree, 0, 0, 10, 10);
+	Q_Free(sub);
+	if (TL_New(tree, 0, 0, 10, 10) != sub) {
+		printf("failed to recycle quad\n");
+		return 0;
+	}
+	T_Free(tree);
+
+	return ok;
+}
+
+int TestS_Kernels(void)
+{
+	int ok = 1;
+
+	int maxcnt = 100;
+	float xs[100], ys[100];
+	int want[100], got[100];
+	int nwant, ngot;
+	Scan *scalar;
+
+	for (scalar = Scans; scalar->name; scalar++) {
+		if (strcmp(scalar->name, "scalar") == 0) {
+			break;
+		}
+	}
+	assert(scalar->name);
+
+	// coarse coordinates so that points land on the box edges and within
+	// almost() of the probes
+	srand(4);
+	for (int ii = 0; ii < maxcnt; ii++) {
+		xs[ii] = rand() % 40 / 4.0;
+		ys[ii] = rand() % 40 / 4.0;
+	}
+	xs[maxcnt / 2] = NAN;
+
+	for (Scan *scan = Scans; scan->name; scan++) {
+		if (!scan->supported()) {
+			continue;
+		}
+		for (int cnt = 0; cnt <= maxcnt; cnt += 7) {
+			for (int probe = 0; probe < 20; probe++) {
+				float xf = rand() % 44 / 4.0 + (probe & 1) * 0.09;
+				float yf = rand() % 44 / 4.0;
+
+				if (scan->find(xs, ys, cnt, xf, yf) != scalar->find(xs, ys, cnt, xf, yf)) {
+					printf("%s: find (%f, %f) in %d points\n", scan->name, xf, yf, cnt);
+					return 0;
+				}
+
+				nwant = scalar->rect(xs, ys, cnt, xf, yf, xf + 2.5, yf + 2.5, want);
+				ngot = scan->rect(xs, ys, cnt, xf, yf, xf + 2.5, yf + 2.5, got);
+				if (ngot != nwant || memcmp(want, got, nwant * sizeof(int)) != 0) {
+					printf("%s: rect at (%f, %f) in %d points\n", scan->name, xf, yf, cnt);
+					return 0;
+				}
+			}
+		}
+	}
+
+	return ok;
+}
+
+int TestQ_Batch(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 1000, 1000);
+	int npts = 20000;
+	int nmiss = 100;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom **found = calloc(npts + nmiss, sizeof(Geom *));
+	float *xf = calloc(npts + nmiss, sizeof(float));
+	float *yf = calloc(npts + nmiss, sizeof(float));
+	Geom *one;
+
+	assert(geoms && found && xf && yf);
+
+	// clustered, and some beyond the root
+	srand(5);
+	for (int ii = 0; ii < npts; ii++) {
+		float cx = ii % 7 * 150;
+		geoms[ii] = P_New(cx + rand() % 20000 / 100.0, cx + rand() % 20000 / 100.0, ii);
+		xf[ii] = geoms[ii]->pt.xf;
+		yf[ii] = geoms[ii]->pt.yf;
+	}
+	for (int ii = npts; ii < npts + nmiss; ii++) {
+		xf[ii] = -5000 + ii;
+		yf[ii] = 5000;
+	}
+
+	Q_AddBatch(quad, geoms, npts / 2);
+	Q_AddBatch(quad, geoms + npts / 2, npts - npts / 2);
+	if (Help_CheckTree(quad) != npts) {
+		printf("failed to add batch\n");
+		return 0;
+	}
+
+	if (Q_FindBatch(quad, xf, yf, npts + nmiss, found) != npts) {
+		printf("failed to find batch\n");
+		return 0;
+	}
+	for (int ii = 0; ii < npts + nmiss; ii++) {
+		one = NULL;
+		Q_Find(quad, xf[ii], yf[ii], &one);
+		if (found[ii] != one) {
+			printf("batch and single lookups differ at %d\n", ii);
+			return 0;
+		}
+	}
+
+	// uniform points added in one batch split into plain leaves, none
+	// grown into a small one over a corner
+	Quad *even = L_New(0, 0, 1000, 1000);
+	Stats stats;
+	srand(7);
+	for (int ii = 0; ii < 5000; ii++) {
+		geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+	}
+	Q_AddBatch(even, geoms, 5000);
+	Q_Stats(even, &stats);
+	if (stats.npt != 5000 || stats.nsmall != 0) {
+		printf("batch of uniform points left %ld small leaves of %ld\n", stats.nsmall, stats.nleaf);
+		return 0;
+	}
+
+	free(geoms);
+	free(found);
+	free(xf);
+	free(yf);
+
+	return ok;
+}
+
+int TestQ_Remove(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int npts = 5000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Geom *found;
+
+	assert(geoms);
+
+	srand(6);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = TP_New(tree, rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		Q_Add(tree->root, geoms[ii]);
+	}
+
+	if (Q_Remove(tree->root, TP_New(tree, 1, 1, 0))) {
+		printf("removed point not in tree\n");
+		return 0;
+	}
+
+	// remove the odd points
+	for (int ii = 1; ii < npts; ii += 2) {
+		if (!Q_Remove(tree->root, geoms[ii])) {
+			printf("failed to remove point %d\n", ii);
+			return 0;
+		}
+		if (Q_Remove(tree->root, geoms[ii])) {
+			printf("removed point %d twice\n", ii);
+			return 0;
+		}
+	}
+	if (Help_CheckTree(tree->root) != npts / 2) {
+		printf("failed to keep tree consistent\n");
+		return 0;
+	}
+	for (int ii = 0; ii < npts; ii++) {
+		found = NULL;
+		Q_Find(tree->root, geoms[ii]->pt.xf, geoms[ii]->pt.yf, &found);
+		if ((found == geoms[ii]) != (ii % 2 == 0)) {
+			printf("failed to find the right points after removal\n");
+			return 0;
+		}
+	}
+
+	// and the rest, which should merge the tree back into its root
+	for (int ii = 0; ii < npts; ii += 2) {
+		if (!Q_Remove(tree->root, geoms[ii])) {
+			printf("failed to remove point %d\n", ii);
+			return 0;
+		}
+	}
+	if (!HelpQL_Expect(tree->root, 0, 0, 1000, 1000, LEAFMINSIZE, 0)) {
+		printf("failed to merge empty tree\n");
+		return 0;
+	}
+
+	free(geoms);
+	T_Free(tree);
+
+	return ok;
+}
+
+// Splits a quad at the centre of the review's example when it can, as
+// the right edge of the west child, left + width, rounds past it
+#define EDGECENTRE -82.2516708f
+
+void Help_SplitEdge(float *xf, float *yf, int cnt, float left, float top, float width, float height, float *centrex, float *centrey)
+{
+	Split_Mid(xf, yf, cnt, left, top, width, height, centrex, centrey);
+	if (left < EDGECENTRE && EDGECENTRE < left + width) {
+		*centrex = EDGECENTRE;
+	}
+}
+
+int TestQ_Move(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int npts = 5000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	Pt *pts = calloc(npts, sizeof(Pt));
+	Geom *found;
+	int nmoved;
+
+	assert(geoms && pts);
+
+	srand(7);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = TP_New(tree, rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+	}
+	Q_AddBatch(tree->root, geoms, npts);
+
+	for (int round = 0; round < 10; round++) {
+		// most points drift a little, every tenth jumps across the map
+		for (int ii = 0; ii < npts; ii++) {
+			pts[ii] = geoms[ii]->pt;
+			if ((ii + round) % 10 == 0) {
+				pts[ii].xf = rand() % 100000 / 100.0;
+				pts[ii].yf = rand() % 100000 / 100.0;
+			}
+			else {
+				pts[ii].xf += (rand() % 100 - 50) / 1000.0;
+				pts[ii].yf += (rand() % 100 - 50) / 1000.0;
+			}
+			pts[ii].zf = round;
+		}
+
+		nmoved = Q_Move(tree->root, geoms, pts, npts);
+		if (nmoved < npts / 10 || nmoved > npts / 2) {
+			printf("moved an unlikely number of points: %d\n", nmoved);
+			return 0;
+		}
+		if (Help_CheckTree(tree->root) != npts) {
+			printf("failed to keep tree consistent\n");
+			return 0;
+		}
+	}
+
+	for (int ii = 0; ii < npts; ii++) {
+		if (!Q_Find(tree->root, pts[ii].xf, pts[ii].yf, &found) || found->pt.zf != 9) {
+			printf("failed to find moved point %d\n", ii);
+			return 0;
+		}
+	}
+
+	// a point moved between the rounded edge of its leaf and the centre
+	// past it belongs to the next leaf, in a plain tree and a shared one
+	for (int shared = 0; shared < 2; shared++) {
+		Tree *edge = T_New(-1000, -1000, 2000, 2000);
+		T_Split(edge, Help_SplitEdge);
+		if (shared) {
+			T_Share(edge);
+		}
+		for (int ii = 0; ii <= LEAFMINSIZE; ii++) {
+			geoms[ii] = TP_New(edge, -100 - ii, ii % 2 ? -100 : 100, ii);
+			Q_Add(edge->root, geoms[ii]);
+		}
+		Quad *west = geoms[0]->quad;
+		if (edge->root->tag != QUAD_NODE || edge->root->node.centrex != EDGECENTRE || west->left + west->width <= EDGECENTRE) {
+			printf("failed to split at a centre the west edge rounds past\n");
+			return 0;
+		}
+		Pt pt = { -82.2516632f, 100, -1 };
+		if (pt.xf < EDGECENTRE || pt.xf >= west->left + west->width) {
+			printf("failed to place a point between centre and edge\n");
+			return 0;
+		}
+		if (Q_Move(edge->root, geoms, &pt, 1) != 1 || Help_CheckTree(edge->root) != LEAFMINSIZE + 1) {
+			printf("failed to move a point past the centre\n");
+			return 0;
+		}
+		if (!Q_Find(edge->root, pt.xf, pt.yf, &found) || found != geoms[0] || !Q_Remove(edge->root, geoms[0])) {
+			printf("failed to find a point moved past the centre\n");
+			return 0;
+		}
+		T_Free(edge);
+	}
+
+	free(geoms);
+	free(pts);
+	T_Free(tree);
+
+	return ok;
+}
+
+/*
+Check that a frozen tree answers every query as the tree it was made from.
+*/
+int Help_FrozenMatches(Frozen *frozen, Quad *quad, Geom **geoms, int npts)
+{
+	Geom *found;
+	Geom *qout[10];
+	int fout[10];
+	int idx, qcnt, fcnt;
+
+	for (int ii = 0; ii < npts; ii++) {
+		float xf = geoms[ii]->pt.xf;
+		float yf = geoms[ii]->pt.yf;
+		if (!Q_Find(quad, xf, yf, &found) || (idx = F_Find(frozen, xf, yf)) < 0) {
+			printf("failed to find point %d\n", ii);
+			return 0;
+		}
+		if (frozen->xf[idx] != found->pt.xf || frozen->yf[idx] != found->pt.yf || frozen->zf[idx] != found->pt.zf) {
+			printf("found a different point for %d\n", ii);
+			return 0;
+		}
+		if (frozen->geom && frozen->geom[idx] != found) {
+			printf("lost payload of point %d\n", ii);
+			return 0;
+		}
+	}
+	if (F_Find(frozen, -12345, 12345) != -1) {
+		printf("found missing point\n");
+		return 0;
+	}
+
+	for (int qq = 0; qq < 50; qq++) {
+		float xf = rand() % 1200 - 100;
+		float yf = rand() % 1200 - 100;
+		float ww = rand() % 300;
+
+		qcnt = Q_QueryRectBuf(quad, xf, yf, ww, ww, NULL, 0);
+		fcnt = F_QueryRectBuf(frozen, xf, yf, ww, ww, NULL, 0);
+		if (qcnt != fcnt) {
+			printf("window queries differ: %d != %d\n", qcnt, fcnt);
+			return 0;
+		}
+
+		qcnt = Q_Nearest(quad, xf, yf, 10, qout);
+		fcnt = F_Nearest(frozen, xf, yf, 10, fout);
+		if (qcnt != fcnt) {
+			printf("nearest queries differ: %d != %d\n", qcnt, fcnt);
+			return 0;
+		}
+		for (int jj = 0; jj < qcnt; jj++) {
+			float qx = qout[jj]->pt.xf - xf, qy = qout[jj]->pt.yf - yf;
+			float fx = frozen->xf[fout[jj]] - xf, fy = frozen->yf[fout[jj]] - yf;
+			float dq = qx * qx + qy * qy;
+			float df = fx * fx + fy * fy;
+			if (dq != df) {
+				printf("nearest neighbour %d differs\n", jj);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+int TestQ_Freeze(void)
+{
+	int ok = 1;
+
+	Tree *tree = T_New(0, 0, 1000, 1000);
+	int npts = 20000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+
+	assert(geoms);
+
+	srand(8);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = TP_New(tree, rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		Q_Add(tree->root, geoms[ii]);
+	}
+
+	Frozen *frozen = Q_Freeze(tree->root);
+	if (frozen->head->npt != npts || frozen->head->width != 1000) {
+		printf("failed to freeze tree\n");
+		return 0;
+	}
+	if (!Help_FrozenMatches(frozen, tree->root, geoms, npts)) {
+		return 0;
+	}
+	F_Free(frozen);
+
+	// an empty tree is a single empty leaf
+	Quad *quad = L_New(0, 0, 10, 10);
+	frozen = Q_Freeze(quad);
+	if (frozen->head->nnode != 1 || F_Find(frozen, 1, 1) != -1 || F_Nearest(frozen, 1, 1, 3, (int [3]) { 0 }) != 0) {
+		printf("failed to freeze empty tree\n");
+		return 0;
+	}
+	F_Free(frozen);
+
+	free(geoms);
+	T_Free(tree);
+
+	return ok;
+}
+
+int TestQ_Open(void)
+{
+	int ok = 1;
+
+	Quad *quad = L_New(0, 0, 1000, 1000);
+	int npts = 20000;
+	Geom **geoms = calloc(npts, sizeof(Geom *));
+	char path[] = "/tmp/quadtree_test.qt";
+	Frozen *frozen, *opened;
+	FILE *fp;
+
+	assert(geoms);
+
+	srand(9);
+	for (int ii = 0; ii < npts; ii++) {
+		geoms[ii] = P_New(rand() % 100000 / 100.0, rand() % 100000 / 100.0, ii);
+		Q_Add(quad, geoms[ii]);
+	}
+
+	frozen = Q_Freeze(quad);
+	if (!F_Write(frozen, path)) {
+		printf("failed to write %s\n", path);
+		return 0;
+	}
+	if ((opened = Q_Open(path)) == NULL) {
+		printf("failed to open %s\n", path);
+		return 0;
+	}
+	if (opened->mapped != frozen->head->size || opened->geom != NULL) {
+		printf("failed to map %s\n", path);
+		return 0;
+	}
+	if (memcmp(opened->head, frozen->head, frozen->head->size) != 0) {
+		printf("failed to write block intact\n");
+		return 0;
+	}
+	if (!Help_FrozenMatches(opened, quad, geoms, npts)) {
+		return 0;
+	}
+	F_Free(opened);
+	F_Free(frozen);
+
+	// truncated
+	if ((fp = fopen(path, "r+b")) == NULL || ftruncate(fileno(fp), 100) != 0) {
+		printf("failed to truncate %s\n", path);
+		return 0;
+	}
+	fclose(fp);
+	if (Q_Open(path) != NULL) {
+		printf("opened truncated file\n");
+		return 0;
+	}
+
+	if (Q_Open("/nonexistent/quadtree.qt") != NULL) {
+		printf("opened missing file\n");
+		return 0;
+	}
+
+	unlink(path);
+	free(geoms);
+	Q_Free(quad);
 
 	return ok;
 }
@@ -793,10 +3830,37 @@ int main(int argc, char **argv)
 		{ "News", TestNews },
 		{ "QL_Centre", TestQL_Centre },
 		{ "QL_Resize", TestQL_Resize },
+		{ "QL_Columns", TestQL_Columns },
+		{ "S_Kernels", TestS_Kernels },
 		{ "QL_Grow", TestQL_Grow },
 		{ "QL_SplitLarge", TestQL_SplitLarge },
 		{ "Q_Add", TestQ_Add },
 		{ "Q_Find", TestQ_Find },
+		{ "Q_Batch", TestQ_Batch },
+		{ "Q_Remove", TestQ_Remove },
+		{ "Q_Move", TestQ_Move },
+		{ "Q_Freeze", TestQ_Freeze },
+		{ "Q_Open", TestQ_Open },
+		{ "Q_QueryRect", TestQ_QueryRect },
+		{ "Q_Nearest", TestQ_Nearest },
+		{ "Q_QueryPool", TestQ_QueryPool },
+		{ "Q_Build", TestQ_Build },
+		{ "Q_BuildPool", TestQ_BuildPool },
+		{ "A_Alloc", TestA_Alloc },
+		{ "T_New", TestT_New },
+		{ "T_Share", TestT_Share },
+		{ "T_Writers", TestT_Writers },
+		{ "T_Split", TestT_Split },
+		{ "T_Hash", TestT_Hash },
+		{ "T_NewConfig", TestT_NewConfig },
+		{ "Q_Stats", TestQ_Stats },
+		{ "Q_Loose", TestQ_Loose },
+		{ "Q_SelfJoin", TestQ_SelfJoin },
+		{ "Q_Join", TestQ_Join },
+#ifdef QUAD_TRACE
+		{ "Trace", TestTrace },
+#endif
+		{ "Q_Free", TestQ_Free },
 		{ NULL, NULL }
 	};
 
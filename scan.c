@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+// almost() squares the difference in float and compares it with 0.01 as
+// a double. The largest float below 0.01 is 0.01f, so the vector kernels
+// can use <= 0.01f on float lanes and match the scalar loop exactly.
+#define ALMOSTF 0.01f
+
+int S_Always(void)
+{
+	return 1;
+}
+
+int S_FindScalar(const float *xs, const float *ys, int cnt, float xf, float yf)
+{
+	float dx, dy;
+
+	for (int ii = 0; ii < cnt; ii++) {
+		dx = xs[ii] - xf;
+		dy = ys[ii] - yf;
+		if (dx * dx < 0.01 && dy * dy < 0.01) {
+			return ii;
+		}
+	}
+
+	return -1;
+}
+
+int S_RectScalar(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx)
+{
+	int full = 0;
+
+	for (int ii = 0; ii < cnt; ii++) {
+		if (xs[ii] >= left && xs[ii] < right && ys[ii] >= top && ys[ii] < bottom) {
+			idx[full++] = ii;
+		}
+	}
+
+	return full;
+}
+
+// Finish the last cnt % width points of a vector kernel. The wide kernels
+// clear the upper register halves first: these are plain SSE code and the
+// compiler does not do it for a tail call.
+int S_FindTail(const float *xs, const float *ys, int from, int cnt, float xf, float yf)
+{
+	int ii = S_FindScalar(xs + from, ys + from, cnt - from, xf, yf);
+
+	return ii < 0 ? -1 : from + ii;
+}
+
+int S_RectTail(const float *xs, const float *ys, int from, int cnt, float left, float top, float right, float bottom, int *idx)
+{
+	int full = S_RectScalar(xs + from, ys + from, cnt - from, left, top, right, bottom, idx);
+
+	for (int ii = 0; ii < full; ii++) {
+		idx[ii] += from;
+	}
+
+	return full;
+}
+
+#ifdef SCAN_X86
+
+int S_HaveAVX512(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+int S_HaveAVX2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+int S_HaveSSE2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+int S_FindSSE2(const float *xs, const float *ys, int cnt, float xf, float yf)
+{
+	__m128 vx = _mm_set1_ps(xf);
+	__m128 vy = _mm_set1_ps(yf);
+	__m128 eps = _mm_set1_ps(ALMOSTF);
+	__m128 dx, dy;
+	int ii, mask;
+
+	for (ii = 0; ii + 4 <= cnt; ii += 4) {
+		dx = _mm_sub_ps(_mm_loadu_ps(xs + ii), vx);
+		dy = _mm_sub_ps(_mm_loadu_ps(ys + ii), vy);
+		dx = _mm_cmple_ps(_mm_mul_ps(dx, dx), eps);
+		dy = _mm_cmple_ps(_mm_mul_ps(dy, dy), eps);
+		if ((mask = _mm_movemask_ps(_mm_and_ps(dx, dy))) != 0) {
+			return ii + __builtin_ctz(mask);
+		}
+	}
+
+	return S_FindTail(xs, ys, ii, cnt, xf, yf);
+}
+
+__attribute__((target("sse2")))
+int S_RectSSE2(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx)
+{
+	__m128 vl = _mm_set1_ps(left);
+	__m128 vt = _mm_set1_ps(top);
+	__m128 vr = _mm_set1_ps(right);
+	__m128 vb = _mm_set1_ps(bottom);
+	__m128 vx, vy, in;
+	int ii, mask;
+	int full = 0;
+
+	for (ii = 0; ii + 4 <= cnt; ii += 4) {
+		vx = _mm_loadu_ps(xs + ii);
+		vy = _mm_loadu_ps(ys + ii);
+		in = _mm_and_ps(_mm_cmpge_ps(vx, vl), _mm_cmplt_ps(vx, vr));
+		in = _mm_and_ps(in, _mm_and_ps(_mm_cmpge_ps(vy, vt), _mm_cmplt_ps(vy, vb)));
+		for (mask = _mm_movemask_ps(in); mask; mask &= mask - 1) {
+			idx[full++] = ii + __builtin_ctz(mask);
+		}
+	}
+
+	return full + S_RectTail(xs, ys, ii, cnt, left, top, right, bottom, idx + full);
+}
+
+__attribute__((target("avx2")))
+int S_FindAVX2(const float *xs, const float *ys, int cnt, float xf, float yf)
+{
+	__m256 vx = _mm256_set1_ps(xf);
+	__m256 vy = _mm256_set1_ps(yf);
+	__m256 eps = _mm256_set1_ps(ALMOSTF);
+	__m256 dx, dy;
+	int ii, mask;
+
+	for (ii = 0; ii + 8 <= cnt; ii += 8) {
+		dx = _mm256_sub_ps(_mm256_loadu_ps(xs + ii), vx);
+		dy = _mm256_sub_ps(_mm256_loadu_ps(ys + ii), vy);
+		dx = _mm256_cmp_ps(_mm256_mul_ps(dx, dx), eps, _CMP_LE_OQ);
+		dy = _mm256_cmp_ps(_mm256_mul_ps(dy, dy), eps, _CMP_LE_OQ);
+		if ((mask = _mm256_movemask_ps(_mm256_and_ps(dx, dy))) != 0) {
+			return ii + __builtin_ctz(mask);
+		}
+	}
+
+	_mm256_zeroupper();
+	return S_FindTail(xs, ys, ii, cnt, xf, yf);
+}
+
+__attribute__((target("avx2")))
+int S_RectAVX2(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx)
+{
+	__m256 vl = _mm256_set1_ps(left);
+	__m256 vt = _mm256_set1_ps(top);
+	__m256 vr = _mm256_set1_ps(right);
+	__m256 vb = _mm256_set1_ps(bottom);
+	__m256 vx, vy, in;
+	int ii, mask;
+	int full = 0;
+
+	for (ii = 0; ii + 8 <= cnt; ii += 8) {
+		vx = _mm256_loadu_ps(xs + ii);
+		vy = _mm256_loadu_ps(ys + ii);
+		in = _mm256_and_ps(_mm256_cmp_ps(vx, vl, _CMP_GE_OQ), _mm256_cmp_ps(vx, vr, _CMP_LT_OQ));
+		in = _mm256_and_ps(in, _mm256_and_ps(_mm256_cmp_ps(vy, vt, _CMP_GE_OQ), _mm256_cmp_ps(vy, vb, _CMP_LT_OQ)));
+		for (mask = _mm256_movemask_ps(in); mask; mask &= mask - 1) {
+			idx[full++] = ii + __builtin_ctz(mask);
+		}
+	}
+
+	_mm256_zeroupper();
+	return full + S_RectTail(xs, ys, ii, cnt, left, top, right, bottom, idx + full);
+}
+
+__attribute__((target("avx512f")))
+int S_FindAVX512(const float *xs, const float *ys, int cnt, float xf, float yf)
+{
+	__m512 vx = _mm512_set1_ps(xf);
+	__m512 vy = _mm512_set1_ps(yf);
+	__m512 eps = _mm512_set1_ps(ALMOSTF);
+	__m512 dx, dy;
+	__mmask16 mask;
+	int ii;
+
+	for (ii = 0; ii + 16 <= cnt; ii += 16) {
+		dx = _mm512_sub_ps(_mm512_loadu_ps(xs + ii), vx);
+		dy = _mm512_sub_ps(_mm512_loadu_ps(ys + ii), vy);
+		mask = _mm512_cmp_ps_mask(_mm512_mul_ps(dx, dx), eps, _CMP_LE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, _mm512_mul_ps(dy, dy), eps, _CMP_LE_OQ);
+		if (mask) {
+			return ii + __builtin_ctz(mask);
+		}
+	}
+
+	_mm256_zeroupper();
+	return S_FindTail(xs, ys, ii, cnt, xf, yf);
+}
+
+__attribute__((target("avx512f")))
+int S_RectAVX512(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx)
+{
+	__m512 vl = _mm512_set1_ps(left);
+	__m512 vt = _mm512_set1_ps(top);
+	__m512 vr = _mm512_set1_ps(right);
+	__m512 vb = _mm512_set1_ps(bottom);
+	__m512i step = _mm512_set1_epi32(16);
+	__m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512 vx, vy;
+	__mmask16 mask;
+	int ii;
+	int full = 0;
+
+	for (ii = 0; ii + 16 <= cnt; ii += 16) {
+		vx = _mm512_loadu_ps(xs + ii);
+		vy = _mm512_loadu_ps(ys + ii);
+		mask = _mm512_cmp_ps_mask(vx, vl, _CMP_GE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, vx, vr, _CMP_LT_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, vy, vt, _CMP_GE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, vy, vb, _CMP_LT_OQ);
+		_mm512_mask_compressstoreu_epi32(idx + full, mask, lane);
+		full += __builtin_popcount(mask);
+		lane = _mm512_add_epi32(lane, step);
+	}
+
+	_mm256_zeroupper();
+	return full + S_RectTail(xs, ys, ii, cnt, left, top, right, bottom, idx + full);
+}
+
+#endif // SCAN_X86
+
+// Finds over a whole leaf of 16, 32 or 64 slots, of which the first full
+// hold points. Each is a kernel with its length fixed, so the compiler
+// unrolls it and drops the tail. Slots past full are compared too, but a
+// match there means there is none before it, as kernels report the first.
+#define SCAN_FIXED(name, find, size, attr) \
+	attr __attribute__((flatten)) \
+	int name(const float *xs, const float *ys, int full, float xf, float yf) \
+	{ \
+		int ii = find(xs, ys, size, xf, yf); \
+		return ii < full ? ii : -1; \
+	}
+
+#ifdef SCAN_X86
+SCAN_FIXED(S_Find16AVX512, S_FindAVX512, 16, __attribute__((target("avx512f"))))
+SCAN_FIXED(S_Find32AVX512, S_FindAVX512, 32, __attribute__((target("avx512f"))))
+SCAN_FIXED(S_Find64AVX512, S_FindAVX512, 64, __attribute__((target("avx512f"))))
+SCAN_FIXED(S_Find16AVX2, S_FindAVX2, 16, __attribute__((target("avx2"))))
+SCAN_FIXED(S_Find32AVX2, S_FindAVX2, 32, __attribute__((target("avx2"))))
+SCAN_FIXED(S_Find64AVX2, S_FindAVX2, 64, __attribute__((target("avx2"))))
+SCAN_FIXED(S_Find16SSE2, S_FindSSE2, 16, __attribute__((target("sse2"))))
+SCAN_FIXED(S_Find32SSE2, S_FindSSE2, 32, __attribute__((target("sse2"))))
+SCAN_FIXED(S_Find64SSE2, S_FindSSE2, 64, __attribute__((target("sse2"))))
+#endif
+SCAN_FIXED(S_Find16Scalar, S_FindScalar, 16, )
+SCAN_FIXED(S_Find32Scalar, S_FindScalar, 32, )
+SCAN_FIXED(S_Find64Scalar, S_FindScalar, 64, )
+
+Scan Scans[] = {
+#ifdef SCAN_X86
+	{ "avx512", S_HaveAVX512, S_FindAVX512, S_RectAVX512, { S_Find16AVX512, S_Find32AVX512, S_Find64AVX512 } },
+	{ "avx2", S_HaveAVX2, S_FindAVX2, S_RectAVX2, { S_Find16AVX2, S_Find32AVX2, S_Find64AVX2 } },
+	{ "sse2", S_HaveSSE2, S_FindSSE2, S_RectSSE2, { S_Find16SSE2, S_Find32SSE2, S_Find64SSE2 } },
+#endif
+	{ "scalar", S_Always, S_FindScalar, S_RectScalar, { S_Find16Scalar, S_Find32Scalar, S_Find64Scalar } },
+	{ NULL, NULL, NULL, NULL, { NULL } }
+};
+
+Scan *Scan_Kernel = NULL;
+
+// The widest kernel the cpu supports. Readers on any thread may be the
+// first to ask, so the choice is made atomically: they all pick the same.
+Scan *S_Kernel(void)
+{
+	Scan *scan = __atomic_load_n(&Scan_Kernel, __ATOMIC_ACQUIRE);
+
+	if (scan == NULL) {
+		for (scan = Scans; scan->name; scan++) {
+			if (scan->supported()) {
+				break;
+			}
+		}
+		assert(scan->name);
+		__atomic_store_n(&Scan_Kernel, scan, __ATOMIC_RELEASE);
+	}
+
+	return scan;
+}
+
+// Force a kernel, or pass NULL to go back to cpu detection
+void S_Use(Scan *scan)
+{
+	if (scan && !scan->supported()) {
+		fprintf(stderr, "BUG: S_Use: %s not supported\n", scan->name);
+		exit(1);
+	}
+
+	__atomic_store_n(&Scan_Kernel, scan, __ATOMIC_RELEASE);
+}
+
+int S_Find(const float *xs, const float *ys, int cnt, float xf, float yf)
+{
+	return S_Kernel()->find(xs, ys, cnt, xf, yf);
+}
+
+int S_Rect(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx)
+{
+	return S_Kernel()->rect(xs, ys, cnt, left, top, right, bottom, idx);
+}
+
+// The fixed find for a leaf of size slots, NULL if there is none
+ScanFixed S_Fixed(int size)
+{
+	switch (size) {
+	case 16:
+		return S_Kernel()->fixed[0];
+	case 32:
+		return S_Kernel()->fixed[1];
+	case 64:
+		return S_Kernel()->fixed[2];
+	default:
+		return NULL;
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Leaf scan kernels over the xf/yf columns of a leaf.
+//
+// find returns the index of the first point within almost() of (xf, yf),
+// or -1. rect stores the index of every point with left <= x < right and
+// top <= y < bottom in idx, which must have room for cnt entries, and
+// returns how many it stored.
+//
+// fixed are finds over a whole leaf of 16, 32 and 64 slots, of which the
+// first full hold points, with no loop tail. The slots past full must be
+// readable.
+
+typedef struct tScan Scan;
+
+typedef int (*ScanFind)(const float *xs, const float *ys, int cnt, float xf, float yf);
+typedef int (*ScanRect)(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx);
+typedef int (*ScanFixed)(const float *xs, const float *ys, int full, float xf, float yf);
+
+struct tScan {
+	char *name;
+	int (*supported)(void);
+	ScanFind find;
+	ScanRect rect;
+	ScanFixed fixed[3];	// 16, 32, 64
+};
+
+// every kernel built into the library, widest first, ending with "scalar"
+// and then a NULL name
+extern Scan Scans[];
+
+Scan *S_Kernel(void);
+void S_Use(Scan *scan);
+int S_Find(const float *xs, const float *ys, int cnt, float xf, float yf);
+int S_Rect(const float *xs, const float *ys, int cnt, float left, float top, float right, float bottom, int *idx);
+ScanFixed S_Fixed(int size);
+
+#endif // SCAN_H
@@ -0,0 +1,143 @@
+/*
+
+Compare the leaf scan kernels against the scalar almost() loop that
+QL_Find used before the columns were scanned with vector instructions.
+
+usage: scan_bench [reps]
+
+Prints one line per kernel and leaf size:
+
+	kernel size find_ns rect_ns
+
+where the times are nanoseconds per leaf scan. Every find misses, so each
+one scans the whole leaf, as a lookup of an absent point does.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scan.h"
+
+// as in quadtree.c, kept here so the compiler can inline it as it could
+// in the original QL_Find
+static int almost(float aa, float bb)
+{
+	aa = aa - bb;
+	aa = aa * aa;
+	return aa < 0.01;
+}
+
+int Bench_FindAlmost(const float *xs, const float *ys, int cnt, float xf, float yf)
+{
+	int ii;
+
+	for (ii = 0; ii < cnt; ii++) {
+		if (almost(xs[ii], xf) && almost(ys[ii], yf)) {
+			break;
+		}
+	}
+
+	return ii < cnt ? ii : -1;
+}
+
+double Bench_Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+volatile int Bench_Sink;
+
+double Bench_Find(ScanFind find, float *xs, float *ys, int cnt, int reps)
+{
+	double start = Bench_Now();
+	int sink = 0;
+
+	for (int ii = 0; ii < reps; ii++) {
+		sink += find(xs, ys, cnt, -1.0 - ii % 7, -1.0);
+	}
+	Bench_Sink = sink;
+
+	return (Bench_Now() - start) / reps;
+}
+
+double Bench_Fixed(ScanFixed find, float *xs, float *ys, int cnt, int reps)
+{
+	double start = Bench_Now();
+	int sink = 0;
+
+	for (int ii = 0; ii < reps; ii++) {
+		sink += find(xs, ys, cnt, -1.0 - ii % 7, -1.0);
+	}
+	Bench_Sink = sink;
+
+	return (Bench_Now() - start) / reps;
+}
+
+double Bench_Rect(ScanRect rect, float *xs, float *ys, int cnt, int *idx, int reps)
+{
+	double start = Bench_Now();
+	int sink = 0;
+
+	for (int ii = 0; ii < reps; ii++) {
+		sink += rect(xs, ys, cnt, 250 + ii % 7, 250, 750, 750, idx);
+	}
+	Bench_Sink = sink;
+
+	return (Bench_Now() - start) / reps;
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 16, 32, 64, 256, 1024, 4096, 16384, 0 };
+	int reps = argc > 1 ? atoi(argv[1]) : 2000000;
+	int maxsize = 16384;
+	float *xs = malloc(maxsize * sizeof(float));
+	float *ys = malloc(maxsize * sizeof(float));
+	int *idx = malloc(maxsize * sizeof(int));
+
+	if (xs == NULL || ys == NULL || idx == NULL || reps <= 0) {
+		fprintf(stderr, "usage: scan_bench [reps]\n");
+		return 1;
+	}
+
+	srand(1);
+	for (int ii = 0; ii < maxsize; ii++) {
+		xs[ii] = rand() % 100000 / 100.0;
+		ys[ii] = rand() % 100000 / 100.0;
+	}
+
+	printf("kernel size find_ns rect_ns\n");
+	for (int ss = 0; sizes[ss]; ss++) {
+		int cnt = sizes[ss];
+		// keep the work per size roughly constant
+		int nrep = (int) ((double) reps * 16 / cnt);
+		if (nrep < 100) {
+			nrep = 100;
+		}
+
+		printf("almost %d %.1f -\n", cnt, Bench_Find(Bench_FindAlmost, xs, ys, cnt, nrep));
+		for (Scan *scan = Scans; scan->name; scan++) {
+			if (!scan->supported()) {
+				continue;
+			}
+			printf("%s %d %.1f %.1f\n", scan->name, cnt,
+				Bench_Find(scan->find, xs, ys, cnt, nrep),
+				Bench_Rect(scan->rect, xs, ys, cnt, idx, nrep));
+			if (cnt <= 64) {
+				int fixed = cnt == 16 ? 0 : cnt == 32 ? 1 : 2;
+				printf("%s-fixed %d %.1f -\n", scan->name, cnt, Bench_Fixed(scan->fixed[fixed], xs, ys, cnt, nrep));
+			}
+		}
+	}
+
+	free(xs);
+	free(ys);
+	free(idx);
+
+	return 0;
+}